@@ -0,0 +1,27 @@
+#!/bin/sh
+# Times every script in scripts/ under each dispatch engine, threaded without superinstructions,
+# and threaded with the JIT.
+# usage: ./bench.sh [runs per script]
+RUNS=${1:-20}
+g++ -O2 glaux.cpp -o glaux_bench || exit 1
+
+elapsed() {
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt $RUNS ]; do
+        ./glaux_bench $1 $2 > /dev/null 2>&1
+        i=$((i+1))
+    done
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+
+printf "%-16s %12s %12s %12s %12s\n" "script" "switch(ms)" "threaded(ms)" "unfused(ms)" "jit(ms)"
+for script in scripts/*.owl; do
+    sw=$(elapsed -fs $script)
+    th=$(elapsed -f $script)
+    un=$(elapsed -fn $script)
+    jt=$(elapsed -fj $script)
+    printf "%-16s %12s %12s %12s %12s\n" $(basename $script .owl) $sw $th $un $jt
+done
+rm -f glaux_bench
@@ -94,6 +94,12 @@ class FileStringBuffer : public CharBuffer {
         }
         ~FileStringBuffer() {
 
+        }
+        string contents() {
+            string text;
+            for (auto & line : lines)
+                text += line + "\n";
+            return text;
         }
         int markStart() {
             start = str_pos;
@@ -1,4 +1,6 @@
 #!/bin/sh
 mgclex parse/ghost.mlex parse/lexer_matrix.h
+#the tables are included from every file that includes glaux.hpp, so they have to be inline
+sed -i 's/^int \(matrix\|accept\)\[/inline int \1[/' parse/lexer_matrix.h
 g++ -g glaux.cpp -o glaux
 sudo mv glaux /usr/local/bin
@@ -7,6 +7,7 @@
 #include "../vm/constpool.hpp"
 #include "scopingst.hpp"
 #include "stresolver.hpp"
+#include "fusion.hpp"
 using namespace std;
 
 
@@ -16,6 +17,11 @@ class  ByteCodeGenerator {
         vector<Instruction> code;
         int cpos;
         int highCI;
+        int funcNesting;
+        int blockNesting;
+        int fieldSites;
+        bool fuse;
+        FusionPass fusion;
         ScopingST symTable;
         STBuilder sr;
         ResolveLocals rl;
@@ -23,12 +29,10 @@ class  ByteCodeGenerator {
             return symTable.depth();
         }
         void emit(Instruction inst) {
-            if (cpos+1 == code.max_size()) {
-                code.push_back(inst);
-                cpos = code.size()-1;
-            } else {
-                code[cpos++] = inst;
+            if (cpos+1 >= code.size()) {
+                code.resize(2*code.size(), Instruction(halt));
             }
+            code[cpos++] = inst;
             if (cpos > highCI)
                 highCI = cpos;
         }
@@ -60,6 +64,8 @@ class  ByteCodeGenerator {
                 emit(Instruction(binop, n->token.getSymbol() == TK_ASSIGN_DIFF ? VM_SUB:VM_ADD));
                 genCode(n->left, true);
                 emitStore(n);
+            } else if (n->token.getSymbol() == TK_MATCHRE && n->right->expr == CONST_EXPR && n->right->token.getSymbol() == TK_STRING) {
+                emitMatchConstant(n);
             } else {
                 if (noisey) cout<<"Compiling BinOp: "<<n->token.getString()<<endl;
                 genCode(n->left,  false);
@@ -82,6 +88,15 @@ class  ByteCodeGenerator {
                 }
             }
         }
+        //a literal pattern is compiled here, once, instead of each time the match is made
+        void emitMatchConstant(astnode* n) {
+            int idx = symTable.getConstPool().insertRegex(n->right->token.getString());
+            Regex* re = symTable.getConstPool().get(idx).objval()->regex;
+            if (!re->valid())
+                cout<<re->errorMessage()<<endl;
+            genCode(n->left, false);
+            emit(Instruction(matchre, idx));
+        }
         void emitUnaryOperator(astnode* n) {
             switch (n->token.getSymbol()) {
                 case TK_INCREMENT: { 
@@ -105,7 +120,13 @@ class  ByteCodeGenerator {
                     emit(Instruction(unop, VM_NEG));
             }
         }
+        //names the symbol table never saw have no slot: they read as nil and stores to them are dropped
+        bool unresolved(SymbolTableEntry& item) {
+            return item.addr == -1 && item.type != NATIVEVAR;
+        }
         void emitLoadAddress(SymbolTableEntry& item, astnode* n) {
+            if (unresolved(item))
+                return;
             emit(Instruction(ldaddr, item.addr));
             if (noisey) cout << "LDADDR: " << n->token.getString()<<"scopelevel="<<n->token.scopeLevel() << " depth=" << item.depth<< endl;
         }
@@ -116,14 +137,18 @@ class  ByteCodeGenerator {
             if (needLvalue) {
                 emitLoadAddress(item, n);
             } else {
-                if (depth == GLOBAL_SCOPE) {
+                if (item.type == NATIVEVAR) {
+                    emit(Instruction(ldconst, item.constPoolIndex));
+                } else if (unresolved(item)) {
+                    emit(Instruction(ldconst, symTable.getConstPool().insert(StackItem())));
+                } else if (depth == GLOBAL_SCOPE) {
                     emit(Instruction(ldglobal, item.addr));
                     if (noisey) cout << "LDGLOBAL: " << n->token.getString()<<"scopelevel="<<n->token.scopeLevel() << " depth=" << item.depth<< endl;
                 } else if (depth == 0) {
                     emit(Instruction(ldlocal, item.addr));
                     if (noisey) cout << "LDLOCAL: " << n->token.getString()<<", scopelevel= "<<n->token.scopeLevel() << " depth= " <<item.depth<< endl;
                 } else {
-                    emit(Instruction(ldupval, item.addr, depth));
+                    emit(Instruction(ldupval, n->token.upvalIndex()));
                     if (noisey) cout<< "LDUPVAL: " << n->token.getString()<<", scopelevel= "<<n->token.scopeLevel() << " depth= " <<item.depth<< endl;
                 }
             }
@@ -131,14 +156,16 @@ class  ByteCodeGenerator {
         void emitStore(astnode* n) {
             SymbolTableEntry item = symTable.lookup(n->left->token.getString());
             int depth = n->left->token.scopeLevel();
-            if (depth == GLOBAL_SCOPE) {
+            if (unresolved(item)) {
+                emit(Instruction(popstack));
+            } else if (depth == GLOBAL_SCOPE) {
                 emit(Instruction(stglobal, item.addr));
                 if (noisey) cout << "STGLOBAL: " << n->left->token.getString()<<", scopelevel= "<<n->left->token.scopeLevel() << " depth= " <<item.depth << endl;
             } else if (depth == 0) {
                 emit(Instruction(stlocal, item.addr));
                 if (noisey) cout << "STLOCAL: " << n->left->token.getString()<<", scopelevel= "<<n->left->token.scopeLevel() << " depth= " << item.depth<< endl;
             } else {
-                emit(Instruction(stupval, depth));
+                emit(Instruction(stupval, n->left->token.upvalIndex()));
                 if (noisey) cout << "STUPVAL: " << n->left->token.getString()<<", scopelevel= "<<n->left->token.scopeLevel() << " depth= " << item.depth<< endl;
             }
 
@@ -148,22 +175,27 @@ class  ByteCodeGenerator {
             genExpression(n->right, false);
             emit(Instruction(isLvalue ? stidx:ldidx));
         }
+        //every ldfield/stfield gets its own inline cache in the VM, numbered by operand b.
+        //int16 runs out eventually, sites that share a cache are just slower.
+        Instruction fieldOp(VMInstruction op, int fieldname) {
+            return Instruction(op, fieldname, fieldSites++ & INT16_MAX);
+        }
         void emitFieldAccess(astnode* n, bool isLvalue) {
             if (noisey) cout<<"Emitting Field access for "<<n->left->token.getString()<<"."<<n->right->token.getString()<<endl;
             emitLoad(n->left, false);
             if (n->right->expr == ID_EXPR) {
-                int fieldname = symTable.getConstPool().insert(alloc.alloc(new string(n->right->token.getString())));
-                emit(Instruction(isLvalue ? stfield:ldfield, fieldname));
+                int fieldname = symTable.getConstPool().insertString(n->right->token.getString());
+                emit(fieldOp(isLvalue ? stfield:ldfield, fieldname));
             } else {
                 auto t = n->right;
                 while (t->expr == FIELD_EXPR) {
-                    int fieldname = symTable.getConstPool().insert(alloc.alloc(new string(t->left->token.getString())));
-                    emit(Instruction(ldfield, fieldname));
+                    int fieldname = symTable.getConstPool().insertString(t->left->token.getString());
+                    emit(fieldOp(ldfield, fieldname));
                     if (t->right->expr == FIELD_EXPR) {
                         t = t->right;
                     } else {
-                        fieldname = symTable.getConstPool().insert(alloc.alloc(new string(t->right->token.getString())));
-                        emit(Instruction(isLvalue ? stfield:ldfield, fieldname));
+                        fieldname = symTable.getConstPool().insertString(t->right->token.getString());
+                        emit(fieldOp(isLvalue ? stfield:ldfield, fieldname));
                         t = t->left;
                     }
                 }
@@ -197,10 +229,24 @@ class  ByteCodeGenerator {
                 } break;
             }
         }
+        //a call in tail position replaces the current frame, unless we are inside
+        //a block, whose frame sits between us and the function's own.
         void emitReturn(astnode* n) {
+            if (n->left != nullptr && n->left->kind == EXPRNODE && n->left->expr == FUNC_EXPR && funcNesting > 0 && blockNesting == 0) {
+                emitFunctionCall(n->left, true);
+                return;
+            }
             genCode(n->left, false);
             emit(Instruction(retfun));
         }
+        //list_append leaves the list behind for the next element of a literal, 
+        //which nothing consumes when append is used as a statement.
+        void emitExprStmt(astnode* n) {
+            genCode(n->left, false);
+            auto e = n->left;
+            if (e != nullptr && e->kind == EXPRNODE && e->expr == LIST_EXPR && e->right != nullptr && e->right->token.getSymbol() == TK_APPEND)
+                emit(Instruction(popstack));
+        }
         void emitPrint(astnode* n) {
             if (noisey) cout<<"Compiling Print Statement: "<<endl;
             genExpression(n->left, false); 
@@ -213,19 +259,19 @@ class  ByteCodeGenerator {
             switch (n->token.getSymbol()) {
                 case TK_NUM:    {
                     int idx = symTable.getConstPool().insert(StackItem(stod(n->token.getString())));
-                    emit(Instruction(ldconst, StackItem(stod(n->token.getString()))));  
+                    emit(Instruction(ldconst, idx));  
                 } break;
                 case TK_STRING: {
-                    int idx = symTable.getConstPool().insert(StackItem(n->token.getString()));
+                    int idx = symTable.getConstPool().insertString(n->token.getString());
                     emit(Instruction(ldconst, idx));  
                 } break;
                 case TK_RANDOM: {
                     double val = n->left == nullptr ? RAND_MAX:stod(n->left->token.getString());
-                    emit(Instruction(ldrand, val));  
+                    emit(Instruction(ldrand, symTable.getConstPool().insert(StackItem(val))));  
                 } break;
-                case TK_TRUE:   emit(Instruction(ldconst, true)); break;
-                case TK_FALSE:  emit(Instruction(ldconst, false)); break;
-                case TK_NIL:    emit(Instruction(ldconst));
+                case TK_TRUE:   emit(Instruction(ldconst, symTable.getConstPool().insert(StackItem(true)))); break;
+                case TK_FALSE:  emit(Instruction(ldconst, symTable.getConstPool().insert(StackItem(false)))); break;
+                case TK_NIL:    emit(Instruction(ldconst, symTable.getConstPool().insert(StackItem())));
                 default: break;
             } 
         }
@@ -236,9 +282,14 @@ class  ByteCodeGenerator {
             int L1 = skipEmit(0);
             skipEmit(1);
             string name = n->token.getString();
-            emit(Instruction(defun, name, numArgs, 0));
+            emit(Instruction(defun, symTable.getConstPool().insertString(name), numArgs));
             symTable.openFunctionScope(name, L1+1);
+            int savedBlocks = blockNesting;
+            blockNesting = 0;
+            funcNesting++;
             genCode(n->right, false);
+            funcNesting--;
+            blockNesting = savedBlocks;
             emit(Instruction(retfun));
             int cpos = skipEmit(0);
             symTable.closeScope();
@@ -261,11 +312,11 @@ class  ByteCodeGenerator {
                 genExpression(x, false);
                 if (it.get().constPoolIndex == -1)
                     it.get().constPoolIndex = symTable.getConstPool().insert(it.get().name);
-                emit(Instruction(stfield, symTable.getConstPool().get(it.get().constPoolIndex)));
+                emit(fieldOp(stfield, it.get().constPoolIndex));
                 it.next();
             }
         }
-        void emitFunctionCall(astnode* n) {
+        void emitFunctionCall(astnode* n, bool isTail) {
             if (noisey) cout<<"Compiling Function Call."<<endl;
             SymbolTableEntry fn_info = symTable.lookup(n->left->token.getString());
             int argsCount = 0;
@@ -273,13 +324,13 @@ class  ByteCodeGenerator {
                 argsCount++;
             genCode(n->right, false);
             genExpression(n->left, false);
-            emit(Instruction(call, fn_info.constPoolIndex, argsCount, n->left->token.scopeLevel()));
+            emit(Instruction(isTail ? tailcall:call, fn_info.constPoolIndex, argsCount, n->left->token.scopeLevel()));
         }
         void emitListConstructor(astnode* n) {
             emit(Instruction(mklist));
             if (n->left != nullptr) {
                 if (n->left->expr == RANGE_EXPR) {
-                    genExpression(n->left, false);
+                    emitRangeExpr(n->left, true);
                 } else {
                     for (astnode* it = n->left; it != nullptr; it = it->next) {
                         genExpression(it, false);
@@ -288,16 +339,18 @@ class  ByteCodeGenerator {
                 }
             }
         }
-        void emitRangeExpr(astnode* n) {
+        void emitRangeExpr(astnode* n, bool intoList) {
             genExpression(n->left, false);
             genExpression(n->right, false);
-            emit(Instruction(mkrange));
+            emit(Instruction(mkrange, intoList));
         }
         void emitBlock(astnode* n) {
             int L1 = skipEmit(0);
-            emit(Instruction(entblk, L1+2));
-            symTable.openFunctionScope(n->token.getString(), L1+2);
+            emit(Instruction(entblk, symTable.lookup(n->token.getString()).constPoolIndex));
+            symTable.openFunctionScope(n->token.getString(), L1+1);
+            blockNesting++;
             genCode(n->left, false);
+            blockNesting--;
             symTable.closeScope();
             emit(Instruction(retblk));
         }
@@ -307,7 +360,11 @@ class  ByteCodeGenerator {
             skipEmit(1);
             string name = n->left->token.getString();
             ClassObject* ent = symTable.lookupClass(name);
-            emit(Instruction(defstruct, ent->cpIdx, L1+1));
+            if (ent->shape == rootShape()) {
+                for (auto it = ent->scope->iter(); !it.done(); it.next())
+                    ent->shape = ent->shape->extend(it.get().name);
+            }
+            emit(Instruction(defstruct, ent->cpIdx));
             int cpos = skipEmit(0);
             skipTo(L1);
             emit(Instruction(jump, cpos));
@@ -316,7 +373,7 @@ class  ByteCodeGenerator {
         void emitStoreFuncInEnvironment(astnode* n, bool isLambda) {
             string name = n->token.getString();
             SymbolTableEntry fn_info = symTable.lookup(name);
-            emit(Instruction(mkclosure, fn_info.constPoolIndex, fn_info.depth));
+            emit(Instruction(mkclosure, fn_info.constPoolIndex));
             if (isLambda)
                 return;
             if (fn_info.depth == GLOBAL_SCOPE) {
@@ -350,6 +407,71 @@ class  ByteCodeGenerator {
             emit(Instruction(brf, L2));
             restore();
         }
+        //slots the compiler declared for itself, in whichever frame the code runs in
+        void emitLoadSlot(int addr) {
+            emit(Instruction(scopeLevel() == GLOBAL_SCOPE ? ldglobal:ldlocal, addr));
+        }
+        void emitStoreSlot(int addr) {
+            emit(Instruction(ldaddr, addr));
+            emit(Instruction(scopeLevel() == GLOBAL_SCOPE ? stglobal:stlocal, addr));
+        }
+        //lo .. hi or [lo .. hi], which a for loop counts through instead of building
+        astnode* rangeOf(astnode* n) {
+            if (n->kind == EXPRNODE && n->expr == RANGE_EXPR)
+                return n;
+            if (n->kind == EXPRNODE && n->expr == LISTCON_EXPR && n->left != nullptr && n->left->expr == RANGE_EXPR && n->left->next == nullptr)
+                return n->left;
+            return nullptr;
+        }
+        //Loops over a range keep a counter and the last number in the loop's two slots and
+        //allocate nothing, anything else gets an iterator that each steps through:
+        //    lo; hi; bounds; -> .n; -> .i          iterable; mkiter; -> .i
+        //  L1: .i; .n; binop <=; brf L2          L1: .i; each L2
+        //    .i; -> x                              -> x
+        //    body                                  body
+        //    .i; incr; -> .i                       jump L1
+        //    jump L1                             L2:
+        //  L2:
+        void emitFor(astnode* n) {
+            string loop = n->token.getString();
+            int counter = symTable.lookup(loop + ".i").addr;
+            int last = symTable.lookup(loop + ".n").addr;
+            astnode* range = rangeOf(n->left->right);
+            if (range != nullptr) {
+                genExpression(range->left, false);
+                genExpression(range->right, false);
+                emit(Instruction(bounds));
+                emitStoreSlot(last);
+                emitStoreSlot(counter);
+            } else {
+                genExpression(n->left->right, false);
+                emit(Instruction(mkiter));
+                emitStoreSlot(counter);
+            }
+            int L1 = skipEmit(0);
+            emitLoadSlot(counter);
+            if (range != nullptr) {
+                emitLoadSlot(last);
+                emit(Instruction(binop, VM_LTE));
+            }
+            int test = skipEmit(0);
+            skipEmit(1);
+            if (range != nullptr)
+                emitLoadSlot(counter);
+            emitLoad(n->left->left, true);
+            emitStore(n->left);
+            genCode(n->right, false);
+            if (range != nullptr) {
+                emitLoadSlot(counter);
+                emit(Instruction(incr));
+                emitStoreSlot(counter);
+            }
+            emit(Instruction(jump, L1));
+            int L2 = skipEmit(0);
+            skipTo(test);
+            emit(Instruction(range != nullptr ? brf:each, L2));
+            restore();
+        }
         void emitIfStmt(astnode* n) {
             if (n->right->token.getSymbol() == TK_ELSE) {
                 astnode* lrc = n->right;
@@ -402,7 +524,8 @@ class  ByteCodeGenerator {
                 case PRINT_STMT:  { emitPrint(n);      } break;
                 case RETURN_STMT: { emitReturn(n);     } break;
                 case WHILE_STMT:  { emitWhile(n);      } break;
-                case EXPR_STMT:   { genCode(n->left, false); } break;
+                case FOR_STMT:    { emitFor(n);        } break;
+                case EXPR_STMT:   { emitExprStmt(n);  } break;
                 default: break;
             };
         }
@@ -413,13 +536,13 @@ class  ByteCodeGenerator {
                 case BIN_EXPR:       { emitBinaryOperator(n); } break;
                 case UOP_EXPR:       { emitUnaryOperator(n);  } break; 
                 case LAMBDA_EXPR:    { emitLambda(n);         } break;
-                case FUNC_EXPR:      { emitFunctionCall(n);   } break;
+                case FUNC_EXPR:      { emitFunctionCall(n, false); } break;
                 case LISTCON_EXPR:   { emitListConstructor(n); } break;
                 case SUBSCRIPT_EXPR: { emitListAccess(n, needLvalue); } break;
                 case FIELD_EXPR:     { emitFieldAccess(n, needLvalue); } break;
                 case LIST_EXPR:      { emitListOperation(n); } break;
                 case BLESS_EXPR:     { emitBlessExpr(n); } break;
-                case RANGE_EXPR:     { emitRangeExpr(n); } break;
+                case RANGE_EXPR:     { emitRangeExpr(n, false); } break;
                 case TERNARY_EXPR:   { emitTernaryExpr(n); } break;
                 default:
                     break;
@@ -435,21 +558,13 @@ class  ByteCodeGenerator {
                 genCode(n->next, false);
             }
         }
-        void printOperand(StackItem& operand) {
-            switch (operand.type) {
-                case INTEGER: cout<<to_string(operand.intval); break;
-                default: cout<<"."; break;
-            }
-        }
         void printByteCode() {
             cout<<"Compiled Bytecode: "<<endl;
             int addr = 0;
             for (auto m : code) {
-                cout<<setw(2)<<addr<<": [0x"<<setw(2)<<m.op<<" "<<instrStr[m.op]<<" ";
-                printOperand(m.operand[0]);
-                cout<<" ";
-                printOperand(m.operand[1]);
-                if (m.op == call) cout<<" "<<m.operand[2].intval;
+                cout<<setw(2)<<addr<<": [0x"<<hex<<setw(2)<<setfill('0')<<(int)m.op<<dec<<setfill(' ')<<" "<<instructionToString(m);
+                if (hasConstOperand(m.op))
+                    cout<<" {"<<symTable.getConstPool().get(m.a).toString()<<"}";
                 cout<<" ]"<<endl;
                 if (m.op == halt)
                     break;
@@ -469,19 +584,40 @@ class  ByteCodeGenerator {
         }
     public:
         ByteCodeGenerator(bool debug = false) {
-            code = vector<Instruction>(1024, Instruction(halt, 0));
-            code.resize(1024);
+            code = vector<Instruction>(1024, Instruction(halt));
             cpos = 0;
             highCI = 0;
+            funcNesting = 0;
+            blockNesting = 0;
+            fieldSites = 0;
+            fuse = true;
             noisey = debug;
         }
         ConstPool& getConstPool() {
             return symTable.getConstPool();
         }
+        void setFusion(bool enabled) {
+            fuse = enabled;
+        }
+        //how much of the code page is in use, the next compile starts there
+        int codeSize() {
+            return highCI;
+        }
+        void declareNative(NativeFunction* native) {
+            symTable.declareNative(native);
+        }
+        //the global slot 'name' was given, or -1 if nothing by that name was declared at the top level
+        int globalAddress(string name) {
+            SymbolTableEntry& entry = symTable.lookup(name);
+            return entry.type == NATIVEVAR ? -1:entry.addr;
+        }
         vector<Instruction> compile(astnode* n) {
+            int first = highCI;
             sr.buildSymbolTable(n, &symTable);
             rl.resolveLocals(n, &symTable);
             genCode(n, false);
+            if (fuse)
+                cpos = highCI = fusion.run(code, first, highCI, symTable.getConstPool());
             if (noisey) {
                 printByteCode();
                 printConstPool();
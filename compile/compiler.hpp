@@ -0,0 +1,51 @@
+#ifndef compiler_driver_hpp
+#define compiler_driver_hpp
+#include "../parse/lexer.hpp"
+#include "../parse/parser.hpp"
+#include "bcgen.hpp"
+#include "../vm/builtins.hpp"
+using namespace std;
+
+// Source to bytecode. Code and constants are cumulative: every call to compile() appends to
+// the code page and constant pool of the ones before it, so later code can refer to whatever
+// earlier code declared.
+class Compiler {
+    private:
+        Lexer lexer;
+        Parser parser;
+        ByteCodeGenerator codeGen;
+    public:
+        Compiler(int verbosity = 0) {
+            if (verbosity > 0) {
+                lexer = Lexer(true);
+                parser = Parser(true);
+                codeGen = ByteCodeGenerator(true);
+            }
+            for (auto & native : builtins())
+                declareNative(native);
+        }
+        //makes a native callable from everything compiled after this
+        void declareNative(NativeFunction native) {
+            codeGen.declareNative(new NativeFunction(native));
+        }
+        ConstPool& getConstPool() {
+            return codeGen.getConstPool();
+        }
+        void setFusion(bool enabled) {
+            codeGen.setFusion(enabled);
+        }
+        int codeSize() {
+            return codeGen.codeSize();
+        }
+        int globalAddress(string name) {
+            return codeGen.globalAddress(name);
+        }
+        vector<Instruction> compile(CharBuffer* buff) {
+            return codeGen.compile(parser.parse(lexer.lex(buff)));
+        }
+        vector<Instruction> operator()(CharBuffer* buff) {
+            return compile(buff);
+        }
+};
+
+#endif
@@ -0,0 +1,291 @@
+#ifndef cppgen_hpp
+#define cppgen_hpp
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include "../vm/instruction.hpp"
+#include "../vm/constpool.hpp"
+#include "../vm/builtins.hpp"
+using namespace std;
+
+// Ahead of time compilation: turns a compiled program, its code page and constant pool,
+// into C++ source to be built against the runtime headers (g++ -O2 -I <glaux> prog.cpp).
+// Every function gets a C++ function of its own, as does the top level, which the VM
+// enters the same way it enters JIT compiled code (see VM::enterNative). Each instruction
+// becomes a direct call to the handler the interpreter would have dispatched to, branches
+// become gotos. Whatever can't be handled in place, running out of stack or reaching halt,
+// leaves the C++ code with ip set and the interpreter finishes the job, so the program
+// behaves exactly as it does under VM::run.
+class CppGenerator {
+    private:
+        vector<Instruction>* code;
+        ConstPool* constPool;
+        vector<int> owner;
+        vector<pair<int,int>> bodies;
+        map<Function*, int> functionConst;
+        string error;
+        string quote(const string& str) {
+            ostringstream out;
+            out<<'"';
+            for (unsigned char ch : str) {
+                if (ch == '"' || ch == '\\') {
+                    out<<'\\'<<ch;
+                } else if (ch < 32 || ch > 126) {
+                    char buff[8];
+                    snprintf(buff, sizeof(buff), "\\%03o", ch);
+                    out<<buff;
+                } else {
+                    out<<ch;
+                }
+            }
+            out<<'"';
+            return out.str();
+        }
+        string bits(StackItem& item) {
+            char buff[32];
+            snprintf(buff, sizeof(buff), "0x%016llxULL", (unsigned long long)item.bits);
+            return buff;
+        }
+        //a function's body runs from start_ip to where the jump in front of it skips to.
+        //Nested functions are carved out of the body of the function around them.
+        void findBodies() {
+            owner.assign(code->size(), -1);
+            bodies.clear();
+            for (int i = 0; i < constPool->size(); i++) {
+                StackItem& si = constPool->get(i);
+                if (!si.isObject() || si.objval()->type != FUNCTION)
+                    continue;
+                int start = si.objval()->func->start_ip;
+                if (start < 1 || start >= code->size() || (*code)[start-1].op != jump)
+                    continue;
+                int end = (*code)[start-1].a;
+                if (end > start && end <= code->size())
+                    bodies.push_back(make_pair(start, end));
+            }
+            sort(bodies.begin(), bodies.end(), [](pair<int,int> a, pair<int,int> b) {
+                return a.second - a.first > b.second - b.first;
+            });
+            for (int i = 0; i < bodies.size(); i++)
+                for (int j = bodies[i].first; j < bodies[i].second; j++)
+                    owner[j] = i;
+        }
+        string target(int from, int addr) {
+            if (addr >= 0 && addr < code->size() && owner[addr] == owner[from])
+                return "goto L" + to_string(addr) + ";";
+            return "{ vm->ip = " + to_string(addr) + "; return; }";
+        }
+        //C++ for the operators fusedOperation has a fast path for, on two doubles
+        string numericExpr(int op) {
+            switch (op) {
+                case VM_ADD: return "StackItem(l + r)";
+                case VM_SUB: return "StackItem(l - r)";
+                case VM_MUL: return "StackItem(l * r)";
+                case VM_DIV: return "StackItem(l / r)";
+                case VM_LT:  return "StackItem(l < r)";
+                case VM_GT:  return "StackItem(l > r)";
+                case VM_LTE: return "StackItem(l <= r)";
+                case VM_GTE: return "StackItem(l >= r)";
+                case VM_EQU: return "StackItem(l == r)";
+                case VM_NEQ: return "StackItem(l != r)";
+                default:
+                    break;
+            }
+            return "";
+        }
+        //binop, with doubles handled in place
+        string numericOperation(int op) {
+            string slow = "vm->fusedOperation(" + to_string(op) + ");";
+            if (numericExpr(op).empty())
+                return slow;
+            return "if (vm->top(0).isNumber() && vm->top(1).isNumber()) { double l = vm->top(1).numval(), r = vm->top(0).numval(); "
+                   "vm->top(1) = " + numericExpr(op) + "; vm->sp--; } else " + slow;
+        }
+        //the statement an instruction becomes, mirroring the interpreter's handlers
+        string statement(int i) {
+            Instruction& inst = (*code)[i];
+            string at = "c[" + to_string(i) + "]";
+            string setIp = "vm->ip = " + to_string(i+1) + "; ";
+            string a = to_string(inst.a);
+            switch (inst.op) {
+                case defun:       return "";
+                case ldconst:     return "vm->loadConst(" + at + ");";
+                case ldglobal:    return "vm->loadGlobal(" + at + ");";
+                case ldlocal:     return "vm->loadLocal(" + at + ");";
+                case ldupval:     return "vm->loadUpval(" + at + ");";
+                case ldaddr:      return "vm->loadAddress(" + at + ");";
+                case ldfield:     return "vm->loadField(" + at + ");";
+                case ldidx:       return "vm->loadIndexed(" + at + ");";
+                case stglobal:    return "vm->storeGlobal();";
+                case stlocal:     return "vm->storeLocal(" + at + ");";
+                case stupval:     return "vm->storeUpval(" + at + ");";
+                case stfield:     return "vm->storeField(" + at + ");";
+                case stidx:       return "vm->storeIndexed(" + at + ");";
+                case list_append: return "vm->appendList();";
+                case list_push:   return "vm->pushList();";
+                case list_len:    return "vm->listLength();";
+                case mkstruct:    return "vm->instantiate(" + at + ");";
+                case mklist:      return "vm->makeList(" + at + ");";
+                case print:       return "vm->printTopOfStack();";
+                case newline:     return "vm->out()<<endl;";
+                case popstack:    return "vm->sp--;";
+                case retblk:      return "vm->closeBlock();";
+                case unop:        return "vm->unaryOperation(" + at + ");";
+                case matchre:     return "vm->matchRegex(" + at + ");";
+                case binop:       return numericOperation(inst.a);
+                case binlocalk:   return "vm->binaryLocalConst(" + at + ");";
+                case binglobalk:  return "vm->binaryGlobalConst(" + at + ");";
+                case incrlocal:   return "vm->stepInPlace(vm->callstk->locals[" + a + "], 1);";
+                case decrlocal:   return "vm->stepInPlace(vm->callstk->locals[" + a + "], -1);";
+                case incrglobal:  return "vm->stepInPlace(vm->globals->locals[" + a + "], 1);";
+                case decrglobal:  return "vm->stepInPlace(vm->globals->locals[" + a + "], -1);";
+                case setlocal:    return "vm->callstk->locals[" + a + "] = vm->opstk[vm->sp--];";
+                case setglobal:   return "vm->globals->locals[" + a + "] = vm->opstk[vm->sp--];";
+                case entblk:      return setIp + "vm->openBlock(" + at + ");";
+                case mkclosure:   return setIp + "vm->closeOver(" + at + "); if (!vm->running) return;";
+                case call:        return setIp + "if (!VM::nativeCall(vm, &" + at + ")) return;";
+                case tailcall:    return setIp + "VM::nativeTailCall(vm, &" + at + "); return;";
+                case retfun:      return setIp + "vm->retProcedure(); return;";
+                case halt:        return "vm->ip = " + to_string(i) + "; return;";
+                case brf:         return "if (!vm->opstk[vm->sp--].boolval()) " + target(i, inst.a);
+                case each:        return "if (!vm->stepIterator()) " + target(i, inst.a);
+                case cmpbrf:
+                    return numericOperation(inst.b) + " if (!vm->opstk[vm->sp--].boolval()) " + target(i, inst.a);
+                case jump:
+                    if (inst.a <= i)
+                        return "vm->ip = " + a + "; vm->safepoint(); " + target(i, inst.a);
+                    return target(i, inst.a);
+                default:
+                    break;
+            }
+            return setIp + "vm->execute(" + at + ");";
+        }
+        void emitBody(ostream& out, string name, int body) {
+            out<<"    static void "<<name<<"(VM* vm) {\n";
+            out<<"        Instruction* c = &vm->codePage[0];\n";
+            int first = body == -1 ? 0:bodies[body].first;
+            int last = body == -1 ? code->size():bodies[body].second;
+            for (int i = first; i < last; i++) {
+                if (owner[i] != body)
+                    continue;
+                out<<"        L"<<i<<": if (vm->sp >= MAX_OP_STACK) { vm->ip = "<<i<<"; return; }";
+                out<<" "<<statement(i)<<"\n";
+            }
+            out<<"        vm->ip = "<<last<<";\n";
+            out<<"    }\n";
+        }
+        bool emitConstant(ostream& out, int i) {
+            StackItem& si = constPool->get(i);
+            if (!si.isObject()) {
+                out<<"        StackItem k"<<i<<"; k"<<i<<".bits = "<<bits(si)<<"; constant(cp, "<<i<<", k"<<i<<");\n";
+                return true;
+            }
+            GCItem* item = si.objval();
+            switch (item->type) {
+                case STRING:
+                    out<<"        constant(cp, "<<i<<", StackItem(string("<<quote(*item->strval)<<", "<<item->strval->size()<<")));\n";
+                    return true;
+                case FUNCTION: {
+                    Function* func = item->func;
+                    functionConst[func] = i;
+                    out<<"        Function* f"<<i<<" = new Function("<<quote(func->name)<<", "<<func->start_ip<<", nullptr);\n";
+                    out<<"        f"<<i<<"->nlocals = "<<func->nlocals<<";\n";
+                    for (auto & uv : func->upvalues)
+                        out<<"        f"<<i<<"->upvalues.push_back({"<<(uv.isLocal ? "true":"false")<<", "<<uv.index<<"});\n";
+                    out<<"        constant(cp, "<<i<<", StackItem(currentHeap().alloc(f"<<i<<")));\n";
+                } return true;
+                case CLOSURE: {
+                    auto it = functionConst.find(item->closure->func);
+                    if (it == functionConst.end() || !item->closure->upvalues.empty())
+                        break;
+                    out<<"        constant(cp, "<<i<<", StackItem(currentHeap().alloc<Closure>(f"<<it->second<<")));\n";
+                } return true;
+                case CLASS: {
+                    ClassObject* obj = item->object;
+                    out<<"        ClassObject* o"<<i<<" = new ClassObject("<<quote(obj->name)<<", nullptr);\n";
+                    out<<"        o"<<i<<"->cpIdx = "<<obj->cpIdx<<";\n";
+                    out<<"        o"<<i<<"->instantiated = "<<(obj->instantiated ? "true":"false")<<";\n";
+                    for (auto & field : obj->shape->names)
+                        out<<"        o"<<i<<"->shape = o"<<i<<"->shape->extend("<<quote(field)<<");\n";
+                    out<<"        o"<<i<<"->slots.resize("<<obj->slots.size()<<");\n";
+                    out<<"        constant(cp, "<<i<<", StackItem(currentHeap().alloc(o"<<i<<")));\n";
+                } return true;
+                case NATIVE: {
+                    NativeFunction* builtin = newBuiltin(item->nativeFn->name);
+                    if (builtin == nullptr)
+                        break;
+                    delete builtin;
+                    out<<"        constant(cp, "<<i<<", StackItem(currentHeap().alloc(newBuiltin("<<quote(item->nativeFn->name)<<"))));\n";
+                } return true;
+                case REGEX:
+                    out<<"        constant(cp, "<<i<<", StackItem(currentHeap().alloc(new Regex("<<quote(item->regex->pattern)<<"))));\n";
+                    return true;
+                default:
+                    break;
+            }
+            error = "constant " + to_string(i) + " (" + si.toString() + ") can't be compiled ahead of time";
+            return false;
+        }
+    public:
+        CppGenerator() : code(nullptr), constPool(nullptr) { }
+        string lastError() {
+            return error;
+        }
+        bool generate(vector<Instruction>& cp, ConstPool& pool, ostream& out) {
+            code = &cp;
+            constPool = &pool;
+            functionConst.clear();
+            findBodies();
+            ostringstream consts;
+            for (int i = 0; i < constPool->size(); i++)
+                if (!emitConstant(consts, i))
+                    return false;
+            out<<"// Generated by glaux -c, build with: g++ -O2 -I <path to glaux> <this file>\n";
+            out<<"#include \"vm/builtins.hpp\"\n";
+            out<<"using namespace std;\n\n";
+            out<<"static Instruction program[] = {\n";
+            for (auto & inst : cp)
+                out<<"    Instruction(VMInstruction("<<(int)inst.op<<"), "<<inst.a<<", "<<inst.b<<", "<<(int)inst.c<<"),\n";
+            out<<"};\n\n";
+            out<<"struct CompiledProgram {\n";
+            out<<"    static void constant(ConstPool& cp, int index, StackItem item) {\n";
+            out<<"        if (cp.insert(item) != index) {\n";
+            out<<"            cout<<\"Error: constant pool out of order at \"<<index<<endl;\n";
+            out<<"            exit(1);\n";
+            out<<"        }\n";
+            out<<"    }\n";
+            out<<"    static void loadConstants(ConstPool& cp) {\n";
+            out<<consts.str();
+            out<<"    }\n";
+            emitBody(out, "toplevel", -1);
+            for (int i = 0; i < bodies.size(); i++)
+                emitBody(out, "fn" + to_string(bodies[i].first), i);
+            out<<"    static void link(ConstPool& cp) {\n";
+            out<<"        for (int i = 0; i < cp.size(); i++) {\n";
+            out<<"            if (!cp.get(i).isObject() || cp.get(i).objval()->type != FUNCTION)\n";
+            out<<"                continue;\n";
+            out<<"            Function* func = cp.get(i).objval()->func;\n";
+            out<<"            switch (func->start_ip) {\n";
+            for (auto & body : bodies)
+                out<<"                case "<<body.first<<": func->native = (void*)fn"<<body.first<<"; break;\n";
+            out<<"                default: break;\n";
+            out<<"            }\n";
+            out<<"        }\n";
+            out<<"    }\n";
+            out<<"};\n\n";
+            out<<"int main(int argc, char* argv[]) {\n";
+            out<<"    VM vm;\n";
+            out<<"    ConstPool constPool;\n";
+            out<<"    CompiledProgram::loadConstants(constPool);\n";
+            out<<"    CompiledProgram::link(constPool);\n";
+            out<<"    vector<Instruction> code(program, program + "<<cp.size()<<");\n";
+            out<<"    vm.setConstPool(constPool);\n";
+            out<<"    vm.runCompiled(code, CompiledProgram::toplevel);\n";
+            out<<"    return 0;\n";
+            out<<"}\n";
+            return true;
+        }
+};
+
+#endif
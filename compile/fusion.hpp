@@ -0,0 +1,127 @@
+#ifndef fusion_hpp
+#define fusion_hpp
+#include <vector>
+#include "../vm/instruction.hpp"
+#include "../vm/constpool.hpp"
+using namespace std;
+
+// Peephole pass over freshly generated bytecode. The sequences below were picked from
+// the pair profile of scripts/ (glaux -fp), each one is rewritten into a single 
+// superinstruction:
+//    ldlocal x; ldconst k; binop op             -> binlocalk k x op
+//    ldglobal x; ldconst k; binop op            -> binglobalk k x op
+//    binop op; brf L                            -> cmpbrf L op
+//    ldlocal x; incr; ldaddr x; stlocal         -> incrlocal x   (decr, globals alike)
+//    ldaddr x; stlocal                          -> setlocal x    (globals alike)
+// Fused code is shorter, so jump targets and function entry points are remapped 
+// afterwards. A sequence is never fused if something jumps into the middle of it.
+class FusionPass {
+    private:
+        vector<Instruction>* code;
+        vector<bool> isTarget;
+        vector<int> newAddr;
+        int from;
+        int end;
+        bool isOp(int at, int op) {
+            return at < end && (*code)[at].op == op;
+        }
+        //instructions at+1 ... at+len-1 would disappear into the one at 'at'
+        bool fusable(int at, int len) {
+            if (at + len > end)
+                return false;
+            for (int i = at + 1; i < at + len; i++)
+                if (isTarget[i - from])
+                    return false;
+            return true;
+        }
+        void markTarget(int addr) {
+            if (addr >= from && addr <= end)
+                isTarget[addr - from] = true;
+        }
+        void findTargets(ConstPool& constPool) {
+            isTarget.assign(end - from + 1, false);
+            for (int i = from; i < end; i++) {
+                Instruction& inst = (*code)[i];
+                if (inst.op == jump || inst.op == brf || inst.op == each)
+                    markTarget(inst.a);
+            }
+            for (int i = 0; i < constPool.size(); i++) {
+                StackItem& si = constPool.get(i);
+                if (si.isObject() && si.objval()->type == FUNCTION)
+                    markTarget(si.objval()->func->start_ip);
+            }
+        }
+        //returns how many instructions were folded into 'out'
+        int match(int at, Instruction& out) {
+            Instruction* c = &(*code)[at];
+            int load = c[0].op;
+            if ((load == ldlocal || load == ldglobal) && fusable(at, 4)
+                && (isOp(at+1, incr) || isOp(at+1, decr)) && isOp(at+2, ldaddr) && c[2].a == c[0].a
+                && isOp(at+3, load == ldlocal ? stlocal:stglobal)) {
+                bool up = c[1].op == incr;
+                if (load == ldlocal) out = Instruction(up ? incrlocal:decrlocal, c[0].a);
+                else out = Instruction(up ? incrglobal:decrglobal, c[0].a);
+                return 4;
+            }
+            if ((load == ldlocal || load == ldglobal) && fusable(at, 3) && isOp(at+1, ldconst) && isOp(at+2, binop)
+                && c[0].a <= INT16_MAX && c[2].a <= INT8_MAX) {
+                out = Instruction(load == ldlocal ? binlocalk:binglobalk, c[1].a, c[0].a, c[2].a);
+                return 3;
+            }
+            if (load == binop && fusable(at, 2) && isOp(at+1, brf) && c[0].a <= INT16_MAX) {
+                out = Instruction(cmpbrf, c[1].a, c[0].a);
+                return 2;
+            }
+            if (load == ldaddr && fusable(at, 2) && (isOp(at+1, stlocal) || isOp(at+1, stglobal))) {
+                out = Instruction(c[1].op == stlocal ? setlocal:setglobal, c[0].a);
+                return 2;
+            }
+            out = c[0];
+            return 1;
+        }
+        void remap(int& addr) {
+            if (addr >= from && addr <= end)
+                addr = newAddr[addr - from];
+        }
+    public:
+        FusionPass() {
+            code = nullptr;
+        }
+        //fuses code[first, last) in place and returns where the fused code now ends.
+        //everything before 'first' has already been handed to the VM, so it's left alone.
+        int run(vector<Instruction>& cp, int first, int last, ConstPool& constPool) {
+            code = &cp;
+            from = first;
+            end = last;
+            findTargets(constPool);
+            newAddr.assign(end - from + 1, 0);
+            int out = from;
+            for (int i = from; i < end; ) {
+                Instruction fused;
+                int n = match(i, fused);
+                for (int j = 0; j < n; j++)
+                    newAddr[i + j - from] = out;
+                i += n;
+                (*code)[out++] = fused;
+            }
+            newAddr[end - from] = out;
+            for (int i = from; i < out; i++) {
+                Instruction& inst = (*code)[i];
+                if (inst.op == jump || inst.op == brf || inst.op == cmpbrf || inst.op == each) {
+                    int target = inst.a;
+                    remap(target);
+                    inst.a = target;
+                }
+            }
+            for (int i = 0; i < constPool.size(); i++) {
+                StackItem& si = constPool.get(i);
+                if (si.isObject() && si.objval()->type == FUNCTION)
+                    remap(si.objval()->func->start_ip);
+            }
+            for (int i = out; i < end; i++)
+                (*code)[i] = Instruction(halt);
+            return out;
+        }
+};
+
+#endif
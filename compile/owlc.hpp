@@ -0,0 +1,665 @@
+#ifndef owlc_hpp
+#define owlc_hpp
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../vm/builtins.hpp"
+using namespace std;
+
+// .owlc files hold a compiled program: the code page, the constant pool, and whatever the
+// compiler printed while producing them, so that a cache hit looks exactly like a compile.
+// .owli files hold the heap the standard library's top level leaves behind (see HeapImage).
+// Files are named after a hash of everything that went into them and are only valid for the
+// build that wrote them, all values are written in native byte order.
+//    header:    "OWLC", version, key, instruction count, constant count, message length,
+//               where the script's code starts, checksum of everything after the header
+//    messages:  raw bytes
+//    code:      8 bytes per Instruction
+//    constants: a kind byte each, then
+//       VALUE    - the NaN-boxed bits of a number, bool, nil or int
+//       STRING   - length, bytes
+//       FUNCTION - name, start_ip, nlocals, upvalue count, (isLocal, index) per upvalue
+//       CLOSURE  - const pool index of its function
+//       CLASS    - name, cpIdx, instantiated, field count, field names in slot order, slot count
+//       NATIVE   - name, only builtins can be cached
+//       REGEX    - pattern, compiled again when loaded
+static const uint32_t OWLC_VERSION = 6;
+static const uint64_t OWLC_HASH_BASIS = 0xcbf29ce484222325ULL;
+
+enum OwlcConstant : uint8_t {
+    OWLC_VALUE, OWLC_STRING, OWLC_FUNCTION, OWLC_CLOSURE, OWLC_CLASS, OWLC_NATIVE, OWLC_REGEX
+};
+
+struct OwlcHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t codeSize;
+    uint32_t constCount;
+    uint32_t messageBytes;
+    uint32_t entry;
+    uint64_t checksum;
+};
+
+//FNV-1a, taken a word at a time
+inline void owlcHash(uint64_t& hash, const char* data, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash ^= word;
+        hash *= 0x100000001b3ULL;
+    }
+    for (; i < len; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+}
+
+template <class T> void owlcPut(string& out, T value) {
+    out.append((char*)&value, sizeof(T));
+}
+
+inline void owlcPutString(string& out, const string& str) {
+    owlcPut<uint32_t>(out, str.size());
+    out.append(str);
+}
+
+//reads out of a mapped file, every read is bounds checked
+struct OwlcReader {
+    const char* pos;
+    const char* end;
+    bool ok;
+    template <class T> T get() {
+        T value = T();
+        if (end - pos < (long)sizeof(T)) {
+            ok = false;
+            return value;
+        }
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+    string getString() {
+        uint32_t len = get<uint32_t>();
+        if (!ok || end - pos < (long)len) {
+            ok = false;
+            return "";
+        }
+        string str(pos, len);
+        pos += len;
+        return str;
+    }
+};
+
+// Where both kinds of file live, and how they get there and back. Files are written to a
+// temporary name and renamed into place, so readers never see half a file.
+class OwlcDirectory {
+    private:
+        string dir;
+        void* mem;
+        size_t length;
+    public:
+        OwlcDirectory(string directory) : dir(directory), mem(nullptr), length(0) { }
+        ~OwlcDirectory() {
+            unmap();
+        }
+        string pathFor(uint64_t key, const char* extension) {
+            char name[40];
+            snprintf(name, sizeof(name), "%016llx.%s", (unsigned long long)key, extension);
+            return dir + "/" + name;
+        }
+        bool write(string path, const string& contents) {
+            for (size_t at = dir.find('/', 1); at != string::npos; at = dir.find('/', at + 1))
+                mkdir(dir.substr(0, at).c_str(), 0755);
+            mkdir(dir.c_str(), 0755);
+            //unique to the writer, so racing writers each rename a whole file into place
+            string tmp = path + "." + to_string(chrono::steady_clock::now().time_since_epoch().count())
+                       + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+            ofstream file(tmp, ios::binary);
+            if (!file.write(contents.data(), contents.size())) {
+                remove(tmp.c_str());
+                return false;
+            }
+            file.close();
+            return rename(tmp.c_str(), path.c_str()) == 0;
+        }
+        //maps the file, and checks that it is at least as big as its header and that the
+        //checksum stored at 'checksumAt' matches the rest of it
+        bool map(string path, size_t headerBytes, size_t checksumAt, OwlcReader& in) {
+            FILE* file = fopen(path.c_str(), "rb");
+            if (file == nullptr)
+                return false;
+            struct stat st;
+            if (fstat(fileno(file), &st) != 0 || st.st_size < (off_t)headerBytes) {
+                fclose(file);
+                return false;
+            }
+            length = st.st_size;
+            mem = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            fclose(file);
+            if (mem == MAP_FAILED) {
+                mem = nullptr;
+                return false;
+            }
+            in = { (const char*)mem, (const char*)mem + length, true };
+            uint64_t stored, checksum = OWLC_HASH_BASIS;
+            memcpy(&stored, in.pos + checksumAt, sizeof(stored));
+            owlcHash(checksum, in.pos + headerBytes, length - headerBytes);
+            return stored == checksum;
+        }
+        void unmap() {
+            if (mem != nullptr)
+                munmap(mem, length);
+            mem = nullptr;
+        }
+};
+
+class BytecodeCache {
+    private:
+        OwlcDirectory files;
+        bool putConstant(string& out, StackItem& si, map<Function*, int>& functions, int index) {
+            if (!si.isObject()) {
+                owlcPut<uint8_t>(out, OWLC_VALUE);
+                owlcPut<uint64_t>(out, si.bits);
+                return true;
+            }
+            GCItem* item = si.objval();
+            switch (item->type) {
+                case STRING:
+                    owlcPut<uint8_t>(out, OWLC_STRING);
+                    owlcPutString(out, *item->strval);
+                    return true;
+                case FUNCTION:
+                    functions[item->func] = index;
+                    owlcPut<uint8_t>(out, OWLC_FUNCTION);
+                    owlcPutString(out, item->func->name);
+                    owlcPut<int32_t>(out, item->func->start_ip);
+                    owlcPut<int32_t>(out, item->func->nlocals);
+                    owlcPut<uint32_t>(out, item->func->upvalues.size());
+                    for (auto & uv : item->func->upvalues) {
+                        owlcPut<uint8_t>(out, uv.isLocal);
+                        owlcPut<int32_t>(out, uv.index);
+                    }
+                    return true;
+                case CLOSURE: {
+                    auto it = functions.find(item->closure->func);
+                    if (it == functions.end() || !item->closure->upvalues.empty())
+                        return false;
+                    owlcPut<uint8_t>(out, OWLC_CLOSURE);
+                    owlcPut<int32_t>(out, it->second);
+                } return true;
+                case CLASS:
+                    owlcPut<uint8_t>(out, OWLC_CLASS);
+                    owlcPutString(out, item->object->name);
+                    owlcPut<int32_t>(out, item->object->cpIdx);
+                    owlcPut<uint8_t>(out, item->object->instantiated);
+                    owlcPut<uint32_t>(out, item->object->shape->names.size());
+                    for (auto & field : item->object->shape->names)
+                        owlcPutString(out, field);
+                    owlcPut<uint32_t>(out, item->object->slots.size());
+                    return true;
+                case NATIVE: {
+                    NativeFunction* builtin = newBuiltin(item->nativeFn->name);
+                    if (builtin == nullptr)
+                        return false;
+                    delete builtin;
+                    owlcPut<uint8_t>(out, OWLC_NATIVE);
+                    owlcPutString(out, item->nativeFn->name);
+                } return true;
+                case REGEX:
+                    owlcPut<uint8_t>(out, OWLC_REGEX);
+                    owlcPutString(out, item->regex->pattern);
+                    return true;
+                default:
+                    break;
+            }
+            return false;
+        }
+        StackItem getConstant(OwlcReader& in, ConstPool& constPool) {
+            switch (in.get<uint8_t>()) {
+                case OWLC_VALUE: {
+                    StackItem si;
+                    si.bits = in.get<uint64_t>();
+                    if (si.isObject())
+                        break;
+                    return si;
+                }
+                case OWLC_STRING:
+                    return StackItem(in.getString());
+                case OWLC_FUNCTION: {
+                    string name = in.getString();
+                    Function* func = new Function(name, in.get<int32_t>(), nullptr);
+                    func->nlocals = in.get<int32_t>();
+                    uint32_t count = in.get<uint32_t>();
+                    for (uint32_t i = 0; i < count && in.ok; i++) {
+                        UpvalueDesc uv;
+                        uv.isLocal = in.get<uint8_t>();
+                        uv.index = in.get<int32_t>();
+                        func->upvalues.push_back(uv);
+                    }
+                    return StackItem(currentHeap().alloc(func));
+                }
+                case OWLC_CLOSURE: {
+                    int index = in.get<int32_t>();
+                    if (index < 0 || index >= constPool.size() || !constPool.get(index).isObject()
+                        || constPool.get(index).objval()->type != FUNCTION)
+                        break;
+                    return StackItem(currentHeap().alloc<Closure>(constPool.get(index).objval()->func));
+                }
+                case OWLC_CLASS: {
+                    ClassObject* obj = new ClassObject(in.getString(), nullptr);
+                    obj->cpIdx = in.get<int32_t>();
+                    obj->instantiated = in.get<uint8_t>();
+                    uint32_t fields = in.get<uint32_t>();
+                    for (uint32_t i = 0; i < fields && in.ok; i++)
+                        obj->shape = obj->shape->extend(in.getString());
+                    obj->slots.resize(min(in.get<uint32_t>(), (uint32_t)MAX_LOCAL));
+                    return StackItem(currentHeap().alloc(obj));
+                }
+                case OWLC_NATIVE: {
+                    NativeFunction* builtin = newBuiltin(in.getString());
+                    if (builtin == nullptr)
+                        break;
+                    return StackItem(currentHeap().alloc(builtin));
+                }
+                case OWLC_REGEX:
+                    return StackItem(currentHeap().alloc(new Regex(in.getString())));
+                default:
+                    break;
+            }
+            in.ok = false;
+            return StackItem();
+        }
+    public:
+        BytecodeCache(string directory) : files(directory) { }
+        //a hash of the format version and everything the compiler was given, builtins included
+        uint64_t keyFor(vector<string> sources, bool fusion) {
+            uint64_t hash = OWLC_HASH_BASIS;
+            uint32_t version = OWLC_VERSION;
+            owlcHash(hash, (char*)&version, sizeof(version));
+            owlcHash(hash, (char*)&fusion, sizeof(fusion));
+            for (auto & native : builtins())
+                owlcHash(hash, native.name.data(), native.name.size() + 1);
+            for (auto & src : sources) {
+                uint64_t len = src.size();
+                owlcHash(hash, (char*)&len, sizeof(len));
+                owlcHash(hash, src.data(), src.size());
+            }
+            return hash;
+        }
+        //'entry' is where the script's own code starts, after the standard library's
+        bool store(uint64_t key, vector<Instruction>& code, ConstPool& constPool, const string& messages, int entry) {
+            string out;
+            OwlcHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "OWLC", 4);
+            header.version = OWLC_VERSION;
+            header.key = key;
+            header.codeSize = code.size();
+            header.constCount = constPool.size();
+            header.messageBytes = messages.size();
+            header.entry = entry;
+            header.checksum = OWLC_HASH_BASIS;
+            owlcPut(out, header);
+            out.append(messages);
+            out.append((char*)code.data(), code.size() * sizeof(Instruction));
+            map<Function*, int> functions;
+            for (int i = 0; i < constPool.size(); i++)
+                if (!putConstant(out, constPool.get(i), functions, i))
+                    return false;
+            owlcHash(header.checksum, out.data() + sizeof(header), out.size() - sizeof(header));
+            memcpy(&out[0], &header, sizeof(header));
+            return files.write(files.pathFor(key, "owlc"), out);
+        }
+        bool load(uint64_t key, vector<Instruction>& code, ConstPool& constPool, string& messages, int& entry) {
+            OwlcReader in;
+            if (!files.map(files.pathFor(key, "owlc"), sizeof(OwlcHeader), offsetof(OwlcHeader, checksum), in)) {
+                files.unmap();
+                return false;
+            }
+            OwlcHeader header = in.get<OwlcHeader>();
+            bool valid = memcmp(header.magic, "OWLC", 4) == 0 && header.version == OWLC_VERSION && header.key == key
+                      && header.entry > 0 && header.entry <= header.codeSize
+                      && (size_t)(in.end - in.pos) >= header.messageBytes + (size_t)header.codeSize * sizeof(Instruction);
+            if (valid) {
+                messages.assign(in.pos, header.messageBytes);
+                in.pos += header.messageBytes;
+                code.resize(header.codeSize);
+                memcpy(code.data(), in.pos, header.codeSize * sizeof(Instruction));
+                in.pos += header.codeSize * sizeof(Instruction);
+                entry = header.entry;
+                for (auto & inst : code)
+                    valid = valid && inst.op < NUM_OPCODES;
+                for (uint32_t i = 0; i < header.constCount && valid; i++) {
+                    StackItem si = getConstant(in, constPool);
+                    valid = in.ok && constPool.insert(si) == (int)i;
+                }
+            }
+            files.unmap();
+            return valid;
+        }
+};
+
+// A heap image is the state the standard library's top level leaves the VM in: its globals,
+// the operand stack, and every heap object they reach. Objects are numbered in the order they
+// are found and refer to each other by number, objects that are constants refer to the const
+// pool instead, so an image can be restored into any VM holding the same library's code.
+//    header:  "OWLI", version, key, code size, how many constants it refers to, ip, sp,
+//             object count, output length, checksum of everything after the header
+//    output:  whatever the library printed while it ran
+//    values:  the globals, then opstk[0..sp]
+//    objects: their GCType, then
+//       STRING  - length, bytes
+//       LIST    - count, values
+//       CLOSURE - const pool index of its function, upvalue count, upvalue object numbers
+//       UPVALUE - 0 and its closed over value, or 1 and the global slot it is still open on
+//       CLASS   - name, instantiated, field count, field names in slot order, slot values
+//       RANGE   - first, last
+//       ITERATOR - what it walks, position
+// Every value is a tag, then its bits, a const pool index, or an object number.
+enum OwliValue : uint8_t {
+    OWLI_BITS, OWLI_CONSTANT, OWLI_OBJECT
+};
+
+struct OwliHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t codeSize;
+    uint32_t constCount;
+    int32_t ip;
+    int32_t sp;
+    uint32_t objectCount;
+    uint32_t outputBytes;
+    uint64_t checksum;
+};
+
+class HeapImage {
+    private:
+        OwlcDirectory files;
+        unordered_map<GCItem*, int> constants;
+        unordered_map<Function*, int> functions;
+        unordered_map<GCItem*, uint32_t> numbering;
+        vector<GCItem*> found;
+        int constantsUsed;
+        vector<pair<StackItem*, uint32_t>> valueFixups;
+        vector<pair<GCItem**, uint32_t>> upvalueFixups;
+        uint32_t numberOf(GCItem* item) {
+            auto it = numbering.find(item);
+            if (it != numbering.end())
+                return it->second;
+            numbering[item] = found.size();
+            found.push_back(item);
+            return found.size() - 1;
+        }
+        void putValue(string& out, StackItem& si) {
+            if (!si.isObject()) {
+                owlcPut<uint8_t>(out, OWLI_BITS);
+                owlcPut<uint64_t>(out, si.bits);
+                return;
+            }
+            auto it = constants.find(si.objval());
+            if (it != constants.end()) {
+                constantsUsed = max(constantsUsed, it->second + 1);
+                owlcPut<uint8_t>(out, OWLI_CONSTANT);
+                owlcPut<int32_t>(out, it->second);
+                return;
+            }
+            owlcPut<uint8_t>(out, OWLI_OBJECT);
+            owlcPut<uint32_t>(out, numberOf(si.objval()));
+        }
+        bool putObject(string& out, GCItem* item, VM& vm) {
+            owlcPut<uint8_t>(out, item->type);
+            switch (item->type) {
+                case STRING:
+                    owlcPutString(out, *item->strval);
+                    return true;
+                case LIST:
+                    owlcPut<uint32_t>(out, item->list->size());
+                    for (auto & si : *item->list)
+                        putValue(out, si);
+                    return true;
+                case CLOSURE: {
+                    auto it = functions.find(item->closure->func);
+                    if (it == functions.end())
+                        return false;
+                    constantsUsed = max(constantsUsed, it->second + 1);
+                    owlcPut<int32_t>(out, it->second);
+                    owlcPut<uint32_t>(out, item->closure->upvalues.size());
+                    for (auto uv : item->closure->upvalues)
+                        owlcPut<uint32_t>(out, numberOf(uv));
+                } return true;
+                case UPVALUE: {
+                    Upvalue* uv = item->upval;
+                    if (uv->location == &uv->closed) {
+                        owlcPut<uint8_t>(out, 0);
+                        putValue(out, uv->closed);
+                        return true;
+                    }
+                    long slot = uv->location - vm.globals->locals;
+                    if (slot < 0 || slot >= vm.globals->nslots)
+                        return false;
+                    owlcPut<uint8_t>(out, 1);
+                    owlcPut<int32_t>(out, slot);
+                } return true;
+                case CLASS:
+                    owlcPutString(out, item->object->name);
+                    owlcPut<uint8_t>(out, item->object->instantiated);
+                    owlcPut<uint32_t>(out, item->object->shape->names.size());
+                    for (auto & field : item->object->shape->names)
+                        owlcPutString(out, field);
+                    for (auto & si : item->object->slots)
+                        putValue(out, si);
+                    return true;
+                case RANGE:
+                    owlcPut<double>(out, item->range->first);
+                    owlcPut<double>(out, item->range->last);
+                    return true;
+                case ITERATOR:
+                    putValue(out, item->iter->source);
+                    owlcPut<int32_t>(out, item->iter->position);
+                    return true;
+                default:
+                    break;
+            }
+            return false;
+        }
+        bool getValue(OwlcReader& in, StackItem& si, VM& vm, uint32_t objectCount) {
+            switch (in.get<uint8_t>()) {
+                case OWLI_BITS:
+                    si.bits = in.get<uint64_t>();
+                    return in.ok && !si.isObject();
+                case OWLI_CONSTANT: {
+                    int index = in.get<int32_t>();
+                    if (!in.ok || index < 0 || index >= vm.constPool.size() || !vm.constPool.get(index).isObject())
+                        return false;
+                    si = vm.constPool.get(index);
+                } return true;
+                case OWLI_OBJECT: {
+                    uint32_t number = in.get<uint32_t>();
+                    if (!in.ok || number >= objectCount)
+                        return false;
+                    valueFixups.push_back(make_pair(&si, number));
+                } return true;
+                default:
+                    break;
+            }
+            return false;
+        }
+        //objects go straight to the old generation: they live as long as the library does,
+        //and it means no write barriers are needed while they are wired back together
+        GCItem* getObject(OwlcReader& in, VM& vm, uint32_t objectCount) {
+            GCItem* item = nullptr;
+            switch (in.get<uint8_t>()) {
+                case STRING: {
+                    string str = in.getString();
+                    return in.ok ? currentHeap().promote(currentHeap().alloc<string>(str)):nullptr;
+                }
+                case LIST: {
+                    uint32_t count = in.get<uint32_t>();
+                    if (!in.ok || count > (uint32_t)(in.end - in.pos))
+                        return nullptr;
+                    item = currentHeap().promote(currentHeap().alloc<deque<StackItem>>());
+                    item->list->resize(count);
+                    for (auto & si : *item->list)
+                        if (!getValue(in, si, vm, objectCount))
+                            return nullptr;
+                } return item;
+                case CLOSURE: {
+                    int index = in.get<int32_t>();
+                    uint32_t count = in.get<uint32_t>();
+                    if (!in.ok || index < 0 || index >= vm.constPool.size() || !vm.constPool.get(index).isObject()
+                        || vm.constPool.get(index).objval()->type != FUNCTION || count > MAX_LOCAL)
+                        return nullptr;
+                    item = currentHeap().promote(currentHeap().alloc<Closure>(vm.constPool.get(index).objval()->func));
+                    item->closure->upvalues.resize(count);
+                    for (auto & uv : item->closure->upvalues) {
+                        uint32_t number = in.get<uint32_t>();
+                        if (!in.ok || number >= objectCount)
+                            return nullptr;
+                        upvalueFixups.push_back(make_pair(&uv, number));
+                    }
+                } return item;
+                case UPVALUE: {
+                    if (in.get<uint8_t>() == 0) {
+                        item = currentHeap().promote(currentHeap().alloc<Upvalue>((StackItem*)nullptr));
+                        item->upval->location = &item->upval->closed;
+                        return getValue(in, item->upval->closed, vm, objectCount) ? item:nullptr;
+                    }
+                    int slot = in.get<int32_t>();
+                    if (!in.ok || slot < 0 || slot >= vm.globals->nslots)
+                        return nullptr;
+                    item = currentHeap().promote(currentHeap().alloc<Upvalue>(&vm.globals->locals[slot]));
+                    vm.globals->openUpvalues.push_back(item);
+                } return item;
+                case CLASS: {
+                    string name = in.getString();
+                    uint8_t instantiated = in.get<uint8_t>();
+                    uint32_t fields = in.get<uint32_t>();
+                    if (!in.ok || fields > MAX_LOCAL)
+                        return nullptr;
+                    item = currentHeap().promote(currentHeap().alloc<ClassObject>(name, nullptr));
+                    item->object->instantiated = instantiated;
+                    for (uint32_t i = 0; i < fields && in.ok; i++)
+                        item->object->shape = item->object->shape->extend(in.getString());
+                    item->object->slots.resize(item->object->shape->size());
+                    for (auto & si : item->object->slots)
+                        if (!getValue(in, si, vm, objectCount))
+                            return nullptr;
+                } return item;
+                case RANGE: {
+                    item = currentHeap().promote(currentHeap().alloc<Range>(0.0, 0.0));
+                    item->range->first = in.get<double>();
+                    item->range->last = in.get<double>();
+                } return in.ok ? item:nullptr;
+                case ITERATOR: {
+                    item = currentHeap().promote(currentHeap().alloc<Iterator>(StackItem()));
+                    if (!getValue(in, item->iter->source, vm, objectCount))
+                        return nullptr;
+                    item->iter->position = in.get<int32_t>();
+                } return in.ok ? item:nullptr;
+                default:
+                    break;
+            }
+            return nullptr;
+        }
+    public:
+        HeapImage(string directory) : files(directory), constantsUsed(0) { }
+        //only called once the library has run to its halt, with nothing left on the call stack
+        bool store(uint64_t key, VM& vm, const string& output) {
+            if (vm.callstk != vm.globals || vm.sp < 0 || vm.sp >= MAX_OP_STACK)
+                return false;
+            for (int i = 0; i < vm.constPool.size(); i++) {
+                StackItem& si = vm.constPool.get(i);
+                if (si.isObject()) {
+                    constants[si.objval()] = i;
+                    if (si.objval()->type == FUNCTION)
+                        functions[si.objval()->func] = i;
+                }
+            }
+            string values;
+            for (int i = 0; i < vm.globals->nslots; i++)
+                putValue(values, vm.globals->locals[i]);
+            for (int i = 0; i <= vm.sp; i++)
+                putValue(values, vm.opstk[i]);
+            for (size_t i = 0; i < found.size(); i++)
+                if (!putObject(values, found[i], vm))
+                    return false;
+            string out;
+            OwliHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "OWLI", 4);
+            header.version = OWLC_VERSION;
+            header.key = key;
+            header.codeSize = vm.codePage.size();
+            header.constCount = constantsUsed;
+            header.ip = vm.ip;
+            header.sp = vm.sp;
+            header.objectCount = found.size();
+            header.outputBytes = output.size();
+            header.checksum = OWLC_HASH_BASIS;
+            owlcPut(out, header);
+            out.append(output);
+            out.append(values);
+            owlcHash(header.checksum, out.data() + sizeof(header), out.size() - sizeof(header));
+            memcpy(&out[0], &header, sizeof(header));
+            return files.write(files.pathFor(key, "owli"), out);
+        }
+        //'vm' has to hold the library's constant pool, 'codeSize' is the length of its code
+        bool load(uint64_t key, VM& vm, int codeSize, string& output) {
+            OwlcReader in;
+            if (!files.map(files.pathFor(key, "owli"), sizeof(OwliHeader), offsetof(OwliHeader, checksum), in)) {
+                files.unmap();
+                return false;
+            }
+            OwliHeader header = in.get<OwliHeader>();
+            bool valid = memcmp(header.magic, "OWLI", 4) == 0 && header.version == OWLC_VERSION && header.key == key
+                      && (int)header.codeSize == codeSize && (int)header.constCount <= vm.constPool.size()
+                      && header.ip >= 0 && header.ip <= codeSize && header.sp >= 0 && header.sp < MAX_OP_STACK
+                      && header.objectCount <= (uint32_t)(in.end - in.pos)
+                      && header.outputBytes <= (uint32_t)(in.end - in.pos);
+            vector<StackItem> values;
+            vector<GCItem*> objects;
+            if (valid) {
+                output.assign(in.pos, header.outputBytes);
+                in.pos += header.outputBytes;
+                values.resize(vm.globals->nslots + header.sp + 1);
+                for (auto & si : values)
+                    valid = valid && getValue(in, si, vm, header.objectCount);
+                for (uint32_t i = 0; i < header.objectCount && valid; i++) {
+                    objects.push_back(getObject(in, vm, header.objectCount));
+                    valid = in.ok && objects.back() != nullptr;
+                }
+                for (auto & fix : upvalueFixups)
+                    valid = valid && objects[fix.second]->type == UPVALUE;
+            }
+            files.unmap();
+            if (!valid) {
+                vm.globals->openUpvalues.clear();
+                return false;
+            }
+            for (auto & fix : valueFixups)
+                fix.first->setObject(objects[fix.second]);
+            for (auto & fix : upvalueFixups)
+                *fix.first = objects[fix.second];
+            for (int i = 0; i < vm.globals->nslots; i++)
+                vm.globals->locals[i] = values[i];
+            for (int i = 0; i <= header.sp; i++)
+                vm.opstk[i] = values[vm.globals->nslots + i];
+            vm.sp = header.sp;
+            vm.ip = header.ip;
+            return true;
+        }
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include "../vm/constpool.hpp"
 #include "../vm/callframe.hpp"
 #include "../vm/closure.hpp"
+#include "../vm/native.hpp"
 using namespace std;
 
 const unsigned int MAX_LOCALS = 255;
@@ -17,7 +18,8 @@ enum SymTableType {
     NONE = 0,
     LOCALVAR = 1,
     FUNCVAR = 2,
-    CLASSVAR = 3
+    CLASSVAR = 3,
+    NATIVEVAR = 4
 };
 
 struct SymbolTableEntry {
@@ -129,6 +131,7 @@ class ScopingST {
         ConstPool constPool;
         SymbolTableEntry nfSentinel;
         unordered_map<string, ClassObject*> objectDefs;
+        unordered_map<string, SymbolTableEntry> natives;
         int nextAddr() {
             int na = currentScope->size()+1;
             return na;
@@ -153,9 +156,9 @@ class ScopingST {
                     for (int i = 0; i < d; i++) cout<<"  ";
                     cout<<m.name<<": "<<m.addr<<", "<<m.depth<<endl;
                     if (m.type == 2) {
-                        printST(constPool.get(m.constPoolIndex).objval->closure->func->scope,d + 1);
+                        printST(constPool.get(m.constPoolIndex).objval()->closure->func->scope,d + 1);
                     } else if (m.type == 3) {
-                        printST(constPool.get(m.constPoolIndex).objval->object->scope, d+1);
+                        printST(constPool.get(m.constPoolIndex).objval()->object->scope, d+1);
                     }
                 }
             }
@@ -171,7 +174,7 @@ class ScopingST {
         void openObjectScope(string name) {
             if (currentScope->find(name) != currentScope->end()) {
                  if (currentScope->find(name).type == CLASSVAR) {
-                    BlockScope* ns = constPool.get(currentScope->find(name).constPoolIndex).objval->object->scope;
+                    BlockScope* ns = constPool.get(currentScope->find(name).constPoolIndex).objval()->object->scope;
                     currentScope = ns;
                  } else {
                     BlockScope* ns = new BlockScope(currentScope);
@@ -181,7 +184,7 @@ class ScopingST {
                 BlockScope* ns = new BlockScope(currentScope);
                 ClassObject* obj = new ClassObject(name, ns);
                 objectDefs.insert(make_pair(name, obj));
-                int constIdx = constPool.insert(alloc.alloc(obj));
+                int constIdx = constPool.insert(currentHeap().alloc(obj));
                 int envAddr = nextAddr();
                 objectDefs[name]->cpIdx = constIdx;
                 currentScope->insert(name, SymbolTableEntry(name, envAddr, constIdx, CLASSVAR, depth(currentScope)+1));
@@ -193,13 +196,16 @@ class ScopingST {
         }
         void openFunctionScope(string name, int L1) {
             if (currentScope->find(name) != currentScope->end()) {
-                BlockScope* ns = constPool.get(currentScope->find(name).constPoolIndex).objval->closure->func->scope;
-                constPool.get(currentScope->find(name).constPoolIndex).objval->closure->func->start_ip = L1;
+                Function* func = constPool.get(currentScope->find(name).constPoolIndex).objval()->closure->func;
+                BlockScope* ns = func->scope;
+                func->start_ip = L1;
+                //addresses start at 1, so a frame needs one more slot than the scope has names
+                func->nlocals = ns->size() + 1;
                 currentScope = ns;
             } else {
                 BlockScope*  ns = new BlockScope(currentScope);
-                int funcId = constPool.insert(alloc.alloc(new Function(name, L1, ns)));
-                int constIdx = constPool.insert(alloc.alloc(new Closure(constPool.get(funcId).objval->func, nullptr)));
+                int funcId = constPool.insert(currentHeap().alloc(new Function(name, L1, ns)));
+                int constIdx = constPool.insert(currentHeap().alloc<Closure>(constPool.get(funcId).objval()->func));
                 int envAddr = nextAddr();
                 currentScope->insert(name, SymbolTableEntry(name, envAddr, constIdx, FUNCVAR, depth(currentScope)+1));
                 currentScope = ns;
@@ -210,6 +216,11 @@ class ScopingST {
                 currentScope = currentScope->getEnclosing();
             }
         }
+        //natives are constants, found only once every scope has been searched
+        void declareNative(NativeFunction* native) {
+            int constIdx = constPool.insert(StackItem(currentHeap().alloc(native)));
+            natives[native->name] = SymbolTableEntry(native->name, 0, constIdx, NATIVEVAR, -1);
+        }
         void insert(string name) {
             currentScope->insert(name, SymbolTableEntry(name, nextAddr(), depth(currentScope)));
         }
@@ -223,6 +234,18 @@ class ScopingST {
                     return x->find(name);
                 x = x->getEnclosing();
             }
+            auto native = natives.find(name);
+            if (native != natives.end())
+                return native->second;
+            return nfSentinel;
+        }
+        //look name up only in the scope 'hops' levels out from the current one
+        SymbolTableEntry& lookupAt(string name, int hops) {
+            BlockScope* x = currentScope;
+            while (x != nullptr && hops-- > 0)
+                x = x->getEnclosing();
+            if (x != nullptr && x->find(name) != x->end())
+                return x->find(name);
             return nfSentinel;
         }
         ClassObject* lookupClass(string name) {
@@ -6,19 +6,22 @@
 #include <unordered_map>
 using namespace std;
 
-const int GLOBAL_SCOPE = -1;
 const int LOCAL_SCOPE = 0;
 
 class STBuilder {
     private:
         ScopingST* symTable;
+        int blockCount;
+        int lambdaCount;
+        int loopCount;
         string nameBlock() {
-            static int bnum = 0;
-            return "Block" + to_string(bnum++);
+            return "Block" + to_string(blockCount++);
+        }
+        string nameLoop() {
+            return "for" + to_string(loopCount++);
         }
         string nameLambda() {
-            static int n = 0;
-            return "lambdafunc" + to_string(n++);
+            return "lambdafunc" + to_string(lambdaCount++);
         }
         void buildStatementST(astnode* t) {
             if (t == nullptr)
@@ -64,12 +67,25 @@ class STBuilder {
                     buildSymbolTable(t->left);
                     buildSymbolTable(t->right);
                 } break;
+                //the loop variable, and two slots of the loop's own that no name in 
+                //the program can refer to, see ByteCodeGenerator::emitFor
+                case FOR_STMT: {
+                    t->token.setString(nameLoop());
+                    buildSymbolTable(t->left->right);
+                    buildExpressionST(t->left->left, true);
+                    symTable->insert(t->token.getString() + ".i");
+                    symTable->insert(t->token.getString() + ".n");
+                    buildSymbolTable(t->right);
+                } break;
                 case EXPR_STMT: {
                     buildSymbolTable(t->left);
                 } break;
                 case RETURN_STMT: {
                     buildSymbolTable(t->left);
                 } break;
+                case PRINT_STMT: {
+                    buildSymbolTable(t->left);
+                } break;
                 case STMT_LIST: {
                     buildStatementST(t->left);
                 } break;
@@ -139,7 +155,7 @@ class STBuilder {
             }
         }
     public:
-        STBuilder() { }
+        STBuilder() : blockCount(0), lambdaCount(0), loopCount(0) { }
         void buildSymbolTable(astnode* ast, ScopingST* st) {
             symTable = st;
             buildSymbolTable(ast);
@@ -151,19 +167,41 @@ class ResolveLocals {
         int scope;
         ScopingST* st;
         vector<unordered_map<string, bool>> scopes;
+        vector<Function*> funcs;
         void openScope(string name) {
             SymbolTableEntry sc_info = st->lookup(name);
             if (sc_info.type == CLASSVAR) {
                 st->openObjectScope(name);
+                funcs.push_back(nullptr);
             } else {
+                funcs.push_back(st->getConstPool().get(sc_info.constPoolIndex).objval()->closure->func);
                 st->openFunctionScope(name, -1);
             }
             scopes.push_back(unordered_map<string,bool>());
         }
         void closeScope() {
             scopes.pop_back();
+            funcs.pop_back();
             st->closeScope();
         }
+        int addUpvalue(int level, bool isLocal, int index) {
+            Function* func = funcs[level];
+            if (func == nullptr || index < 0)
+                return -1;
+            for (int i = 0; i < func->upvalues.size(); i++) {
+                if (func->upvalues[i].isLocal == isLocal && func->upvalues[i].index == index)
+                    return i;
+            }
+            func->upvalues.push_back({isLocal, index});
+            return func->upvalues.size() - 1;
+        }
+        //thread a variable declared in scopes[declLevel] through every function 
+        //between it and scopes[level], returning its upvalue index at 'level'.
+        int resolveUpvalue(int level, int declLevel, int addr) {
+            if (level - 1 == declLevel)
+                return addUpvalue(level, true, addr);
+            return addUpvalue(level, false, resolveUpvalue(level - 1, declLevel, addr));
+        }
         void declareName(string name) {
             if (scopes.empty())
                 return;
@@ -179,6 +217,10 @@ class ResolveLocals {
                 if (scopes[i].find(name) != scopes[i].end()) {
                     int depth = (scopes.size() - 1 - i);
                     t->token.setScopeLevel(depth);
+                    if (depth > 0) {
+                        int addr = st->lookupAt(name, depth).addr;
+                        t->token.setUpvalIndex(resolveUpvalue(scopes.size() - 1, i, addr));
+                    }
                     return;
                 }
             }
@@ -216,6 +258,13 @@ class ResolveLocals {
                     resolve(node->left);
                     resolve(node->right);
                 } break;
+                case FOR_STMT: {
+                    resolve(node->left->right);
+                    declareName(node->left->left->token.getString());
+                    defineName(node->left->left->token.getString());
+                    resolve(node->left->left);
+                    resolve(node->right);
+                } break;
                 case BLOCK_STMT: {
                     openScope(node->token.getString());
                     resolve(node->left);
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Runs every script in scripts/ under the interpreter and with every function compiled to
+# native code on its first call, and reports the scripts whose output differs. Scripts with
+# a file in scripts/expected/ must also print exactly that, less the warning about a missing
+# standard library. embedtest.cpp, which calls into Glaux from C++ in two translation units,
+# is built and run last.
+# usage: ./difftest.sh
+g++ -O2 glaux.cpp -o glaux_difftest || exit 1
+
+cache=$(mktemp -d)
+failed=0
+for script in scripts/*.owl; do
+    name=$(basename $script .owl)
+    GLAUX_SEED=1 GLAUX_CACHE_DIR=$cache ./glaux_difftest -f $script > /tmp/difftest.$name.interp 2>&1
+    GLAUX_SEED=1 GLAUX_CACHE_DIR=$cache GLAUX_JIT_THRESHOLD=1 ./glaux_difftest -fj $script > /tmp/difftest.$name.jit 2>&1
+    expected=scripts/expected/$name.out
+    if [ -f $expected ] && ! grep -v "^Couldnt open .*stdlib.owl" /tmp/difftest.$name.interp | cmp -s - $expected; then
+        printf "%-16s WRONG OUTPUT\n" $name
+        grep -v "^Couldnt open .*stdlib.owl" /tmp/difftest.$name.interp | diff - $expected | head -10
+        failed=1
+    elif cmp -s /tmp/difftest.$name.interp /tmp/difftest.$name.jit; then
+        printf "%-16s ok\n" $name
+    else
+        printf "%-16s DIFFERS\n" $name
+        diff /tmp/difftest.$name.interp /tmp/difftest.$name.jit | head -10
+        failed=1
+    fi
+    rm -f /tmp/difftest.$name.interp /tmp/difftest.$name.jit
+done
+rm -rf glaux_difftest $cache
+
+g++ -O2 embedtest.cpp embednatives.cpp -o glaux_embedtest || exit 1
+if ./glaux_embedtest > /tmp/difftest.embed 2>&1; then
+    printf "%-16s ok\n" embedtest
+else
+    printf "%-16s FAILED\n" embedtest
+    grep -v "^Couldnt open .*stdlib.owl" /tmp/difftest.embed | head -10
+    failed=1
+fi
+rm -f glaux_embedtest /tmp/difftest.embed
+exit $failed
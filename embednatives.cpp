@@ -0,0 +1,16 @@
+#include "glaux.hpp"
+using namespace std;
+
+// The natives embedtest.cpp registers, built separately from it: twice(f, x) calls back into
+// Glaux for f(f(x)), hostval() hands back a value from the host.
+void registerHostNatives(Interpreter& glaux) {
+    glaux.registerNative("twice", [](VM& vm, NativeArgs& args) {
+        StackItem once = vm.apply(args[0], &args[1], 1);
+        if (vm.halted())
+            return;
+        args.result = vm.apply(args[0], &once, 1);
+    });
+    glaux.registerNative("hostval", [](VM& vm, NativeArgs& args) {
+        args.result = StackItem(7);
+    });
+}
@@ -0,0 +1,89 @@
+#include <iostream>
+#include "glaux.hpp"
+using namespace std;
+
+// Drives the embedding API in glaux.hpp the way a host program would: looking globals up,
+// calling them, registering natives that call back into Glaux, and carrying on after a call
+// that fails part way through. Prints what went wrong and exits non-zero if anything did. The
+// natives are in a file of their own, so glaux.hpp is included from two translation units.
+// usage: g++ -O2 embedtest.cpp embednatives.cpp -o embedtest && ./embedtest
+
+void registerHostNatives(Interpreter& glaux);
+
+int failures = 0;
+
+void expect(string what, StackItem got, string want) {
+    string res = got.toString();
+    if (res != want) {
+        cout<<what<<": got "<<res<<", wanted "<<want<<endl;
+        failures++;
+    }
+}
+
+void expect(string what, bool ok) {
+    if (!ok) {
+        cout<<what<<endl;
+        failures++;
+    }
+}
+
+int main() {
+    Interpreter glaux;
+    registerHostNatives(glaux);
+    glaux.loadString(
+        "fn add(let a, let b) { return a + b; }\n"
+        "fn greet(let name) { return \"hello \" + name; }\n"
+        "fn fib(let n) { if (n < 2) { return n; } return fib(n-1) + fib(n-2); }\n"
+        "let count := 0;\n"
+        "fn bump() { count := count + 1; return count; }\n"
+        "fn inc(let x) { return x + 1; }\n"
+        "fn quad(let x) { return twice(&(let y) -> y * 2, x); }\n"
+        "fn fromhost() { return hostval() + 1; }\n"
+        "fn inner(let x) { return x(1); }\n"
+        "fn outer(let x) { let y := inner(x); return y + 1; }\n"
+        "fn viahost(let x) { return twice(inner, x); }\n");
+    glaux.loadString("fn sub(let a, let b) { return a - b; }\n");
+
+    int add = glaux.lookup("add");
+    expect("lookup add", add > -1);
+    expect("lookup missing", glaux.lookup("nosuchfn") == -1);
+    expect("lookup second module", glaux.lookup("sub") > -1);
+
+    expect("add by slot", glaux.call(add, {StackItem(2), StackItem(3)}), "5");
+    expect("add by name", glaux.call("add", {StackItem(40), StackItem(2)}), "42");
+    expect("greet", glaux.call("greet", {glaux.makeString("world")}), "hello world");
+    expect("fib", glaux.call("fib", {StackItem(20)}), "6765");
+    expect("sub", glaux.call("sub", {StackItem(10), StackItem(4)}), "6");
+    glaux.call("bump");
+    glaux.call("bump");
+    expect("module state", glaux.call("bump"), "3");
+
+    expect("native", glaux.call("fromhost"), "8");
+    expect("native calling back", glaux.call("quad", {StackItem(5)}), "20");
+    expect("VM::apply", glaux.machine().apply(glaux.machine().global(glaux.lookup("inc")), {StackItem(1)}).toString() == "2");
+
+    //a failed call gives back nil and leaves the interpreter as it found it
+    ostringstream errors;
+    glaux.setOutput(errors);
+    int depth = glaux.machine().callDepth();
+    for (int i = 0; i < 10000; i++) {
+        StackItem res = glaux.call("outer", {StackItem(5)});
+        expect("failed call returns nil", res.isNil() && glaux.machine().halted());
+        res = glaux.call("viahost", {StackItem(5)});
+        expect("failed callback returns nil", res.isNil() && glaux.machine().halted());
+        expect("calling a missing name returns nil", glaux.call("nosuchfn").isNil());
+        expect("failed calls unwind their frames", glaux.machine().callDepth() == depth);
+        if (failures > 0)
+            break;
+    }
+    glaux.setOutput(cout);
+    expect("failed calls report an error", errors.str().find("Fatal error") != string::npos);
+    expect("call after failures", glaux.call(add, {StackItem(20), StackItem(22)}), "42");
+    expect("state after failures", glaux.call("bump"), "4");
+    expect("not halted after success", !glaux.machine().halted());
+
+    if (failures > 0)
+        return 1;
+    cout<<"ok"<<endl;
+    return 0;
+}
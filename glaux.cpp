@@ -1,74 +1,147 @@
 #include <iostream>
 #include <cstring>
 #include <vector>
-#include <map>
-#include "parse/lexer.hpp"
-#include "parse/parser.hpp"
-#include "vm/stackitem.hpp"
-#include "compile/bcgen.hpp"
-#include "vm/vm.hpp"
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include "glaux.hpp"
+#include "compile/cppgen.hpp"
 using namespace std;
 
-class Compiler {
-    private:
-        Lexer lexer;
-        Parser parser;
-        ByteCodeGenerator codeGen;
-    public:
-        Compiler(int verbosity = 0) {
-            if (verbosity > 0) {
-                lexer = Lexer(true);
-                parser = Parser(true);
-                codeGen = ByteCodeGenerator(true);
-            }
-        }
-        ConstPool& getConstPool() {
-            return codeGen.getConstPool();
-        }
-        vector<Instruction> compile(CharBuffer* buff) {
-            return codeGen.compile(parser.parse(lexer.lex(buff)));
-        }
-        vector<Instruction> operator()(CharBuffer* buff) {
-            return compile(buff);
-        }
-};
-
-void initStdLib(Compiler& compiler, VM& vm) {
-    FileStringBuffer* fb = new FileStringBuffer();
-    fb->readFile("/usr/local/bin/vm/stdlib.owl");
-    auto code = compiler.compile(fb);
-    vm.setConstPool(compiler.getConstPool());
-    vm.run(code, 0);
-}
+//the compiler reports errors on cout, which every thread shares. Scripts are compiled one at a
+//time with cout pointed at the output of the one being compiled, then run side by side.
+mutex compileLock;
 
-void compileAndRun(CharBuffer* buff, int verbosity) {
+void compileAndRun(CharBuffer* buff, RunOptions& opts, ostream& out = cout) {
+    int verbosity = opts.verbosity;
     VM vm;
+    vm.setOutput(out);
+    configure(vm, opts);
     Compiler compiler(verbosity);
-    initStdLib(compiler, vm);
-    vector<Instruction> code = compiler.compile(buff);
+    compiler.setFusion(opts.fusion);
+    vector<Instruction> code;
+    {
+        lock_guard<mutex> lock(compileLock);
+        streambuf* shared = cout.rdbuf(out.rdbuf());
+        initStdLib(compiler, vm, opts);
+        code = compiler.compile(buff);
+        cout.rdbuf(shared);
+    }
     vm.setConstPool(compiler.getConstPool());
     vm.run(code, verbosity);
+    report(vm, opts);
 }
 
-void runScript(string filename, int verbosity) {
+//Compiled scripts are kept in the cache directory (compile/owlc.hpp), keyed by the script
+//and the standard library it was compiled against. On a hit neither of them is lexed, parsed
+//or compiled.
+void runCached(FileStringBuffer* script, RunOptions& opts) {
+    FileStringBuffer* lib = readStdLib();
+    BytecodeCache cache(opts.cacheDir);
+    uint64_t key = cache.keyFor({lib->contents(), script->contents()}, opts.fusion);
+    VM vm;
+    configure(vm, opts);
+    ConstPool constPool;
+    Compiler compiler;
+    vector<Instruction> code;
+    string messages;
+    int entry;
+    if (cache.load(key, code, constPool, messages, entry)) {
+        cout<<messages;
+        vm.setConstPool(constPool);
+    } else {
+        compiler.setFusion(opts.fusion);
+        ostringstream captured;
+        streambuf* out = cout.rdbuf(captured.rdbuf());
+        compiler.compile(lib);
+        entry = compiler.codeSize() + 1;
+        code = compiler.compile(script);
+        cout.rdbuf(out);
+        messages = captured.str();
+        cout<<messages;
+        cache.store(key, code, compiler.getConstPool(), messages, entry);
+        vm.setConstPool(compiler.getConstPool());
+    }
+    //the library's code ends with a halt, which the script's code starts over
+    vector<Instruction> libCode(code.begin(), code.begin() + entry);
+    libCode.back() = Instruction(halt);
+    runStdLib(vm, libCode, opts, stdLibKey(lib, opts));
+    vm.run(code, 0);
+    report(vm, opts);
+}
+
+void runScript(string filename, RunOptions& opts) {
+    FileStringBuffer* fb = new FileStringBuffer();
+    fb->readFile(filename);
+    if (opts.cacheDir.empty() || opts.verbosity > 0) {
+        compileAndRun(fb, opts);
+    } else {
+        runCached(fb, opts);
+    }
+}
+
+//the standard library is compiled in along with the script, see compile/cppgen.hpp
+void compileToCpp(string filename, string outfile, RunOptions& opts) {
+    Isolate isolate;
+    Compiler compiler;
+    compiler.setFusion(opts.fusion);
+    compileStdLib(compiler);
     FileStringBuffer* fb = new FileStringBuffer();
     fb->readFile(filename);
-    compileAndRun(fb, verbosity);
+    vector<Instruction> code = compiler.compile(fb);
+    CppGenerator generator;
+    ofstream out(outfile);
+    if (!out) {
+        cout<<"Couldnt open "<<outfile<<" for writing"<<endl;
+    } else if (!generator.generate(code, compiler.getConstPool(), out)) {
+        cout<<"Error: "<<generator.lastError()<<endl;
+    }
 }
 
-void runCommand(string cmd, int verbosity) {
+//every script gets a VM of its own, 'threads' of them run at once. What each one printed
+//is held on to and printed in the order the scripts were given, once they have all finished.
+void runBatch(vector<string> filenames, int threads, RunOptions& opts) {
+    vector<string> outputs(filenames.size());
+    atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < (int)filenames.size(); i = next++) {
+            FileStringBuffer* fb = new FileStringBuffer();
+            fb->readFile(filenames[i]);
+            ostringstream captured;
+            compileAndRun(fb, opts, captured);
+            outputs[i] = captured.str();
+        }
+    };
+    vector<thread> pool;
+    for (int i = 0; i < max(1, threads); i++)
+        pool.push_back(thread(worker));
+    for (auto & t : pool)
+        t.join();
+    for (auto & output : outputs)
+        cout<<output;
+}
+
+void runCommand(string cmd, RunOptions& opts) {
     cout<< "Running: "<<cmd<<endl;
     StringBuffer* sb = new StringBuffer();
     sb->init(cmd);
-    compileAndRun(sb, verbosity);
+    compileAndRun(sb, opts);
 }
 
-void repl(int vb) {
+void repl(RunOptions& opts) {
     bool looping = true;
+    int vb = opts.verbosity;
     StringBuffer* sb = new StringBuffer();
-    Compiler compiler(vb);
     VM vm;
-    initStdLib(compiler, vm);
+    vm.setDispatchMode(opts.dispatch);
+    vm.setGCPolicy(opts.gcPolicy);
+    if (opts.jit)
+        vm.enableJit(opts.jitThreshold);
+    Compiler compiler(vb);
+    compiler.setFusion(opts.fusion);
+    initStdLib(compiler, vm, opts);
     unsigned int lno = 0;
     while (looping) {
         string input;
@@ -89,19 +162,49 @@ int verbosityLevel(char *str) {
     return vlev;
 }
 
+//flags are single letters following the dash, ex: -fvv or -fs
+// v - verbosity, one level per 'v'
+// s - use the switch dispatch loop instead of the threaded one
+// g - print garbage collector statistics on exit
+// p - count which opcodes execute back to back and print the most frequent pairs on exit
+// n - don't fuse instruction sequences into superinstructions
+// j - compile hot functions to native code (x86-64 only)
+RunOptions parseOptions(char *str) {
+    RunOptions opts(verbosityLevel(str));
+    for (char *x = str; *x; x++) {
+        if (*x == 's')
+            opts.dispatch = SWITCH_DISPATCH;
+        if (*x == 'g')
+            opts.gcStats = true;
+        if (*x == 'p')
+            opts.pairProfile = true;
+        if (*x == 'n')
+            opts.fusion = false;
+        if (*x == 'j')
+            opts.jit = true;
+    }
+    return opts;
+}
+
 int main(int argc, char* argv[]) {
-    srand(time(0));
+    RunOptions opts = argc > 1 ? parseOptions(argv[1]):RunOptions();
     switch (argc) {
-        case 1: repl(0); break;
-        case 2: repl(verbosityLevel(argv[1]));
+        case 1: repl(opts); break;
+        case 2: repl(opts);
         default:
             if (argc == 3 && argv[1][0] == '-') {
                 switch (argv[1][1]) {
-                    case 'e': runCommand(argv[2], verbosityLevel(argv[1])); break;
-                    case 'f': runScript(argv[2], verbosityLevel(argv[1])); break;
+                    case 'e': runCommand(argv[2], opts); break;
+                    case 'f': runScript(argv[2], opts); break;
                     default: break;
                 }
             }
+            //glaux -c prog.owl -o prog.cpp
+            if (argc == 5 && argv[1][0] == '-' && argv[1][1] == 'c' && strcmp(argv[3], "-o") == 0)
+                compileToCpp(argv[2], argv[4], opts);
+            //glaux -b 8 a.owl b.owl ...
+            if (argc > 3 && argv[1][0] == '-' && argv[1][1] == 'b')
+                runBatch(vector<string>(argv + 3, argv + argc), atoi(argv[2]), opts);
     }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,194 @@
+#ifndef glaux_hpp
+#define glaux_hpp
+#include <iostream>
+#include <vector>
+#include <sstream>
+#include "compile/compiler.hpp"
+#include "compile/owlc.hpp"
+#include "vm/vm.hpp"
+using namespace std;
+
+inline FileStringBuffer* readStdLib() {
+    FileStringBuffer* fb = new FileStringBuffer();
+    fb->readFile("/usr/local/bin/vm/stdlib.owl");
+    return fb;
+}
+
+inline vector<Instruction> compileStdLib(Compiler& compiler) {
+    return compiler.compile(readStdLib());
+}
+
+//GLAUX_GC_GROWTH - old generation growth factor between major collections
+//GLAUX_GC_MAXHEAP - cap on the major collection threshold, in MB
+//GLAUX_GC_PAUSE   - minor collection pause target, in ms
+inline GCPolicy gcPolicyFromEnv() {
+    GCPolicy policy;
+    if (char* growth = getenv("GLAUX_GC_GROWTH"))
+        policy.heapGrowth = max(1.1, atof(growth));
+    if (char* maxHeap = getenv("GLAUX_GC_MAXHEAP"))
+        policy.maxHeap = (size_t)atol(maxHeap) << 20;
+    if (char* pause = getenv("GLAUX_GC_PAUSE"))
+        policy.pauseTargetMs = atof(pause);
+    return policy;
+}
+
+//GLAUX_JIT_THRESHOLD - calls to a function before it is compiled to native code
+inline int jitThresholdFromEnv() {
+    if (char* threshold = getenv("GLAUX_JIT_THRESHOLD"))
+        return atoi(threshold);
+    return 100;
+}
+
+//GLAUX_CACHE_DIR - where compiled scripts are kept, set it empty to turn the cache off
+inline string cacheDirFromEnv() {
+    if (char* dir = getenv("GLAUX_CACHE_DIR"))
+        return dir;
+    if (char* home = getenv("HOME"))
+        return string(home) + "/.cache/glaux";
+    return "";
+}
+
+struct RunOptions {
+    int verbosity;
+    DispatchMode dispatch;
+    bool gcStats;
+    bool pairProfile;
+    bool fusion;
+    bool jit;
+    int jitThreshold;
+    GCPolicy gcPolicy;
+    string cacheDir;
+    RunOptions(int vb = 0, DispatchMode dm = THREADED_DISPATCH) : verbosity(vb), dispatch(dm), gcStats(false), pairProfile(false), fusion(true), jit(false), jitThreshold(jitThresholdFromEnv()), gcPolicy(gcPolicyFromEnv()), cacheDir(cacheDirFromEnv()) { }
+};
+
+inline void configure(VM& vm, RunOptions& opts) {
+    vm.setDispatchMode(opts.dispatch);
+    vm.setGCPolicy(opts.gcPolicy);
+    if (opts.pairProfile)
+        vm.enablePairProfile();
+    if (opts.jit)
+        vm.enableJit(opts.jitThreshold);
+}
+
+inline void report(VM& vm, RunOptions& opts) {
+    if (opts.gcStats)
+        vm.printGCStats();
+    if (opts.pairProfile)
+        vm.printPairProfile();
+}
+
+//runs the standard library's top level, 'code' ends with its halt. Once it has run the heap it
+//left behind is saved, and later VMs restore that instead of running it (compile/owlc.hpp)
+inline void runStdLib(VM& vm, vector<Instruction> code, RunOptions& opts, uint64_t key) {
+    if (opts.cacheDir.empty()) {
+        vm.run(code, 0);
+        return;
+    }
+    HeapImage image(opts.cacheDir);
+    string output;
+    ostream& out = vm.out();
+    if (image.load(key, vm, code.size(), output)) {
+        out<<output;
+        return;
+    }
+    ostringstream captured;
+    vm.setOutput(captured);
+    vm.run(code, 0);
+    vm.setOutput(out);
+    output = captured.str();
+    out<<output;
+    HeapImage(opts.cacheDir).store(key, vm, output);
+}
+
+inline uint64_t stdLibKey(FileStringBuffer* lib, RunOptions& opts) {
+    return BytecodeCache(opts.cacheDir).keyFor({lib->contents()}, opts.fusion);
+}
+
+inline void initStdLib(Compiler& compiler, VM& vm, RunOptions& opts) {
+    FileStringBuffer* lib = readStdLib();
+    auto code = compiler.compile(lib);
+    code.resize(compiler.codeSize() + 1);
+    vm.setConstPool(compiler.getConstPool());
+    runStdLib(vm, code, opts, stdLibKey(lib, opts));
+}
+
+// Glaux embedded in a C++ program. An interpreter compiles and runs the standard library
+// once, modules loaded into it after that leave their globals behind, and the host can call
+// the functions among them as often as it likes without anything being compiled again, ie:
+//
+//   Interpreter glaux;
+//   glaux.loadFile("handlers.owl");
+//   int handler = glaux.lookup("handle");
+//   StackItem reply = glaux.call(handler, {glaux.makeString("GET /"), StackItem(42)});
+//
+// An interpreter is only ever used by one thread at a time, a service that wants more than
+// one thread running Glaux gives each of them an interpreter of its own. Nothing is cached on
+// disk unless the host sets cacheDir in the options it passes, ie: opts.cacheDir = cacheDirFromEnv();
+class Interpreter {
+    private:
+        RunOptions opts;
+        VM vm;
+        Compiler compiler;
+        static RunOptions uncached() {
+            RunOptions options;
+            options.cacheDir = "";
+            return options;
+        }
+    public:
+        Interpreter(RunOptions options = uncached()) : opts(options) {
+            configure(vm, opts);
+            compiler.setFusion(opts.fusion);
+            initStdLib(compiler, vm, opts);
+        }
+        Interpreter(const Interpreter& interpreter) = delete;
+        ~Interpreter() {
+            vm.bind();
+        }
+        //runs the module's top level, what it declares stays around for the calls that follow
+        void load(CharBuffer* source) {
+            vm.bind();
+            vector<Instruction> code = compiler.compile(source);
+            vm.setConstPool(compiler.getConstPool());
+            vm.run(code, opts.verbosity);
+        }
+        void loadFile(string filename) {
+            FileStringBuffer fb;
+            fb.readFile(filename);
+            load(&fb);
+        }
+        void loadString(string source) {
+            StringBuffer sb;
+            sb.init(source);
+            load(&sb);
+        }
+        //the global slot a module gave 'name', or -1 if none did. Slots stay put, unlike the
+        //closures in them, so look a function up once and call it by its slot after that.
+        int lookup(string name) {
+            return compiler.globalAddress(name);
+        }
+        StackItem call(int global, const vector<StackItem>& args = {}) {
+            return vm.apply(vm.global(global), args);
+        }
+        StackItem call(string name, const vector<StackItem>& args = {}) {
+            return call(lookup(name), args);
+        }
+        //makes fn callable as 'name' from modules loaded after this, ie:
+        //  glaux.registerNative("now", [](VM& vm, NativeArgs& args) { args.result = StackItem((double)time(0)); });
+        void registerNative(string name, NativeFn fn) {
+            vm.bind();
+            compiler.declareNative(NativeFunction(name, fn));
+        }
+        //strings live on the interpreter's heap, so the host makes them through it
+        StackItem makeString(string value) {
+            vm.bind();
+            return StackItem(value);
+        }
+        void setOutput(ostream& out) {
+            vm.setOutput(out);
+        }
+        VM& machine() {
+            return vm;
+        }
+};
+
+#endif
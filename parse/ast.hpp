@@ -16,7 +16,7 @@ enum ExprType {
     RANGE_EXPR, TERNARY_EXPR
 };
 
-string exprTypeStr[] = {
+inline string exprTypeStr[] = {
     "CONST_EXPR", "ID_EXPR", "BIN_EXPR", "UOP_EXPR", "FUNC_EXPR", "LAMBDA_EXPR",
     "LISTCON_EXPR", "SUBSCRIPT_EXPR", "LIST_EXPR", "BLESS_EXPR", "FIELD_EXPR",
     "RANGE_EXPR", "TERNARY_EXPR"
@@ -25,13 +25,13 @@ string exprTypeStr[] = {
 
 enum StmtType {
     PRINT_STMT, WHILE_STMT, IF_STMT, ELSE_STMT, STMT_LIST, EXPR_STMT,
-    LET_STMT, RETURN_STMT, DEF_CLASS_STMT, BLOCK_STMT
+    LET_STMT, RETURN_STMT, DEF_CLASS_STMT, BLOCK_STMT, FOR_STMT
 };
 
-string stmtTypeStr[] = { 
+inline string stmtTypeStr[] = { 
     "PRINT_STMT", "WHILE_STMT", "IF_STMT", "ELSE_STMT", "STMT_LIST", "EXPR_STMT",
-    "LET_STMT", "RETURN_STMT", "DEF_CLASS_STMT", "BLOCK_STMT"
-    
+    "LET_STMT", "RETURN_STMT", "DEF_CLASS_STMT", "BLOCK_STMT", "FOR_STMT"
+
 };
 
 struct astnode {
@@ -49,7 +49,7 @@ struct astnode {
     astnode() : token(Token(TK_EOI, "fin")), left(nullptr), right(nullptr), next(nullptr) { }
 };
 
-void preorder(astnode* node, int d) {
+inline void preorder(astnode* node, int d) {
     if (node != nullptr) {
             for (int i = 0; i < d; i++) cout<<" ";
             cout<<"[";
@@ -20,13 +20,13 @@ class Lexer {
         vector<Token> lex(CharBuffer* buffer);
 };
 
-Lexer::Lexer(bool dbg = false) { noisey = dbg; }
+inline Lexer::Lexer(bool dbg = false) { noisey = dbg; }
 
-Token Lexer::makeLexToken(TKSymbol symbol, char* text, int length) {
+inline Token Lexer::makeLexToken(TKSymbol symbol, char* text, int length) {
     return Token(symbol, string(text, length));
 }
 
-Token Lexer::nextToken() {
+inline Token Lexer::nextToken() {
     int state = 1;
     int last_match = 0;
     int match_len = 0;
@@ -58,16 +58,18 @@ Token Lexer::nextToken() {
     return Token((TKSymbol)accept[last_match], buffer->sliceFromStart(match_len), buffer->lineNo());
 }
 
-bool Lexer::shouldSkip(char c) {
+inline bool Lexer::shouldSkip(char c) {
     return (c == ' ' || c == '\t' || c == '\r' || c == '\n'); 
 }
 
-vector<Token> Lexer::lex(CharBuffer* buff) {
+inline vector<Token> Lexer::lex(CharBuffer* buff) {
     buffer = buff;
     in_comment = false;
     vector<Token> tokens;
     for (; !buffer->done();) { 
-        while (shouldSkip(buffer->get())) buffer->advance();
+        while (!buffer->done() && shouldSkip(buffer->get())) buffer->advance();
+        if (buffer->done())
+            break;
         Token next;
         next = nextToken();
         if (next.getSymbol() == TK_OPEN_COMMENT) {
@@ -336,6 +336,25 @@ class Parser {
             match(TK_RCURLY);
             return n;
         }
+        //for (x in xs) { ... }, left is the 'x in xs' and right the body
+        astnode* parseForStmt() {
+            astnode* n = new astnode(FOR_STMT, current());
+            match(TK_FOR);
+            match(TK_LPAREN);
+            if (expect(TK_LET))
+                match(TK_LET);
+            astnode* var = new astnode(ID_EXPR, current());
+            match(TK_ID);
+            n->left = new astnode(BIN_EXPR, current());
+            match(TK_IN);
+            n->left->left = var;
+            n->left->right = expression();
+            match(TK_RPAREN);
+            match(TK_LCURLY);
+            n->right = stmt_list();
+            match(TK_RCURLY);
+            return n;
+        }
         astnode* parseVarDec() {
             astnode* n = new astnode(LET_STMT, current());
             match(TK_LET);
@@ -409,6 +428,7 @@ class Parser {
                 case TK_CLASS:    n = parseClassDef();break;
                 case TK_IF:       n = parseIfStmt(); break;
                 case TK_WHILE:    n = parseWhileStmt();break;
+                case TK_FOR:      n = parseForStmt(); break;
                 case TK_FN:       n = parseFuncDef(); break;
                 case TK_LET:      n = parseVarDec(); break;
                 case TK_LCURLY:   n = parseBlock(); break;
@@ -9,15 +9,18 @@ class Token {
         TKSymbol symbol;
         string strval;
         int depth;
+        int upval;
         int lineNum;
     public:
-        Token(TKSymbol sym = TK_EOI, string st = "<nil>", int ln = 0) : symbol(sym), strval(st), depth(-1), lineNum(ln) { }
+        Token(TKSymbol sym = TK_EOI, string st = "<nil>", int ln = 0) : symbol(sym), strval(st), depth(-1), upval(-1), lineNum(ln) { }
         TKSymbol getSymbol() { return symbol; }
         string getString() { return strval; }
         void setString(string s) { strval = s; }
         void setSymbol(TKSymbol s) { symbol = s; }
         int scopeLevel() { return depth; }
         void setScopeLevel(int level) { depth = level; }
+        int upvalIndex() { return upval; }
+        void setUpvalIndex(int idx) { upval = idx; }
         void setLineNum(int ln) { lineNum = ln; }
         int lineNumber() { return lineNum; }
 };
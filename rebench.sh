@@ -0,0 +1,56 @@
+#!/bin/sh
+# Times =~ over a few megabytes of text with a handful of patterns and reports the throughput
+# of the matcher alone, the time taken to build the text is measured separately and taken off.
+# Matching stops at the first newline or once nothing can match, so the text has none and
+# the patterns keep going to its end.
+# usage: ./rebench.sh [matches per pattern]
+RUNS=${1:-10}
+g++ -O2 glaux.cpp -o glaux_rebench || exit 1
+dir=$(mktemp -d)
+
+# words: 55 bytes doubled 16 times, 3.4MB
+words='let text := "the quick brown fox jumps over the lazy dog 0123456789 ";
+let i := 0;
+while (i < 16) { text := text + text; i++; }'
+
+# coins: 8K random a/b doubled 9 times, 4MB that no small DFA covers
+coins='let seed := "a";
+let i := 0;
+while (i < 8192) { if (random(2) < 1) { seed := seed + "a"; } else { seed := seed + "b"; } i++; }
+let text := seed;
+i := 0;
+while (i < 9) { text := text + text; i++; }'
+
+script() {
+    cat > $dir/$1.owl <<EOF
+$2
+let r := 0;
+while (r < $3) { text =~ "$4"; r++; }
+println len(text);
+EOF
+}
+
+elapsed() {
+    start=$(date +%s%N)
+    bytes=$(GLAUX_CACHE_DIR= GLAUX_SEED=1 ./glaux_rebench -f $1 2>/dev/null | tail -1)
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 )) $bytes
+}
+
+bench() {
+    script setup "$1" 0 "$2"
+    script match "$1" $RUNS "$2"
+    set -- "$2" $(elapsed $dir/setup.owl) $(elapsed $dir/match.owl)
+    ms=$(( $4 - $2 ))
+    [ $ms -gt 0 ] || ms=1
+    printf "%10s %10s %10s  %s\n" $3 $ms $(( $3 * $RUNS / 1000 / $ms )) "$1"
+}
+
+printf "%10s %10s %10s  %s\n" "bytes" "match(ms)" "MB/s" "pattern"
+bench "$words" "[a-z0-9 ]*"
+bench "$words" "(the|quick|brown|fox|jumps|over|lazy|dog| |[0-9])*"
+bench "$words" "(.*o.*e)*"
+bench "$words" ".*fatal error.*"
+bench "$coins" "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)"
+bench "$coins" "((a|b)(a|b))*"
+rm -rf $dir glaux_rebench
@@ -0,0 +1,38 @@
+#include <iostream>
+#include <chrono>
+#include "vm/vm.hpp"
+using namespace std;
+
+// Times the StackItem traffic at the heart of the interpreter: values pushed onto an operand
+// stack, popped back off and added, the way ldconst/ldlocal/binop move them, with no dispatch
+// around it. Numbers and integers are timed separately since they take different paths in add().
+// usage: g++ -O2 stackbench.cpp -o stackbench && ./stackbench [millions of ops]
+
+StackItem opstk[MAX_OP_STACK];
+
+double elapsed(StackItem a, StackItem b, long ops, StackItem& result) {
+    auto start = chrono::steady_clock::now();
+    int sp = -1;
+    opstk[++sp] = a;
+    for (long i = 0; i < ops; i++) {
+        opstk[++sp] = b;
+        StackItem rhs = opstk[sp--];
+        opstk[sp].add(rhs);
+        if ((i & 1023) == 0)
+            opstk[sp] = a;
+    }
+    result = opstk[sp];
+    auto end = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    long ops = (argc > 1 ? atol(argv[1]):20) * 1000000;
+    StackItem result;
+    double num = elapsed(StackItem(0.5), StackItem(1.25), ops, result);
+    cout<<"number:  "<<num<<"ms ("<<result.toString()<<")"<<endl;
+    double integer = elapsed(StackItem(1), StackItem(2), ops, result);
+    cout<<"integer: "<<integer<<"ms ("<<result.toString()<<")"<<endl;
+    cout<<"sizeof(StackItem): "<<sizeof(StackItem)<<endl;
+    return 0;
+}
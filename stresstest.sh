@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs several copies of every script in scripts/ at once, each in a VM of its own on a pool
+# of threads, and checks that what they print matches running them one after another. Every
+# VM seeds its own generator from GLAUX_SEED, so scripts using random() print the same either way.
+# usage: ./stresstest.sh [threads] [copies of each script]
+THREADS=${1:-8}
+COPIES=${2:-4}
+g++ -O2 -pthread glaux.cpp -o glaux_stress || exit 1
+
+scripts=""
+for script in scripts/*.owl; do
+    i=0
+    while [ $i -lt $COPIES ]; do
+        scripts="$scripts $script"
+        i=$((i+1))
+    done
+done
+
+cache=$(mktemp -d)
+GLAUX_SEED=1 GLAUX_CACHE_DIR= ./glaux_stress -b 1 $scripts > /tmp/stresstest.sequential 2>&1
+GLAUX_SEED=1 GLAUX_CACHE_DIR=$cache ./glaux_stress -b $THREADS $scripts > /tmp/stresstest.concurrent 2>&1
+failed=0
+if cmp -s /tmp/stresstest.sequential /tmp/stresstest.concurrent; then
+    echo "ok: $(echo $scripts | wc -w) scripts on $THREADS threads"
+else
+    echo "DIFFERS"
+    diff /tmp/stresstest.sequential /tmp/stresstest.concurrent | head -10
+    failed=1
+fi
+rm -rf glaux_stress $cache /tmp/stresstest.sequential /tmp/stresstest.concurrent
+exit $failed
@@ -1,101 +1,219 @@
 #ifndef alloc_hpp
 #define alloc_hpp
 #include <iostream>
-#include <unordered_set>
-#include <deque>
+#include <vector>
+#include <new>
+#include <utility>
 #include "heapitem.hpp"
+#include "pageheap.hpp"
 using namespace std;
 
+static const size_t NURSERY_BYTES = 1 << 20;
+static const size_t MIN_NURSERY_BYTES = 64 * 1024;
 
+static_assert(sizeof(GCItem) == 16, "GCItem is expected to fit the smallest size class");
+
+inline char* payloadOf(GCItem* item) {
+    return (char*)item + sizeof(GCItem);
+}
+
+//moves a payload stored inline in 'from' into the cell 'to', payloads allocated 
+//outside of the heap just keep their address.
+template <class T>
+T* relocate(T* payload, GCItem* from, GCItem* to) {
+    if ((char*)payload != payloadOf(from))
+        return payload;
+    T* moved = new (payloadOf(to)) T(std::move(*payload));
+    payload->~T();
+    return moved;
+}
+
+template <class T>
+void destroyPayload(T* payload, GCItem* item) {
+    if (payload == nullptr)
+        return;
+    if ((char*)payload == payloadOf(item)) {
+        payload->~T();
+    } else {
+        delete payload;
+    }
+}
+
+// New objects are bump allocated out of the nursery, with strings, lists, closures, upvalues,
+// ranges, iterators and class instances constructed inline right behind their GCItem. Objects which survive a 
+// minor collection are moved into the old generation's PageHeap, leaving a FORWARD cell 
+// behind, so the nursery can be reset wholesale once the collector is done. Old objects 
+// which are made to point at young ones are kept in the remembered set.
 class GCAllocator {
     private:
         friend class GarbageCollector;
-        unordered_set<GCObject*> live_items;
-        deque<GCItem*> free_list;
-        GCItem* next() {
-            GCItem* x = nullptr;
-            if (free_list.empty()) {
-                x = new GCItem();
-            } else {
-                x = free_list.front();
-                free_list.pop_front();
+        PageHeap heap;
+        char* nursery;
+        char* nurseryTop;
+        char* nurseryEnd;
+        bool nurseryExhausted;
+        vector<GCItem*> remembered;
+        //the nursery stays full until the next safepoint, so overflow goes straight 
+        //to the old generation.
+        GCItem* next(int cls, bool& overflow) {
+            overflow = nurseryTop + cellSize[cls] > nurseryEnd;
+            if (overflow) {
+                nurseryExhausted = true;
+                return heap.allocate(cls);
             }
-            x->marked = false;
-            x->isAR = false;
+            GCItem* x = (GCItem*)nurseryTop;
+            nurseryTop += cellSize[cls];
             return x;
         }
+        GCItem* place(GCItem* x, int cls, bool overflow) {
+            x->cls = cls;
+            //its fields aren't set yet, so an overflowed object is remembered up front.
+            if (overflow)
+                remember(x);
+            return x;
+        }
+        void remember(GCItem* x) {
+            x->remembered = true;
+            remembered.push_back(x);
+        }
+        //payloads of cells left in the nursery after evacuation are garbage.
+        void resetNursery() {
+            for (char* p = nursery; p < nurseryTop; p += cellSize[((GCItem*)p)->cls]) {
+                GCItem* x = (GCItem*)p;
+                if (x->type != FORWARD)
+                    freePayload(x);
+            }
+            nurseryTop = nursery;
+            nurseryExhausted = false;
+        }
     public:
         GCAllocator() {
-
+            nursery = (char*)aligned_alloc(16, NURSERY_BYTES);
+            nurseryTop = nursery;
+            nurseryEnd = nursery + NURSERY_BYTES;
+            nurseryExhausted = false;
         }
-        void free(GCItem* item) {
-            if (item == nullptr)
+        //whatever is still alive when the heap goes away goes with it
+        ~GCAllocator() {
+            resetNursery();
+            ::free(nursery);
+        }
+        GCAllocator(const GCAllocator& allocator) = delete;
+        bool isYoung(GCItem* item) {
+            return (char*)item >= nursery && (char*)item < nursery + NURSERY_BYTES;
+        }
+        //set once an allocation no longer fits the nursery, the VM collects at its next safepoint.
+        bool collectionRequested() {
+            return nurseryExhausted;
+        }
+        size_t nurseryBytes() {
+            return nurseryEnd - nursery;
+        }
+        //only takes effect while the nursery is empty, ie right after a minor collection.
+        void setNurseryBytes(size_t bytes) {
+            if (nurseryTop != nursery)
                 return;
-            switch (item->type) {
-                case STRING: {
-                    if (item->strval)
-                        delete item->strval;
-                } break;
-                case LIST: {
-                    if (item->list)
-                        delete item->list;
-                } break;
-                case CLOSURE: {
-                    freeClosure(item->closure);
-                } break;
-                case CLASS: {
-                    freeClass(item->object);
-                } break;
-                case FUNCTION: {
-                    freeFunction(item->func);
-                }
-            };
-            item->type = NILPTR;
-            free_list.push_back(item);
-        }
-        GCItem* alloc(string* s) {
-            GCItem* x = next();
-            x->type = STRING;
-            x->strval = s;
-            live_items.insert(x);
-            return x;
+            bytes = min(NURSERY_BYTES, max(MIN_NURSERY_BYTES, bytes));
+            nurseryEnd = nursery + bytes;
         }
-        GCItem* alloc(Closure* c) {
-            GCItem* x = next();
-            x->type = CLOSURE;
-            x->closure = c;
-            live_items.insert(x);
+        //moves obj to the old generation, the collector uses this for survivors and the 
+        //constant pool for objects that are going to live as long as the program does.
+        GCItem* promote(GCItem* obj) {
+            if (obj == nullptr || !isYoung(obj))
+                return obj;
+            if (obj->type == FORWARD)
+                return obj->forward;
+            GCItem* x = heap.allocate(obj->cls);
+            switch (obj->type) {
+                case STRING:   new (x) GCItem(relocate(obj->strval, obj, x)); break;
+                case LIST:     new (x) GCItem(relocate(obj->list, obj, x)); break;
+                case CLOSURE:  new (x) GCItem(relocate(obj->closure, obj, x)); break;
+                case UPVALUE:  new (x) GCItem(relocate(obj->upval, obj, x)); break;
+                case CLASS:    new (x) GCItem(relocate(obj->object, obj, x)); break;
+                case FUNCTION: new (x) GCItem(obj->func); break;
+                case REF:      new (x) GCItem(obj->reference); break;
+                case NATIVE:   new (x) GCItem(obj->nativeFn); break;
+                case REGEX:    new (x) GCItem(obj->regex); break;
+                case RANGE:    new (x) GCItem(relocate(obj->range, obj, x)); break;
+                case ITERATOR: new (x) GCItem(relocate(obj->iter, obj, x)); break;
+                default:       new (x) GCItem(); break;
+            }
+            x->cls = obj->cls;
+            obj->type = FORWARD;
+            obj->forward = x;
             return x;
         }
-        GCItem* alloc(Function* f) {
-            GCItem* x = next();
-            x->type = FUNCTION;
-            x->func = f;
-            live_items.insert(x);
-            return x;
+        //has to be called whenever a reference is stored into a heap object, 
+        //stores into frames and the operand stack are covered by them being roots.
+        void writeBarrier(GCItem* container, StackItem& value);
+        bool isMarked(GCItem* item) {
+            return heap.isMarked(item);
         }
-        GCItem* alloc(deque<StackItem>* l) {
-            GCItem* x = next();
-            x->type = LIST;
-            x->list = l;
-            live_items.insert(x);
-            return x;
+        void mark(GCItem* item) {
+            heap.mark(item);
+        }
+        void free(GCItem* item) {
+            if (item == nullptr || isYoung(item))
+                return;
+            heap.release(item);
+        }
+        //constructs a T inline in a fresh cell, ie: currentHeap().alloc<string>("glaux")
+        template <class T, class... Args>
+        GCItem* alloc(Args&&... args) {
+            constexpr int cls = sizeClassFor(sizeof(GCItem) + sizeof(T));
+            static_assert(cls >= 0, "payload too large for the heap's size classes");
+            bool overflow;
+            GCItem* x = next(cls, overflow);
+            T* payload = new (payloadOf(x)) T(std::forward<Args>(args)...);
+            new (x) GCItem(payload);
+            return place(x, cls, overflow);
+        }
+        //functions, class definitions, natives and compiled regexes are shared with the compiler, so they stay where they are.
+        GCItem* alloc(Function* f) {
+            bool overflow;
+            GCItem* x = next(0, overflow);
+            new (x) GCItem(f);
+            return place(x, 0, overflow);
         }
         GCItem* alloc(ClassObject* l) {
-            GCItem* x = next();
-            x->type = CLASS;
-            x->object = l;
-            live_items.insert(x);
-            return x;
+            bool overflow;
+            GCItem* x = next(0, overflow);
+            new (x) GCItem(l);
+            return place(x, 0, overflow);
+        }
+        GCItem* alloc(NativeFunction* n) {
+            bool overflow;
+            GCItem* x = next(0, overflow);
+            new (x) GCItem(n);
+            return place(x, 0, overflow);
         }
-        void registerObject(GCObject* obj) {
-            live_items.insert(obj);
+        GCItem* alloc(Regex* re) {
+            bool overflow;
+            GCItem* x = next(0, overflow);
+            new (x) GCItem(re);
+            return place(x, 0, overflow);
         }
-        unordered_set<GCObject*>& getLiveList() {
-            return live_items;
+        PageHeap& oldGeneration() {
+            return heap;
         }
 };
 
-GCAllocator alloc;
+inline void freePayload(GCItem* item) {
+    switch (item->type) {
+        case STRING:   destroyPayload(item->strval, item); break;
+        case LIST:     destroyPayload(item->list, item); break;
+        case CLOSURE:  destroyPayload(item->closure, item); break;
+        case CLASS:    destroyPayload(item->object, item); break;
+        case FUNCTION: destroyPayload(item->func, item); break;
+        case UPVALUE:  destroyPayload(item->upval, item); break;
+        case NATIVE:   destroyPayload(item->nativeFn, item); break;
+        case RANGE:    destroyPayload(item->range, item); break;
+        case ITERATOR: destroyPayload(item->iter, item); break;
+        case REGEX:    destroyPayload(item->regex, item); break;
+        default:
+            break;
+    }
+    item->type = NILPTR;
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,172 @@
+#ifndef builtins_hpp
+#define builtins_hpp
+#include <algorithm>
+#include "vm.hpp"
+using namespace std;
+
+// The natives every program can call without declaring them. They sit outside of the global
+// scope, so anything a program (or the standard library) declares by the same name wins.
+
+//a fresh list in the result slot, where the collector can see it
+inline void resultList(NativeArgs& args) {
+    args.result = StackItem(currentHeap().alloc<deque<StackItem>>());
+}
+
+inline void appendResult(NativeArgs& args, StackItem value) {
+    args.result.objval()->list->push_back(value);
+    currentHeap().writeBarrier(args.result.objval(), value);
+}
+
+//natives that call back into Glaux check for the function first, rather than applying
+//whatever happens to be on the stack past the arguments they were given
+inline bool callableArg(VM& vm, NativeArgs& args, int i, string name) {
+    if (vm.isCallable(args.arg(i)))
+        return true;
+    vm.fail(name + " expects a function as argument " + to_string(i+1) + ".");
+    return false;
+}
+
+//len(xs) - how many elements a list has, characters a string, or numbers a range
+inline void nativeLen(VM& vm, NativeArgs& args) {
+    if (args.list(0) != nullptr) {
+        args.result = StackItem((double)args.list(0)->size());
+    } else if (args.str(0) != nullptr) {
+        args.result = StackItem((double)args.str(0)->size());
+    } else if (args.arg(0).isObject() && args.arg(0).objval()->type == RANGE) {
+        args.result = StackItem((double)args.arg(0).objval()->range->size());
+    }
+}
+
+//map(xs, f) - a new list of f(x) for every x in xs
+inline void nativeMap(VM& vm, NativeArgs& args) {
+    if (args.list(0) == nullptr || !callableArg(vm, args, 1, "map"))
+        return;
+    resultList(args);
+    for (int i = 0; args.list(0) != nullptr && i < args.list(0)->size(); i++) {
+        StackItem x = args.list(0)->at(i);
+        StackItem fx = vm.apply(args.arg(1), &x, 1);
+        if (vm.halted())
+            return;
+        appendResult(args, fx);
+    }
+}
+
+//filter(xs, f) - a new list of the x in xs for which f(x) is true
+inline void nativeFilter(VM& vm, NativeArgs& args) {
+    if (args.list(0) == nullptr || !callableArg(vm, args, 1, "filter"))
+        return;
+    resultList(args);
+    for (int i = 0; args.list(0) != nullptr && i < args.list(0)->size(); i++) {
+        StackItem x = args.list(0)->at(i);
+        bool keep = vm.apply(args.arg(1), &x, 1).boolval();
+        if (vm.halted())
+            return;
+        if (keep && i < args.list(0)->size())
+            appendResult(args, args.list(0)->at(i));
+    }
+}
+
+//reduce(xs, f, init) - folds f over xs from the left, starting from init or the first element
+inline void nativeReduce(VM& vm, NativeArgs& args) {
+    if (args.list(0) == nullptr || !callableArg(vm, args, 1, "reduce"))
+        return;
+    int i = 0;
+    if (args.count > 2) {
+        args.result = args[2];
+    } else if (!args.list(0)->empty()) {
+        args.result = args.list(0)->at(i++);
+    }
+    for (; args.list(0) != nullptr && i < args.list(0)->size(); i++) {
+        StackItem pair[2] = { args.result, args.list(0)->at(i) };
+        StackItem acc = vm.apply(args.arg(1), pair, 2);
+        if (vm.halted())
+            return;
+        args.result = acc;
+    }
+}
+
+//sort(xs, less) - a sorted copy of xs, in ascending order unless less(a, b) says otherwise.
+//The comparator can run a collection, so it is handed positions in the copy rather than values.
+inline void nativeSort(VM& vm, NativeArgs& args) {
+    if (args.list(0) == nullptr || (args.count > 1 && !callableArg(vm, args, 1, "sort")))
+        return;
+    resultList(args);
+    for (auto & x : *args.list(0))
+        appendResult(args, x);
+    deque<StackItem>* sorted = args.result.objval()->list;
+    if (args.count < 2) {
+        stable_sort(sorted->begin(), sorted->end(), [](StackItem a, StackItem b) { return a.lessThan(b); });
+        return;
+    }
+    vector<int> order(sorted->size());
+    for (int i = 0; i < order.size(); i++)
+        order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        if (vm.halted())
+            return false;
+        deque<StackItem>* xs = args.result.objval()->list;
+        StackItem pair[2] = { xs->at(a), xs->at(b) };
+        return vm.apply(args.arg(1), pair, 2).boolval();
+    });
+    sorted = args.result.objval()->list;
+    vector<StackItem> items(sorted->begin(), sorted->end());
+    for (int i = 0; i < order.size(); i++)
+        sorted->at(i) = items[order[i]];
+}
+
+//split(str, sep) - the pieces of str between occurrences of sep (a space by default),
+//or its characters when sep is empty
+inline void nativeSplit(VM& vm, NativeArgs& args) {
+    if (args.str(0) == nullptr)
+        return;
+    string str = *args.str(0);
+    string sep = args.count > 1 ? args.arg(1).toString():" ";
+    resultList(args);
+    if (sep.empty()) {
+        for (char c : str)
+            appendResult(args, StackItem(string(1, c)));
+        return;
+    }
+    size_t from = 0;
+    for (size_t at = str.find(sep); at != string::npos; at = str.find(sep, from)) {
+        appendResult(args, StackItem(str.substr(from, at - from)));
+        from = at + sep.size();
+    }
+    appendResult(args, StackItem(str.substr(from)));
+}
+
+//join(xs, sep) - the elements of xs as one string, with sep (nothing by default) between them
+inline void nativeJoin(VM& vm, NativeArgs& args) {
+    if (args.list(0) == nullptr)
+        return;
+    string sep = args.count > 1 ? args.arg(1).toString():"";
+    string str;
+    for (auto & x : *args.list(0)) {
+        if (&x != &args.list(0)->front())
+            str += sep;
+        str += x.toString();
+    }
+    args.result = StackItem(str);
+}
+
+inline vector<NativeFunction> builtins() {
+    return {
+        NativeFunction("len", nativeLen),
+        NativeFunction("map", nativeMap),
+        NativeFunction("filter", nativeFilter),
+        NativeFunction("reduce", nativeReduce),
+        NativeFunction("sort", nativeSort),
+        NativeFunction("split", nativeSplit),
+        NativeFunction("join", nativeJoin)
+    };
+}
+
+//nullptr if there is no builtin by that name
+inline NativeFunction* newBuiltin(string name) {
+    for (auto & native : builtins())
+        if (native.name == name)
+            return new NativeFunction(native);
+    return nullptr;
+}
+
+#endif
@@ -1,44 +1,110 @@
 #ifndef callframe_hpp
 #define callframe_hpp
 #include <iostream>
+#include <vector>
 #include "stackitem.hpp"
 #include "instruction.hpp"
 #include "gcobject.hpp"
 
 static const int MAX_LOCAL = 255;
+const int GLOBAL_SCOPE = -1;
 
+// An upvalue is open while the variable it refers to still lives in a frame's
+// locals, and is closed over (copied into itself) when that frame is released.
+struct Upvalue {
+    StackItem* location;
+    StackItem closed;
+    Upvalue(StackItem* loc) : location(loc) { }
+    //a closed upvalue points at itself, which has to follow it when the collector moves it
+    Upvalue(Upvalue&& uv) : closed(uv.closed) {
+        location = uv.location == &uv.closed ? &closed:uv.location;
+    }
+    void close() {
+        closed = *location;
+        location = &closed;
+    }
+};
+
+// Activation records are sized to the scope they are created for, and are owned by
+// the VM's FramePool rather than the garbage collector. Closures never hold on to a 
+// frame, only to the upvalues they use, so every frame is recycled when it returns.
 struct ActivationRecord : GCObject {
     int cp_index;
     int ret_addr;
-    StackItem locals[MAX_LOCAL];
+    int nslots;
+    StackItem* locals;
+    GCItem* closure;
+    vector<GCItem*> openUpvalues;
     ActivationRecord* control;
-    ActivationRecord* access;
-    ActivationRecord(int idx = -1, int ra = 0, ActivationRecord* calling = nullptr, ActivationRecord* defining = nullptr) {
+    ActivationRecord(int slots, int idx = -1, int ra = 0, ActivationRecord* calling = nullptr, GCItem* running = nullptr) {
+        nslots = slots;
+        locals = new StackItem[nslots];
+        isAR = true;
+        init(idx, ra, calling, running);
+    }
+    ActivationRecord(const ActivationRecord& ar) = delete;
+    ~ActivationRecord() {
+        delete [] locals;
+    }
+    void init(int idx, int ra, ActivationRecord* calling, GCItem* running) {
         cp_index = idx;
         ret_addr = ra;
         control = calling;
-        access = defining;
-        isAR = true;
-        alloc.registerObject(this);
+        closure = running;
+        marked = false;
     }
-    ActivationRecord(const ActivationRecord& ar) {
-        cp_index = ar.cp_index;
-        ret_addr = ar.ret_addr;
-        control = ar.control;
-        access = ar.access;
-        isAR = true;
-        marked = ar.marked;
+    GCItem* captureUpvalue(int slot) {
+        for (auto uv : openUpvalues) {
+            if (uv->upval->location == &locals[slot])
+                return uv;
+        }
+        GCItem* uv = currentHeap().alloc<Upvalue>(&locals[slot]);
+        openUpvalues.push_back(uv);
+        return uv;
     }
-    ~ActivationRecord() {
-        
+    void closeUpvalues() {
+        for (auto uv : openUpvalues) {
+            uv->upval->close();
+            currentHeap().writeBarrier(uv, uv->upval->closed);
+        }
+        openUpvalues.clear();
     }
 };
 
-void freeAR(ActivationRecord* to) {
+inline void freeAR(ActivationRecord* to) {
     if (to != nullptr) {
         delete to;
     }
 }
 
+// Recycles activation records by slot count, so a call or block entry is a pop 
+// from a free list instead of a heap allocation.
+class FramePool {
+    private:
+        vector<ActivationRecord*> freeFrames[MAX_LOCAL+1];
+    public:
+        FramePool() { }
+        ~FramePool() {
+            for (int i = 0; i <= MAX_LOCAL; i++) {
+                for (auto ar : freeFrames[i])
+                    freeAR(ar);
+            }
+        }
+        ActivationRecord* acquire(int nslots, int idx, int ra, ActivationRecord* calling, GCItem* running) {
+            if (nslots > MAX_LOCAL) nslots = MAX_LOCAL;
+            if (freeFrames[nslots].empty())
+                return new ActivationRecord(nslots, idx, ra, calling, running);
+            ActivationRecord* ar = freeFrames[nslots].back();
+            freeFrames[nslots].pop_back();
+            ar->init(idx, ra, calling, running);
+            for (int i = 0; i < nslots; i++)
+                ar->locals[i] = StackItem();
+            return ar;
+        }
+        void release(ActivationRecord* ar) {
+            ar->closeUpvalues();
+            freeFrames[ar->nslots].push_back(ar);
+        }
+};
 
 #endif
\ No newline at end of file
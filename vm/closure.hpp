@@ -5,21 +5,40 @@ using namespace std;
 
 struct BlockScope;
 
+// Tells mkclosure where to find each of a function's upvalues: a slot in the 
+// enclosing frame (isLocal), or an upvalue of the enclosing closure.
+struct UpvalueDesc {
+    bool isLocal;
+    int index;
+};
+
+//calls and native belong to the JIT: how often the function has been entered,
+//and its compiled body once that crosses the threshold.
 struct Function {
     string name;
     int start_ip;
+    int nlocals;
     BlockScope* scope;
-    Function(string n, int sip, BlockScope* sc) : name(n), start_ip(sip), scope(sc) { }
+    vector<UpvalueDesc> upvalues;
+    int calls;
+    void* native;
+    Function(string n, int sip, BlockScope* sc) : name(n), start_ip(sip), nlocals(1), scope(sc), calls(0), native(nullptr) { }
     Function(const Function& f) {
         name = f.name;
         start_ip  = f.start_ip;
+        nlocals = f.nlocals;
         scope = f.scope;
+        upvalues = f.upvalues;
+        calls = 0;
+        native = nullptr;
     }
     Function& operator=(const Function& f) {
         if (this != &f) {
             name = f.name;
             start_ip  = f.start_ip;
+            nlocals = f.nlocals;
             scope = f.scope;
+            upvalues = f.upvalues;
         }
         return *this;
     }
@@ -27,12 +46,11 @@ struct Function {
 
 struct Closure {
     Function* func;
-    ActivationRecord* env;
-    Closure(Function* f, ActivationRecord* e) : func(f), env(e) { }
-    Closure(Function* f) : func(f), env(nullptr) { }
+    vector<GCItem*> upvalues;
+    Closure(Function* f) : func(f) { }
     Closure(const Closure& c) {
         func = c.func;
-        env = c.env;
+        upvalues = c.upvalues;
     }
     ~Closure() {
 
@@ -40,26 +58,14 @@ struct Closure {
     Closure& operator=(const Closure& c) {
         if (this != &c) {
             func = c.func;
-            env = c.env;
+            upvalues = c.upvalues;
         }
         return *this;
     }
 };
 
-string closureToString(Closure* closure) {
+inline string closureToString(Closure* closure) {
     return "(closure)" + closure->func->name + ", " + to_string(closure->func->start_ip);
 }
 
-void freeClosure(Closure* cl) {
-    if (cl != nullptr) {
-        delete cl;
-    }   
-}
-
-void freeFunction(Function* f) {
-    if (f != nullptr) {
-        delete f;
-    }
-}
-
 #endif
\ No newline at end of file
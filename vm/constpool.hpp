@@ -4,6 +4,7 @@
 #include <queue>
 #include "stackitem.hpp"
 #include "closure.hpp"
+#include "regex/subset_match.hpp"
 using namespace std;
 
 // the items stored in this table are _not_ considered 
@@ -14,6 +15,8 @@ class ConstPool {
     private:
     friend class GarbageCollector;
         unordered_map<string, int> stringPool;
+        unordered_map<double, int> numberPool;
+        unordered_map<string, int> regexPool;
         StackItem* data;
         queue<int> freeList;
         int n;
@@ -47,8 +50,8 @@ class ConstPool {
         }
         ~ConstPool() {
             for (int i = 0; i < maxN; i++) {
-                if (data[i].type == OBJECT) {
-                    alloc.free(data[i].objval);
+                if (data[i].type() == OBJECT) {
+                    currentHeap().free(data[i].objval());
                 }
             }
             delete [] data;
@@ -60,6 +63,8 @@ class ConstPool {
             for (int i = 0; i < n; i++)
                 data[i] = cp.data[i];
             stringPool = cp.stringPool;
+            numberPool = cp.numberPool;
+            regexPool = cp.regexPool;
         }
         ConstPool& operator=(const ConstPool& cp) {
             if (this != &cp) {
@@ -69,12 +74,26 @@ class ConstPool {
                 for (int i = 0; i < n; i++)
                     data[i] = cp.data[i];
                 stringPool = cp.stringPool;
+                numberPool = cp.numberPool;
+                regexPool = cp.regexPool;
             }
             return *this;
         }
+        //constants live as long as the program does, so they skip the nursery.
         int insert(StackItem item) {
+            if (item.isObject())
+                item.setObject(currentHeap().promote(item.objval()));
+            if (item.type() == NUMBER) {
+                auto it = numberPool.find(item.numval());
+                if (it != numberPool.end())
+                    return it->second;
+                int addr = nextAddress();
+                data[addr] = item;
+                numberPool.insert(make_pair(item.numval(), addr));
+                return addr;
+            }
             string strval;
-            if (item.type == OBJECT && item.objval->type == STRING) {
+            if (item.type() == OBJECT && item.objval()->type == STRING) {
                 strval = item.toString();
                 if (stringPool.find(strval) != stringPool.end()) {
                     return stringPool.at(strval);
@@ -82,13 +101,29 @@ class ConstPool {
             }
             int addr = nextAddress();
             data[addr] = item;
-            if (item.type == OBJECT && item.objval->type == STRING) {
+            if (item.type() == OBJECT && item.objval()->type == STRING) {
                 if (!strval.empty()) {
                     stringPool.insert(make_pair(strval, addr));
                 }
             }
             return addr;
         }
+        //only allocates a new string object when the pool doesnt already hold one
+        int insertString(string str) {
+            auto it = stringPool.find(str);
+            if (it != stringPool.end())
+                return it->second;
+            return insert(StackItem(str));
+        }
+        //compiles pattern the first time it's seen, the same pattern shares one regex
+        int insertRegex(string pattern) {
+            auto it = regexPool.find(pattern);
+            if (it != regexPool.end())
+                return it->second;
+            int addr = insert(StackItem(currentHeap().alloc(new Regex(pattern))));
+            regexPool.insert(make_pair(pattern, addr));
+            return addr;
+        }
         StackItem& get(int indx) {
             return data[indx];
         }
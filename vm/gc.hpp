@@ -2,101 +2,241 @@
 #define gc_hpp
 #include <vector>
 #include <memory>
+#include <chrono>
 #include "constpool.hpp"
 #include "stackitem.hpp"
+#include "range.hpp"
+#include "regex/subset_match.hpp"
 #include "instruction.hpp"
 using namespace std;
 
+struct GCStats {
+    int minorCollections;
+    int majorCollections;
+    long promoted;
+    double minorPauseMs;
+    double majorPauseMs;
+    double maxPauseMs;
+    GCStats() : minorCollections(0), majorCollections(0), promoted(0), minorPauseMs(0), majorPauseMs(0), maxPauseMs(0) { }
+};
+
+// Tunables for when collections happen. After every major collection the next one is 
+// scheduled for when the old generation reaches heapGrowth times what survived, clamped
+// to [minHeap, maxHeap] (maxHeap of 0 means unbounded). pauseTargetMs is soft: a minor
+// collection that overruns it halves the nursery, and the nursery grows back once pauses
+// are comfortably under it.
+struct GCPolicy {
+    double heapGrowth;
+    size_t minHeap;
+    size_t maxHeap;
+    double pauseTargetMs;
+    GCPolicy() : heapGrowth(2.0), minHeap(4 << 20), maxHeap(0), pauseTargetMs(10) { }
+};
+
+// Minor collections copy whatever is reachable in the nursery out to the old generation,
+// starting from the operand stack, the call stack, and the remembered set, then reset the 
+// nursery. Once the old generation passes majorThreshold bytes it is marked, and its pages
+// are then swept lazily by the allocator. The VM only calls run() at safepoints.
 class GarbageCollector {
     private:
-        void markObject(GCItem*& curr) {
+        vector<GCItem*> grey;
+        GCStats stats;
+        GCItem* forward(GCItem* obj) {
+            if (obj == nullptr || !currentHeap().isYoung(obj))
+                return obj;
+            if (obj->type == FORWARD)
+                return obj->forward;
+            GCItem* copy = currentHeap().promote(obj);
+            stats.promoted++;
+            grey.push_back(copy);
+            return copy;
+        }
+        void evacuate(StackItem* si) {
+            if (si->isObject() && currentHeap().isYoung(si->objval()))
+                si->setObject(forward(si->objval()));
+        }
+        void scanObject(GCItem* curr) {
+            switch (curr->type) {
+                case LIST: {
+                    for (auto & it : *curr->list)
+                        evacuate(&it);
+                } break;
+                case CLASS: {
+                    for (auto & it : curr->object->slots)
+                        evacuate(&it);
+                } break;
+                case CLOSURE: {
+                    for (auto & uv : curr->closure->upvalues)
+                        uv = forward(uv);
+                } break;
+                case UPVALUE: {
+                    evacuate(&curr->upval->closed);
+                } break;
+                case ITERATOR: {
+                    evacuate(&curr->iter->source);
+                } break;
+                default:
+                    break;
+            }
+        }
+        void evacuateRoots(ActivationRecord* callstk, StackItem opstk[], int sp) {
+            for (int i = sp; i >= 0; i--)
+                evacuate(&opstk[i]);
+            for (auto ar = callstk; ar != nullptr; ar = ar->control) {
+                for (int i = 0; i < ar->nslots; i++)
+                    evacuate(&ar->locals[i]);
+                ar->closure = forward(ar->closure);
+                for (auto & uv : ar->openUpvalues)
+                    uv = forward(uv);
+            }
+            for (auto obj : currentHeap().remembered) {
+                obj->remembered = false;
+                scanObject(obj);
+            }
+            currentHeap().remembered.clear();
+        }
+        void minorCollection(ActivationRecord* callstk, StackItem opstk[], int sp) {
+            evacuateRoots(callstk, opstk, sp);
+            while (!grey.empty()) {
+                GCItem* curr = grey.back();
+                grey.pop_back();
+                scanObject(curr);
+            }
+            currentHeap().resetNursery();
+        }
+        void markObject(GCItem* curr) {
             if (curr == nullptr)
                 return;
-            if (curr != nullptr && curr->marked == false) {
-                curr->marked = true;
+            if (!currentHeap().isMarked(curr)) {
+                currentHeap().mark(curr);
                 if (curr->type == LIST && curr->list != nullptr) {
                     for (auto & it : *curr->list) {
                         markItem(&it);
                     }
                 } else if (curr->type == CLASS && curr->object != nullptr) {
-                    for (auto & it : curr->object->fields) {
-                        markItem(&it.second);
+                    for (auto & it : curr->object->slots) {
+                        markItem(&it);
                     }
                 } else if (curr->type == CLOSURE && curr->closure != nullptr) {
-                    markAR(curr->closure->env);
-                } else if (curr->type == FUNCTION && curr->func != nullptr) {
-                    cout<<"Marked function "<<curr->func->name<<endl;
+                    for (auto uv : curr->closure->upvalues) {
+                        markObject(uv);
+                    }
+                } else if (curr->type == UPVALUE && curr->upval != nullptr) {
+                    markItem(curr->upval->location);
+                } else if (curr->type == ITERATOR && curr->iter != nullptr) {
+                    markItem(&curr->iter->source);
                 }
             }
         }
         void markItem(StackItem* si) {
-            if (si->type == OBJECT) {
-                markObject(si->objval);
+            if (si->type() == OBJECT) {
+                markObject(si->objval());
             }
         }
         void markAR(ActivationRecord* callframe) {
             ActivationRecord* ar = callframe;
             if (ar != nullptr && !ar->marked) {
                 ar->marked = true;
-                for (int i = 0; i < 255; i++) {
+                for (int i = 0; i < ar->nslots; i++) {
                     markItem(&ar->locals[i]);
                 }
-                markAR(ar->access);
+                markObject(ar->closure);
+                for (auto uv : ar->openUpvalues)
+                    markObject(uv);
                 markAR(ar->control);
             }
         }
-        void sweep() {
-            unordered_set<GCObject*> nextGen;
-            int far = 0, fri = 0, ltn = 0;
-            for (auto & it : alloc.getLiveList()) {
-                if (it->marked) {
-                    it->marked = false;
-                    nextGen.insert(it);
-                } else {
-                    if (it->isAR) {
-                        freeAR((ActivationRecord*)it);
-                    } else {
-                        alloc.free((GCItem*)it);
-                    }
-                }
-            }
-            alloc.getLiveList().swap(nextGen);
-        }
         void markOpStack(StackItem ops[], int sp) {
             for (int i = sp; i >= 0; i--) {
                 markItem(&ops[i]);
             }
-            int i = 1;
         }
         void markConstPool(ConstPool* constPool) {
             for (int i = 0; i < constPool->maxN; i++) {
-                if (constPool->data[i].type == OBJECT && constPool->data[i].objval->marked == false) { 
-                    constPool->data[i].objval->marked = true;
-                    if (constPool->data[i].objval->type == CLOSURE && constPool->data[i].objval->closure->env != nullptr) {
-                        markAR(constPool->data[i].objval->closure->env);
-                    }
+                if (constPool->data[i].type() == OBJECT && !currentHeap().isMarked(constPool->data[i].objval())) { 
+                    currentHeap().mark(constPool->data[i].objval());
                 }
             }
         }
+        //frames belong to the VM, not the heap, so sweeping never clears their mark bits.
+        void unmarkCallStack(ActivationRecord* callstk) {
+            for (auto x = callstk; x != nullptr; x = x->control)
+                x->marked = false;
+        }
         void markRoots(ActivationRecord* callstk, StackItem opstk[], int sp, ConstPool* constPool) { 
             markOpStack(opstk, sp);
             markAR(callstk);
             markConstPool(constPool);
         }
-        unsigned int GC_LIMIT;
+        void majorCollection(ActivationRecord* callstk, StackItem opstk[], int sp, ConstPool* constPool) {
+            currentHeap().oldGeneration().finishSweep();
+            markRoots(callstk, opstk, sp, constPool);
+            currentHeap().oldGeneration().beginSweep();
+            unmarkCallStack(callstk);
+        }
+        bool oldGenFull() {
+            return currentHeap().oldGeneration().bytesAllocated() > majorThreshold;
+        }
+        double since(chrono::steady_clock::time_point start) {
+            return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        }
+        void scheduleMajor() {
+            size_t next = currentHeap().oldGeneration().bytesAllocated() * policy.heapGrowth;
+            next = max(next, policy.minHeap);
+            if (policy.maxHeap > 0)
+                next = min(next, policy.maxHeap);
+            majorThreshold = next;
+        }
+        void resizeNursery(double pause) {
+            if (pause > policy.pauseTargetMs) {
+                currentHeap().setNurseryBytes(currentHeap().nurseryBytes() / 2);
+            } else if (pause < policy.pauseTargetMs / 4) {
+                currentHeap().setNurseryBytes(currentHeap().nurseryBytes() * 2);
+            }
+        }
+        GCPolicy policy;
+        size_t majorThreshold;
     public:
         GarbageCollector() {
-            GC_LIMIT = 512 * sizeof(ActivationRecord);
+            majorThreshold = policy.minHeap;
+        }
+        void setPolicy(GCPolicy p) {
+            policy = p;
+            majorThreshold = policy.minHeap;
         }
         bool ready() {
-            return (alloc.getLiveList().size() * sizeof(ActivationRecord)) > GC_LIMIT;
+            return currentHeap().collectionRequested();
         }
         void run(ActivationRecord* callstk, StackItem opstk[], int sp, ConstPool* constPool) {
-            markRoots(callstk, opstk, sp, constPool);
-            sweep();
-            GC_LIMIT *= 2;
+            auto start = chrono::steady_clock::now();
+            minorCollection(callstk, opstk, sp);
+            double pause = since(start);
+            stats.minorCollections++;
+            stats.minorPauseMs += pause;
+            resizeNursery(pause);
+            if (oldGenFull()) {
+                auto mstart = chrono::steady_clock::now();
+                majorCollection(callstk, opstk, sp, constPool);
+                stats.majorCollections++;
+                stats.majorPauseMs += since(mstart);
+                pause = since(start);
+                scheduleMajor();
+            }
+            if (pause > stats.maxPauseMs)
+                stats.maxPauseMs = pause;
+        }
+        GCStats& getStats() {
+            return stats;
+        }
+        void printStats() {
+            cout<<"[gc] minor: "<<stats.minorCollections<<" ("<<stats.minorPauseMs<<"ms), "
+                <<"major: "<<stats.majorCollections<<" ("<<stats.majorPauseMs<<"ms), "
+                <<"max pause: "<<stats.maxPauseMs<<"ms, promoted: "<<stats.promoted
+                <<", old gen: "<<currentHeap().oldGeneration().bytesAllocated()/1024<<"KB in "
+                <<currentHeap().oldGeneration().pageCount()<<" pages, next major at: "<<majorThreshold/1024
+                <<"KB, nursery: "<<currentHeap().nurseryBytes()/1024<<"KB"<<endl;
         }
 };
 
 
-#endif
\ No newline at end of file
+#endif
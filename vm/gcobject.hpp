@@ -4,9 +4,11 @@
 struct GCObject {
     bool marked;
     bool isAR; 
+    bool remembered;
     GCObject() {
         isAR = false;
         marked = false;
+        remembered = false;
     }
 };
 
@@ -4,11 +4,12 @@
 #include <unordered_set>
 #include <list>
 #include <deque>
+#include <cstdint>
 #include "gcobject.hpp"
 using namespace std;
 
-enum GCType {
-    STRING, FUNCTION, CLOSURE, LIST, CLASS, REF, NILPTR
+enum GCType : uint8_t {
+    STRING, FUNCTION, CLOSURE, LIST, CLASS, REF, UPVALUE, NATIVE, RANGE, ITERATOR, REGEX, FORWARD, NILPTR
 };
 
 struct Scope;
@@ -16,17 +17,23 @@ struct Function;
 struct StackItem;
 struct ClassObject;
 struct Closure;
+struct Upvalue;
+struct NativeFunction;
+struct Range;
+struct Iterator;
+struct Regex;
 
-string closureToString(Closure* cl);
-string listToString(deque<StackItem>* list);
-string classToString(ClassObject* obj);
+inline string closureToString(Closure* cl);
+inline string listToString(deque<StackItem>* list);
+inline string classToString(ClassObject* obj);
+inline string rangeToString(Range* range);
 
-void freeClosure(Closure* cl);
-void freeClass(ClassObject* obj);
-void freeFunction(Function* f);
+struct GCItem;
+inline void freePayload(GCItem* item);
 
 struct GCItem : GCObject {
     GCType type;
+    uint8_t cls;
     union {
         string* strval;
         Function* func;
@@ -34,6 +41,12 @@ struct GCItem : GCObject {
         deque<StackItem>* list;
         ClassObject* object;
         StackItem* reference;
+        Upvalue* upval;
+        NativeFunction* nativeFn;
+        Range* range;
+        Iterator* iter;
+        Regex* regex;
+        GCItem* forward;
     };
     GCItem(string* s) : type(STRING), strval(s) { }
     GCItem(Function* f) : type(FUNCTION), func(f) { }
@@ -41,6 +54,11 @@ struct GCItem : GCObject {
     GCItem(deque<StackItem>* l) : type(LIST), list(l) { }
     GCItem(ClassObject* o) : type(CLASS), object(o) { } 
     GCItem(StackItem* r) : type(REF), reference(r) { }
+    GCItem(Upvalue* u) : type(UPVALUE), upval(u) { }
+    GCItem(NativeFunction* n) : type(NATIVE), nativeFn(n) { }
+    GCItem(Range* r) : type(RANGE), range(r) { }
+    GCItem(Iterator* it) : type(ITERATOR), iter(it) { }
+    GCItem(Regex* re) : type(REGEX), regex(re) { }
     GCItem() : type(NILPTR) { }
     GCItem(const GCItem& si) {
         switch (si.type) {
@@ -50,6 +68,12 @@ struct GCItem : GCObject {
             case LIST: list = si.list; break;
             case CLASS: object = si.object; break;
             case REF: reference = si.reference; break;
+                case UPVALUE: upval = si.upval; break;
+                case NATIVE: nativeFn = si.nativeFn; break;
+                case RANGE: range = si.range; break;
+                case ITERATOR: iter = si.iter; break;
+                case REGEX: regex = si.regex; break;
+                case FORWARD: forward = si.forward; break;
         }
         type = si.type;
         isAR = si.isAR;
@@ -64,6 +88,12 @@ struct GCItem : GCObject {
                 case LIST: list = si.list; break;
                 case CLASS: object = si.object; break;
                 case REF: reference = si.reference; break;
+                case UPVALUE: upval = si.upval; break;
+                case NATIVE: nativeFn = si.nativeFn; break;
+                case RANGE: range = si.range; break;
+                case ITERATOR: iter = si.iter; break;
+                case REGEX: regex = si.regex; break;
+                case FORWARD: forward = si.forward; break;
             }
             type = si.type;
             isAR = si.isAR;
@@ -79,6 +109,11 @@ struct GCItem : GCObject {
             case LIST: return listToString(list);
             case CLASS: return "(class)" + classToString(object);
             case REF: return "(reference)";
+            case UPVALUE: return "(upvalue)";
+            case NATIVE: return "(native)";
+            case RANGE: return rangeToString(range);
+            case ITERATOR: return "(iterator)";
+            case REGEX: return "(regex)";
         }
         return "(nil)";
     }
@@ -92,6 +127,11 @@ struct GCItem : GCObject {
             case CLASS: return object == rhs->object;
             case CLOSURE: return closure == rhs->closure;
             case REF:   return false;
+            case UPVALUE: return upval == rhs->upval;
+            case NATIVE: return nativeFn == rhs->nativeFn;
+            case RANGE: return rangeToString(range) == rangeToString(rhs->range);
+            case ITERATOR: return iter == rhs->iter;
+            case REGEX: return regex == rhs->regex;
         }
         return false;
     }
@@ -7,19 +7,19 @@
 #include "stackitem.hpp"
 using namespace std;
 
-void freeListObject(GCItem* item) {
+inline void freeListObject(GCItem* item) {
     for (auto it : *item->list) {
-        if (it.type == OBJECT) {
-            alloc.free(it.objval);
+        if (it.type() == OBJECT) {
+            currentHeap().free(it.objval());
         }
     }
     delete item->list;
 }
 
-void freeClassObject(GCItem* item) {
-    for (auto it : item->object->fields) {
-        if (it.second.type == OBJECT)
-            alloc.free(it.second.objval);
+inline void freeClassObject(GCItem* item) {
+    for (auto it : item->object->slots) {
+        if (it.type() == OBJECT)
+            currentHeap().free(it.objval());
     }
     delete item->object;
 }
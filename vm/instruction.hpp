@@ -1,5 +1,6 @@
 #ifndef instruction_hpp
 #define instruction_hpp
+#include <cstdint>
 #include "stackitem.hpp"
 
 enum VMInstruction {
@@ -10,19 +11,28 @@ enum VMInstruction {
     stglobal, stlocal, 
     stupval, stfield, 
     stidx, dup,
-    call, retfun, 
+    call, tailcall, retfun, 
     entblk, retblk,
     jump, brf, incr, decr, floorval, toint,
-    binop, unop, defun, mkclosure, 
+    binop, unop, matchre, defun, mkclosure, 
     defstruct, mkstruct, popstack, mkrange,
-    mklist, list_append, list_push, list_len, each,
-    print, newline, halt
+    mklist, list_append, list_push, list_len, mkiter, each, bounds,
+    print, newline, 
+    binlocalk, binglobalk, cmpbrf, incrlocal, decrlocal, 
+    incrglobal, decrglobal, setlocal, setglobal,
+    add_nn, sub_nn, mul_nn, div_nn, mod_nn, lt_nn, gt_nn, 
+    lte_nn, gte_nn, eq_nn, neq_nn, concat_ss,
+    halt
 };
 
-string instrStr[] = { "ldrand", "ldconst", "ldfield", "ldidx", "ldglobal", "ldlocal", "ldupval", "ldaddr", 
-                     "stglobal", "stlocal", "stupval", "stfield", "stidx", "dup", "call", "retfun", "entblk", "retblk", 
-                     "jump", "brf", "incr", "decr","floorval","toint", "binop", "unop","defun", "mkclosure", "defstruct", "mkstruct", 
-                     "popstack","mkrange", "append", "push", "list_len", "each", "print", "newline", "halt"};
+static const int NUM_OPCODES = halt + 1;
+
+inline string instrStr[] = { "ldrand", "ldconst", "ldfield", "ldidx", "ldglobal", "ldlocal", "ldupval", "ldaddr", 
+                     "stglobal", "stlocal", "stupval", "stfield", "stidx", "dup", "call", "tailcall", "retfun", "entblk", "retblk", 
+                     "jump", "brf", "incr", "decr","floorval","toint", "binop", "unop", "matchre", "defun", "mkclosure", "defstruct", "mkstruct", 
+                     "popstack","mkrange", "mklist", "append", "push", "list_len", "mkiter", "each", "bounds", "print", "newline", 
+                     "binlocalk", "binglobalk", "cmpbrf", "incrlocal", "decrlocal", "incrglobal", "decrglobal", "setlocal", "setglobal", 
+                     "add_nn", "sub_nn", "mul_nn", "div_nn", "mod_nn", "lt_nn", "gt_nn", "lte_nn", "gte_nn", "eq_nn", "neq_nn", "concat_ss", "halt"};
 
 enum VMOperators {
     VM_ADD = 1, VM_SUB = 2, VM_MUL = 3, VM_DIV = 4, 
@@ -31,13 +41,57 @@ enum VMOperators {
     VM_LOGIC_OR = 15, VM_REGEX = 16
 };
 
+// Instructions are packed into 8 bytes: a 1 byte opcode followed by up to three operands
+// of decreasing width. Operands never hold values directly, literals and names live in the
+// ConstPool and are referenced by index through the wide operand.
+//    a - const pool index, local address, jump target, operator, or on a mkrange, whether it
+//        fills the list literal beneath it
+//    b - argument count, scope depth, frame size, inline cache, local address, or on a 
+//        binop, that the site has been de-quickened
+//    c - scope level of a call site
+// Superinstructions produced by the fusion pass (compile/fusion.hpp) pack the operands of
+// the instructions they replace into whichever of these are free.
 struct Instruction {
-    VMInstruction op;
-    StackItem operand[3];
-    Instruction(VMInstruction instr, StackItem val, StackItem val2, StackItem val3) : op(instr) { operand[0] = val; operand[1] = val2; operand[2] = val3; } 
-    Instruction(VMInstruction instr, StackItem val, StackItem val2) : op(instr) { operand[0] = val; operand[1] = val2; }
-    Instruction(VMInstruction instr, StackItem val) : op(instr) { operand[0] = val; }
-    Instruction(VMInstruction instr = halt) : op(instr) { }
+    uint8_t op;
+    int8_t c;
+    int16_t b;
+    int32_t a;
+    Instruction(VMInstruction instr = halt, int32_t opa = 0, int16_t opb = 0, int8_t opc = 0) : op(instr), c(opc), b(opb), a(opa) { }
 };
 
+static_assert(sizeof(Instruction) == 8, "Instruction is expected to pack into 8 bytes");
+
+inline int operandCount(int op) {
+    switch (op) {
+        case call: case tailcall: case binlocalk: case binglobalk:
+            return 3;
+        case defun: case mkstruct: case ldfield: case stfield: case cmpbrf:
+            return 2;
+        case ldrand: case ldconst: case ldglobal: case ldlocal: case ldupval: case ldaddr: case mkclosure:
+        case stglobal: case stlocal: case stupval: case entblk: case jump: case brf: case each: case mkrange:
+        case incrlocal: case decrlocal: case incrglobal: case decrglobal: case setlocal: case setglobal:
+        case add_nn: case sub_nn: case mul_nn: case div_nn: case mod_nn: case lt_nn: case gt_nn:
+        case lte_nn: case gte_nn: case eq_nn: case neq_nn: case concat_ss:
+        case binop: case unop: case matchre: case defstruct:
+            return 1;
+        default:
+            break;
+    }
+    return 0;
+}
+
+// operands which are an index into the constant pool
+inline bool hasConstOperand(int op) {
+    return op == ldconst || op == ldrand || op == ldfield || op == stfield || op == defun || op == binlocalk || op == binglobalk || op == matchre;
+}
+
+inline string instructionToString(Instruction& inst) {
+    string str = instrStr[inst.op];
+    int n = operandCount(inst.op);
+    if (n > 0) str += " " + to_string(inst.a);
+    if (n > 1) str += " " + to_string(inst.b);
+    if (n > 2) str += " " + to_string(inst.c);
+    return str;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,39 @@
+#ifndef isolate_hpp
+#define isolate_hpp
+#include "alloc.hpp"
+#include "shape.hpp"
+using namespace std;
+
+// The state an interpreter would otherwise keep in globals: its heap and the root of its
+// shape tree. Every VM owns an isolate, which is bound to the thread that creates it and again
+// to whichever thread runs it. Objects are always allocated out of the isolate bound to the
+// calling thread, so any number of interpreters can run side by side, one per thread, without
+// sharing anything mutable. A compiler allocates its constants out of the current isolate, so
+// it has to be created after the VM it compiles for.
+class Isolate {
+    public:
+        inline static thread_local Isolate* current = nullptr;
+        GCAllocator heap;
+        Shape rootShape;
+        Isolate() {
+            bind();
+        }
+        Isolate(const Isolate& isolate) = delete;
+        ~Isolate() {
+            if (current == this)
+                current = nullptr;
+        }
+        void bind() {
+            current = this;
+        }
+};
+
+inline GCAllocator& currentHeap() {
+    return Isolate::current->heap;
+}
+
+inline Shape* rootShape() {
+    return &Isolate::current->rootShape;
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef jit_hpp
+#define jit_hpp
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <sys/mman.h>
+using namespace std;
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define HAS_JIT 1
+#else
+#define HAS_JIT 0
+#endif
+
+static const size_t JIT_BUFFER_BYTES = 4 << 20;
+
+// Executable memory for native code. It is only writable while code is being emitted
+// into it, and only executable the rest of the time.
+class CodeBuffer {
+    private:
+        uint8_t* base;
+        size_t capacity;
+        size_t used;
+    public:
+        CodeBuffer(size_t bytes = JIT_BUFFER_BYTES) {
+            capacity = bytes;
+            used = 0;
+            void* mem = mmap(nullptr, capacity, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            base = mem == MAP_FAILED ? nullptr:(uint8_t*)mem;
+        }
+        ~CodeBuffer() {
+            if (base != nullptr)
+                munmap(base, capacity);
+        }
+        bool usable() {
+            return base != nullptr;
+        }
+        void beginWrite() {
+            mprotect(base, capacity, PROT_READ|PROT_WRITE);
+        }
+        void endWrite() {
+            mprotect(base, capacity, PROT_READ|PROT_EXEC);
+        }
+        bool hasRoom(size_t bytes) {
+            return used + bytes <= capacity;
+        }
+        size_t position() {
+            return used;
+        }
+        void rewind(size_t pos) {
+            used = pos;
+        }
+        void* address(size_t pos) {
+            return base + pos;
+        }
+        void emit(uint8_t b) {
+            base[used++] = b;
+        }
+        void emit32(uint32_t v) {
+            memcpy(base + used, &v, 4);
+            used += 4;
+        }
+        void emit64(uint64_t v) {
+            memcpy(base + used, &v, 8);
+            used += 8;
+        }
+        void patch32(size_t pos, uint32_t v) {
+            memcpy(base + pos, &v, 4);
+        }
+};
+
+enum X86Reg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7, R12 = 12, R13 = 13 };
+enum X86Cond { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB };
+
+// Where the parts of the VM that native code touches directly live, relative to the VM
+// and to the frame callstk points at.
+struct VMLayout {
+    int32_t ip;
+    int32_t sp;
+    int32_t opstk;
+    int32_t callstk;
+    int32_t locals;
+};
+
+// The handful of x86-64 instructions the baseline compiler needs. Generated functions
+// keep the VM pointer in r12 for their whole lifetime, every other register is scratch
+// across the helper calls that make up most of their body. Inline code keeps sp in rcx
+// and the address of the top of the operand stack in rdx.
+class X86Emitter {
+    private:
+        CodeBuffer& buf;
+        VMLayout vm;
+        void rex(bool wide, int reg, int base) {
+            uint8_t r = 0x40 | (wide ? 8:0) | ((reg >> 3) << 2) | (base >> 3);
+            if (r != 0x40)
+                buf.emit(r);
+        }
+        //op reg, [base + disp32]
+        void mem(uint8_t op, int reg, int base, int32_t disp, bool wide = true) {
+            rex(wide, reg, base);
+            buf.emit(op);
+            buf.emit(0x80 | ((reg & 7) << 3) | (base & 7));
+            if ((base & 7) == RSP)
+                buf.emit(0x24);
+            buf.emit32(disp);
+        }
+        //op rm, reg
+        void regreg(uint8_t op, int rm, int reg) {
+            rex(true, reg, rm);
+            buf.emit(op);
+            buf.emit(0xC0 | ((reg & 7) << 3) | (rm & 7));
+        }
+    public:
+        X86Emitter(CodeBuffer& cb, VMLayout layout) : buf(cb), vm(layout) { }
+        //push rbx; push r12; push r13; mov r12, rdi
+        //three pushes on top of the return address leave rsp 16 byte aligned for calls
+        void prologue() {
+            buf.emit(0x53);
+            buf.emit(0x41); buf.emit(0x54);
+            buf.emit(0x41); buf.emit(0x55);
+            regreg(0x89, R12, RDI);
+        }
+        //pop r13; pop r12; pop rbx; ret
+        void epilogue() {
+            buf.emit(0x41); buf.emit(0x5D);
+            buf.emit(0x41); buf.emit(0x5C);
+            buf.emit(0x5B);
+            buf.emit(0xC3);
+        }
+        //mov dword [r12 + vm.ip], value
+        void storeIp(int32_t value) {
+            rex(false, 0, R12);
+            buf.emit(0xC7);
+            buf.emit(0x84); buf.emit(0x24);
+            buf.emit32(vm.ip);
+            buf.emit32(value);
+        }
+        //helper(vm, arg): mov rdi, r12; mov rsi, arg; mov rax, helper; call rax
+        void callHelper(void* helper, void* arg) {
+            regreg(0x89, RDI, R12);
+            loadImmediate(RSI, (uint64_t)arg);
+            loadImmediate(RAX, (uint64_t)helper);
+            buf.emit(0xFF); buf.emit(0xD0);
+        }
+        //test al, al
+        void testResult() {
+            buf.emit(0x84); buf.emit(0xC0);
+        }
+        //the jumps return where their rel32 lives, so it can be patched once the target is known
+        size_t jumpIf(X86Cond cc) {
+            buf.emit(0x0F); buf.emit(0x80 | cc);
+            buf.emit32(0);
+            return buf.position() - 4;
+        }
+        size_t jumpIfZero() {
+            return jumpIf(CC_E);
+        }
+        size_t jumpIfNotZero() {
+            return jumpIf(CC_NE);
+        }
+        size_t jump() {
+            buf.emit(0xE9);
+            buf.emit32(0);
+            return buf.position() - 4;
+        }
+        void bind(size_t rel32At, size_t target) {
+            buf.patch32(rel32At, (uint32_t)(target - (rel32At + 4)));
+        }
+        void bindHere(size_t rel32At) {
+            bind(rel32At, buf.position());
+        }
+        void loadImmediate(int reg, uint64_t value) {
+            rex(true, 0, reg);
+            buf.emit(0xB8 | (reg & 7));
+            buf.emit64(value);
+        }
+        void load(int reg, int base, int32_t disp) {
+            mem(0x8B, reg, base, disp);
+        }
+        void store(int base, int32_t disp, int reg) {
+            mem(0x89, reg, base, disp);
+        }
+        //rcx = sp, rdx = &opstk[sp]
+        void loadStackTop() {
+            mem(0x63, RCX, R12, vm.sp);
+            buf.emit(0x49); buf.emit(0x8D); buf.emit(0x94); buf.emit(0xCC);
+            buf.emit32(vm.opstk);
+        }
+        //sp = rcx + n
+        void adjustSp(int8_t n) {
+            buf.emit(0x83); buf.emit(0xC1); buf.emit((uint8_t)n);
+            mem(0x89, RCX, R12, vm.sp, false);
+        }
+        //reg = &callstk->locals[0]
+        void loadLocals(int reg) {
+            load(reg, R12, vm.callstk);
+            load(reg, reg, vm.locals);
+        }
+        //jumps away unless reg holds a double
+        size_t jumpIfNotNumber(int reg, uint64_t qnan) {
+            loadImmediate(RSI, qnan);
+            regreg(0x89, RDI, reg);
+            regreg(0x21, RDI, RSI);
+            regreg(0x39, RDI, RSI);
+            return jumpIf(CC_E);
+        }
+        size_t jumpIfEqual(int reg, uint64_t value) {
+            loadImmediate(RSI, value);
+            regreg(0x39, reg, RSI);
+            return jumpIf(CC_E);
+        }
+        //movq xmm, reg / movq reg, xmm
+        void toDouble(int xmm, int reg) {
+            buf.emit(0x66); rex(true, xmm, reg);
+            buf.emit(0x0F); buf.emit(0x6E);
+            buf.emit(0xC0 | (xmm << 3) | (reg & 7));
+        }
+        void fromDouble(int reg, int xmm) {
+            buf.emit(0x66); rex(true, xmm, reg);
+            buf.emit(0x0F); buf.emit(0x7E);
+            buf.emit(0xC0 | (xmm << 3) | (reg & 7));
+        }
+        //addsd 0x58, mulsd 0x59, subsd 0x5C, divsd 0x5E, xmm0 op= xmm1
+        void arithmetic(uint8_t op) {
+            buf.emit(0xF2); buf.emit(0x0F); buf.emit(op); buf.emit(0xC1);
+        }
+        //ucomisd xmm_a, xmm_b
+        void compare(int a, int b) {
+            buf.emit(0x66); buf.emit(0x0F); buf.emit(0x2E);
+            buf.emit(0xC0 | (a << 3) | b);
+        }
+        //setcc al or bl
+        void setIf(X86Cond cc, int reg) {
+            buf.emit(0x0F); buf.emit(0x90 | cc); buf.emit(0xC0 | reg);
+        }
+        //and al, bl / or al, bl
+        void andFlags() {
+            buf.emit(0x20); buf.emit(0xD8);
+        }
+        void orFlags() {
+            buf.emit(0x08); buf.emit(0xD8);
+        }
+        //movzx eax, al
+        void widenFlag() {
+            buf.emit(0x0F); buf.emit(0xB6); buf.emit(0xC0);
+        }
+        //or rax, rsi
+        void orTag() {
+            regreg(0x09, RAX, RSI);
+        }
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef native_hpp
+#define native_hpp
+#include <functional>
+#include "stackitem.hpp"
+using namespace std;
+
+class VM;
+
+// What a native function is handed: its arguments, left on the operand stack where the caller
+// pushed them, and the slot its result goes in, which sits on the stack just above them. Both
+// are roots. Natives that call back into Glaux (VM::apply) may see a collection, which can move
+// any object, so they keep what they are building in 'result' and go back through args[] and
+// result after every call rather than holding on to the objects they point at.
+struct NativeArgs {
+    StackItem* args;
+    int count;
+    StackItem& result;
+    NativeArgs(StackItem* a, int n, StackItem& r) : args(a), count(n), result(r) { }
+    StackItem& operator[](int i) {
+        return args[i];
+    }
+    //nil for arguments the caller didn't pass
+    StackItem arg(int i) {
+        return i < count ? args[i]:StackItem();
+    }
+    deque<StackItem>* list(int i) {
+        return i < count && args[i].isObject() && args[i].objval()->type == LIST ? args[i].objval()->list:nullptr;
+    }
+    string* str(int i) {
+        return i < count && args[i].isObject() && args[i].objval()->type == STRING ? args[i].objval()->strval:nullptr;
+    }
+};
+
+typedef function<void(VM&, NativeArgs&)> NativeFn;
+
+// A function implemented in C++. Calling one takes no activation record: it runs straight
+// off the operand stack and its result replaces the arguments.
+struct NativeFunction {
+    string name;
+    NativeFn fn;
+    NativeFunction(string n, NativeFn f) : name(n), fn(f) { }
+};
+
+#endif
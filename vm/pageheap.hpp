@@ -0,0 +1,166 @@
+#ifndef pageheap_hpp
+#define pageheap_hpp
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "heapitem.hpp"
+using namespace std;
+
+static const size_t HEAP_PAGE_SIZE = 64 * 1024;
+static const int NUM_SIZE_CLASSES = 5;
+static const size_t cellSize[NUM_SIZE_CLASSES] = { 16, 32, 48, 96, 128 };
+
+//a cell is a GCItem followed by its payload, when the payload is stored inline
+constexpr int sizeClassFor(size_t bytes) {
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+        if (bytes <= cellSize[i])
+            return i;
+    return -1;
+}
+
+// Every cell in a page is the same size. Mark bits live in the page header rather than
+// in the objects, and pages are aligned to their size so a cell finds its page by masking.
+struct HeapPage {
+    int sizeClass;
+    int ncells;
+    uint64_t markBits[HEAP_PAGE_SIZE / 16 / 64];
+    static size_t headerSize() {
+        return (sizeof(HeapPage) + 15) & ~(size_t)15;
+    }
+    GCItem* cell(int i) {
+        return (GCItem*)((char*)this + headerSize() + i * cellSize[sizeClass]);
+    }
+    int indexOf(GCItem* item) {
+        return ((char*)item - ((char*)this + headerSize())) / cellSize[sizeClass];
+    }
+    bool isMarked(int i) {
+        return markBits[i >> 6] & (1ULL << (i & 63));
+    }
+    void mark(int i) {
+        markBits[i >> 6] |= (1ULL << (i & 63));
+    }
+    void clearMarks() {
+        memset(markBits, 0, sizeof(markBits));
+    }
+};
+
+inline HeapPage* pageOf(GCItem* item) {
+    return (HeapPage*)((uintptr_t)item & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+// The old generation. Each size class allocates from a free list of cells, which is refilled
+// by sweeping one page at a time: after a collection every page is queued as unswept, and
+// pages are only swept once allocation needs the space (or the next collection begins).
+class PageHeap {
+    private:
+        vector<HeapPage*> pages;
+        vector<HeapPage*> unswept[NUM_SIZE_CLASSES];
+        GCItem* freeCells[NUM_SIZE_CLASSES];
+        size_t allocatedBytes;
+        size_t markedBytes;
+        void pushFree(int cls, GCItem* cell) {
+            cell->forward = freeCells[cls];
+            freeCells[cls] = cell;
+        }
+        void newPage(int cls) {
+            HeapPage* page = (HeapPage*)aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+            page->sizeClass = cls;
+            page->ncells = (HEAP_PAGE_SIZE - HeapPage::headerSize()) / cellSize[cls];
+            page->clearMarks();
+            for (int i = page->ncells - 1; i >= 0; i--) {
+                page->cell(i)->type = NILPTR;
+                pushFree(cls, page->cell(i));
+            }
+            pages.push_back(page);
+        }
+        void sweepPage(HeapPage* page) {
+            int cls = page->sizeClass;
+            for (int i = page->ncells - 1; i >= 0; i--) {
+                GCItem* cell = page->cell(i);
+                if (cell->type != NILPTR) {
+                    if (page->isMarked(i))
+                        continue;
+                    freePayload(cell);
+                }
+                pushFree(cls, cell);
+            }
+            page->clearMarks();
+        }
+    public:
+        PageHeap() {
+            for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+                freeCells[i] = nullptr;
+            allocatedBytes = 0;
+            markedBytes = 0;
+        }
+        ~PageHeap() {
+            for (auto page : pages) {
+                for (int i = 0; i < page->ncells; i++)
+                    if (page->cell(i)->type != NILPTR)
+                        freePayload(page->cell(i));
+                free(page);
+            }
+        }
+        GCItem* allocate(int cls) {
+            while (freeCells[cls] == nullptr) {
+                if (unswept[cls].empty()) {
+                    newPage(cls);
+                } else {
+                    sweepPage(unswept[cls].back());
+                    unswept[cls].pop_back();
+                }
+            }
+            GCItem* cell = freeCells[cls];
+            freeCells[cls] = cell->forward;
+            allocatedBytes += cellSize[cls];
+            return cell;
+        }
+        //frees the payload now, the cell itself is picked up by the next sweep of its page
+        void release(GCItem* cell) {
+            if (cell->type == NILPTR)
+                return;
+            freePayload(cell);
+        }
+        bool isMarked(GCItem* item) {
+            HeapPage* page = pageOf(item);
+            return page->isMarked(page->indexOf(item));
+        }
+        void mark(GCItem* item) {
+            HeapPage* page = pageOf(item);
+            page->mark(page->indexOf(item));
+            markedBytes += cellSize[page->sizeClass];
+        }
+        //called once marking is done. Whatever wasn't marked is as good as free, so from 
+        //here on the heap only counts what survived plus what gets allocated.
+        void beginSweep() {
+            allocatedBytes = markedBytes;
+            for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+                freeCells[i] = nullptr;
+                unswept[i].clear();
+            }
+            for (auto page : pages)
+                unswept[page->sizeClass].push_back(page);
+        }
+        //called before marking, so no page still holds mark bits from the last cycle.
+        void finishSweep() {
+            for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+                while (!unswept[i].empty()) {
+                    sweepPage(unswept[i].back());
+                    unswept[i].pop_back();
+                }
+            }
+            markedBytes = 0;
+        }
+        size_t bytesAllocated() {
+            return allocatedBytes;
+        }
+        size_t bytesMarked() {
+            return markedBytes;
+        }
+        int pageCount() {
+            return pages.size();
+        }
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef pairprofile_hpp
+#define pairprofile_hpp
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "instruction.hpp"
+using namespace std;
+
+// Counts how often each opcode is executed straight after the one before it. Pairs are only
+// counted when the first instruction fell through to the second, so every pair reported sits
+// next to each other in the code page and is a candidate for a superinstruction.
+class PairProfile {
+    private:
+        long counts[NUM_OPCODES][NUM_OPCODES];
+        long total;
+        int last;
+    public:
+        PairProfile() {
+            memset(counts, 0, sizeof(counts));
+            total = 0;
+            last = -1;
+        }
+        void record(int op, bool fellThrough) {
+            if (last != -1) {
+                counts[last][op]++;
+                total++;
+            }
+            last = fellThrough ? op:-1;
+        }
+        void print(int limit = 20) {
+            vector<pair<long,int>> pairs;
+            for (int i = 0; i < NUM_OPCODES; i++)
+                for (int j = 0; j < NUM_OPCODES; j++)
+                    if (counts[i][j] > 0)
+                        pairs.push_back(make_pair(counts[i][j], i * NUM_OPCODES + j));
+            sort(pairs.rbegin(), pairs.rend());
+            cout<<"[pairs] "<<total<<" adjacent pairs executed"<<endl;
+            for (int i = 0; i < pairs.size() && i < limit; i++) {
+                string name = instrStr[pairs[i].second / NUM_OPCODES] + " " + instrStr[pairs[i].second % NUM_OPCODES];
+                cout<<"[pairs] "<<setw(24)<<left<<name<<right<<setw(12)<<pairs[i].first
+                    <<setw(8)<<fixed<<setprecision(2)<<(100.0 * pairs[i].first / total)<<"%"<<endl;
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef range_hpp
+#define range_hpp
+#include "stackitem.hpp"
+using namespace std;
+
+// lo .. hi outside of a list literal, the numbers from lo up to hi without any of them being
+// stored. The bounds are taken the way [lo .. hi] takes them: in either order, with the lower
+// one truncated to an integer, so a range holds exactly what the list would have.
+struct Range {
+    double first;
+    double last;
+    Range(double lo, double hi) {
+        if (hi < lo) swap(lo, hi);
+        first = (int)lo;
+        last = hi;
+    }
+    int size() {
+        return first <= last ? (int)(last - first) + 1:0;
+    }
+    double at(int i) {
+        return first + i;
+    }
+};
+
+inline string rangeToString(Range* range) {
+    return StackItem(range->first).toString() + " .. " + StackItem(range->last).toString();
+}
+
+// What 'each' steps through: a list, a string or a range, and how far into it it has got.
+// Lists are read at their current size, so one that grows while it is walked is walked to
+// its new end.
+struct Iterator {
+    StackItem source;
+    int position;
+    Iterator(StackItem src) : source(src), position(0) { }
+    static bool iterable(StackItem& si) {
+        return si.isObject() && (si.objval()->type == LIST || si.objval()->type == STRING || si.objval()->type == RANGE);
+    }
+    //false once there is nothing left
+    bool next(StackItem& item) {
+        if (!iterable(source))
+            return false;
+        GCItem* obj = source.objval();
+        switch (obj->type) {
+            case LIST:
+                if (position >= obj->list->size())
+                    return false;
+                item = obj->list->at(position++);
+                return true;
+            case STRING:
+                if (position >= obj->strval->size())
+                    return false;
+                item = StackItem(string(1, obj->strval->at(position++)));
+                return true;
+            case RANGE:
+                if (position >= obj->range->size())
+                    return false;
+                item = StackItem(obj->range->at(position++));
+                return true;
+            default:
+                break;
+        }
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef prefilter_hpp
+#define prefilter_hpp
+#include <cstring>
+#include "re_compiler.hpp"
+using namespace std;
+
+// What is known about the text a piece of a pattern matches: that it always starts with
+// prefix, ends with suffix and has required somewhere in it. Exact pieces match only the
+// one string, which is all three.
+struct Literals {
+    bool exact;
+    string prefix;
+    string suffix;
+    string required;
+    Literals() : exact(false) { }
+    Literals(string lit) : exact(true), prefix(lit), suffix(lit), required(lit) { }
+};
+
+inline string longest(string a, string b) {
+    return b.length() > a.length() ? b:a;
+}
+
+inline Literals literalsOf(re_ast* t) {
+    if (t == nullptr)
+        return Literals("");
+    if (t->type == LITERAL)
+        return t->c == '.' ? Literals():Literals(string(1, t->c));
+    if (t->type == CHCLASS)
+        return t->ccl.length() == 1 ? Literals(t->ccl):Literals();
+    Literals res;
+    switch (t->c) {
+        case '@': {
+            Literals lhs = literalsOf(t->left), rhs = literalsOf(t->right);
+            if (lhs.exact && rhs.exact)
+                return Literals(lhs.prefix + rhs.prefix);
+            res.prefix = lhs.exact ? lhs.prefix + rhs.prefix:lhs.prefix;
+            res.suffix = rhs.exact ? lhs.suffix + rhs.suffix:rhs.suffix;
+            res.required = longest(longest(lhs.required, rhs.required), lhs.suffix + rhs.prefix);
+            res.required = longest(res.required, longest(res.prefix, res.suffix));
+        } break;
+        case '|': {
+            Literals lhs = literalsOf(t->left), rhs = literalsOf(t->right);
+            if (lhs.exact && rhs.exact && lhs.prefix == rhs.prefix)
+                return lhs;
+            int i = 0;
+            while (i < lhs.prefix.length() && i < rhs.prefix.length() && lhs.prefix[i] == rhs.prefix[i])
+                i++;
+            res.prefix = lhs.prefix.substr(0, i);
+            int j = 0;
+            while (j < lhs.suffix.length() && j < rhs.suffix.length()
+                    && lhs.suffix[lhs.suffix.length()-1-j] == rhs.suffix[rhs.suffix.length()-1-j])
+                j++;
+            res.suffix = lhs.suffix.substr(lhs.suffix.length()-j);
+            res.required = longest(res.prefix, res.suffix);
+        } break;
+        case '+': {
+            Literals once = literalsOf(t->left);
+            res.prefix = once.prefix;
+            res.suffix = once.suffix;
+            res.required = once.required;
+        } break;
+        case '^':
+        case '$':
+            return literalsOf(t->left);
+        default: //'*' and '?' can match nothing at all
+            break;
+    }
+    return res;
+}
+
+// Turns text away before it reaches the automaton when it can't hold a match: one that
+// doesn't start with the pattern's literal prefix, or lacks the longest literal every match
+// contains. A match never reads past the first newline, so that is as far as the literal
+// may be found. The scan is memchr for its first byte and memcmp for the rest.
+class Prefilter {
+    private:
+        string prefix;
+        string required;
+        const char* find(const char* s, const char* end) {
+            size_t m = required.length();
+            while (end - s >= (long)m) {
+                s = (const char*)memchr(s, required[0], end - s - m + 1);
+                if (s == nullptr)
+                    return nullptr;
+                if (memcmp(s, required.data(), m) == 0)
+                    return s;
+                s++;
+            }
+            return nullptr;
+        }
+    public:
+        Prefilter(re_ast* ast) {
+            Literals lits = literalsOf(ast);
+            prefix = lits.prefix;
+            required = lits.required;
+            if (required == prefix)
+                required.clear();
+        }
+        bool mayMatch(const string& text) {
+            if (text.compare(0, prefix.length(), prefix) != 0)
+                return false;
+            if (required.empty())
+                return true;
+            const char* s = text.data();
+            const char* at = find(s, s + text.length());
+            if (at == nullptr)
+                return false;
+            size_t upto = at - s + required.length();
+            return memchr(s, '\n', upto) == nullptr && memchr(s, '\0', upto) == nullptr;
+        }
+};
+
+#endif
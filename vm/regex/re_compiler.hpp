@@ -3,6 +3,8 @@
 #include <iostream>
 #include <vector>
 #include <stack>
+#include <deque>
+#include <cstdint>
 using namespace std;
 
 const int LITERAL = 1;
@@ -19,7 +21,7 @@ struct re_ast {
     re_ast(char ch, int t) : type(t), c(ch), ccl(""), left(nullptr), right(nullptr) { }
 };
 
-void preorder(re_ast* t, int d) {
+inline void preorder(re_ast* t, int d) {
     d++;
     if (t != nullptr) {
         for (int i = 0; i < d; i++) cout<<" ";
@@ -37,6 +39,12 @@ class REParser {
     private:
         string rexpr;
         int pos;
+        string err;
+        //only the first error is kept, whatever follows it is usually a consequence
+        void error(string msg) {
+            if (err.empty())
+                err = msg;
+        }
         void advance() {
             if (pos < rexpr.length())
                 pos++;
@@ -51,13 +59,18 @@ class REParser {
         char lookahead() {
             return rexpr[pos];
         }
+        //everything but the operators stands for itself, '.' for any character
+        bool isLiteral(char c) {
+            return pos < rexpr.length() && string("()[]|*+?^$").find(c) == string::npos;
+        }
         re_ast* factor() {
-            re_ast* t;
+            re_ast* t = nullptr;
             if (lookahead() == '(') {
                 match('(');
                 t = anchordexprs();
-                match(')');
-            } else if (isdigit(lookahead()) || isalpha(lookahead()) || lookahead() == '.') {
+                if (!match(')'))
+                    error("Unclosed group");
+            } else if (isLiteral(lookahead())) {
                 t = new re_ast(lookahead(), 1);
                 advance();
             } else if (lookahead() == '[') {
@@ -68,15 +81,24 @@ class REParser {
                     advance();
                 }
                 if (lookahead() != ']') {
-                    cout<<"Error: Unclosed character class."<<endl;
+                    error("Unclosed character class");
+                    return nullptr;
+                } else if (ccl.empty() || ccl == "^") {
+                    error("Empty character class");
                     return nullptr;
                 } else {
                     advance();
                 }
                 t = new re_ast(ccl, 3);
+            } else if (pos < rexpr.length()) {
+                error(string("Unexpected '") + lookahead() + "'");
+                return nullptr;
+            } else {
+                error("Pattern ends too soon");
+                return nullptr;
             }
 
-            if (lookahead() == '*' || lookahead() == '+' || lookahead() == '?') {
+            if (t != nullptr && (lookahead() == '*' || lookahead() == '+' || lookahead() == '?')) {
                 re_ast* n = new re_ast(lookahead(), 2);
                 match(lookahead());
                 n->left = t;
@@ -86,7 +108,7 @@ class REParser {
         }
         re_ast* term() {
             re_ast* t = factor();
-            if (lookahead() == '(' || (lookahead() == '.' || isdigit(lookahead()) || isalpha(lookahead()) || lookahead() == '[')) {
+            if (lookahead() == '(' || isLiteral(lookahead()) || lookahead() == '[') {
                 re_ast* n = new re_ast('@', 2);
                 n->left = t;
                 n->right = term();
@@ -130,9 +152,16 @@ class REParser {
         REParser() {
 
         }
+        //nullptr if pat isn't a valid pattern, lastError() says why.
         re_ast* parse(string pat) {
-            rexpr = pat; pos = 0;
-            return anchordexprs();
+            rexpr = pat; pos = 0; err.clear();
+            re_ast* t = anchordexprs();
+            if (pos < rexpr.length())
+                error(string("Unexpected '") + lookahead() + "'");
+            return err.empty() ? t:nullptr;
+        }
+        string lastError() {
+            return err;
         }
 };
 
@@ -147,14 +176,46 @@ struct Stack : public stack<T> {
 
 typedef int State;
 
+//small enough that a set of states fits in a 256 bit mask (see subset_match.hpp)
+const int MAX_STATE = 256;
+
 struct NFAState;
 
+// The bytes a transition reads, one bit each.
+struct CharClass {
+    uint64_t bits[4];
+    CharClass() {
+        for (auto & b : bits) b = 0;
+    }
+    void add(unsigned char c) {
+        bits[c/64] |= 1ULL << (c%64);
+    }
+    void addRange(unsigned char lo, unsigned char hi) {
+        for (int c = lo; c <= hi; c++)
+            add(c);
+    }
+    void negate() {
+        for (auto & b : bits) b = ~b;
+    }
+    bool contains(unsigned char c) const {
+        return bits[c/64] & (1ULL << (c%64));
+    }
+};
+
+//'.' reads any byte, every other character just itself
 struct Transition {
-    char ch;
     bool is_epsilon;
+    CharClass chars;
     NFAState* dest;
-    Transition(NFAState* d) : ch('&'), dest(d), is_epsilon(true) { }
-    Transition(char c, NFAState* d) : ch(c), dest(d), is_epsilon(false) { }
+    Transition(NFAState* d) : is_epsilon(true), dest(d) { }
+    Transition(CharClass cc, NFAState* d) : is_epsilon(false), chars(cc), dest(d) { }
+    Transition(char c, NFAState* d) : is_epsilon(false), dest(d) {
+        if (c == '.') {
+            chars.negate();
+        } else {
+            chars.add(c);
+        }
+    }
     Transition() {
         is_epsilon = false;
         dest = nullptr;
@@ -166,13 +227,6 @@ struct NFAState {
     vector<Transition> transitions;
     NFAState(State st = -1) : label(st) { }
     ~NFAState() {    }
-    bool hasTransition(Transition t) {
-        for (auto e : transitions) {
-            if (e.ch == t.ch && e.dest == t.dest)
-                return true;
-        }
-        return false;
-    }
     void addTransition(Transition t) {
         transitions.push_back(t);
     }
@@ -184,122 +238,86 @@ struct NFA {
     NFA(NFAState* s = nullptr, NFAState* a = nullptr) : start(s), accept(a) {  }
 };
 
-//about as simple of an allocator as you can get.
-const int MAX_STATE = 255;
-NFAState arena[MAX_STATE];
-int nf = 0;
-
-NFAState* makeState(int label) {
-    if (nf+1 == MAX_STATE) {
-        cout<<"ERROR: OUT OF MEMORY"<<endl;
-        return nullptr;
-    }
-    NFAState* ns = &arena[nf++];
-    ns->label = label;
-    return ns;
-}
-
-int nextLabel() {
-    static int label = 0;
-    return label++;
-}
-
-NFA makeAtomic(char ch) {
-    NFAState* ns = makeState(nextLabel());
-    NFAState* ts = makeState(nextLabel());
-    ns->addTransition(Transition(ch, ts));
-    return NFA(ns, ts);
-}
-
-void makeRangeClassTrans(NFAState* ns, NFAState* ts, string ccl, bool negate, int spos) {
-    char lo = ccl[spos], hi = ccl[spos+2];
-    if (!negate) {
-        for (char t = lo; t <= hi; t++)
-            ns->addTransition(Transition(t, ts));
-        return;
-    }
-    for (char t = '0'; t < lo; t++)
-        ns->addTransition(Transition(t, ts));
-    for (char t = hi+1; t <= '~'; t++)
-        ns->addTransition(Transition(t, ts));   
-}
-
-void makeRegClassTrans(NFAState* ns, NFAState* ts, string ccl, bool negate, int spos) {
-    if (!negate) {
-        ns->addTransition(Transition(ccl[spos], ts));
-        return;
-    }
-    for (char t = '0'; t <= '~'; t++) {
-        if (ccl.find(t) == std::string::npos && !ns->hasTransition(Transition(t, ts))) {
-            ns->addTransition(Transition(t, ts));
-        }
-   }
-}
-
-NFA makeCharClass(string ccl) {
-    NFAState* ns = makeState(nextLabel());
-    NFAState* ts = makeState(nextLabel());
-    int i = 0; bool negate = false;
-    if (ccl[0] == '^') {
-        negate = true; 
-        i++;
-    }
-    while (i < ccl.length()) {
-        if (i+2 < ccl.length() && ccl[i+1] == '-') {
-            makeRangeClassTrans(ns, ts, ccl, negate, i);
-            i += 2;
-        } else {
-            makeRegClassTrans(ns, ts, ccl, negate, i);
-            i++;
-        }
-    }
-    return NFA(ns, ts);
-}
-
-// "The empty string"
-NFA makeEpsilonAtomic() {
-    NFAState* ns = makeState(nextLabel());
-    NFAState* ts = makeState(nextLabel());
-    ns->addTransition(Transition(ts));
-    return NFA(ns, ts);
-}
-
-NFA makeConcat(NFA a, NFA b) {
-    a.accept->addTransition(Transition(b.start));
-    a.accept = b.accept;
-    return a;
-}
-
-NFA makeAlternate(NFA a, NFA b) {
-    NFAState* ns = makeState(nextLabel());
-    NFAState* ts = makeState(nextLabel());
-    ns->addTransition(Transition(a.start));
-    ns->addTransition(Transition(b.start));
-    a.accept->addTransition(Transition(ts));
-    b.accept->addTransition(Transition(ts));
-    return NFA(ns, ts);
-}
-
-NFA makeKleene(NFA a, bool must) {
-    NFAState* ns = makeState(nextLabel());
-    NFAState* ts = makeState(nextLabel());
-    ns->addTransition(Transition(a.start));
-    if (!must)
-        ns->addTransition(Transition(ts));
-    a.accept->addTransition(Transition(ts));
-    a.accept->addTransition(Transition(a.start));
-    return NFA(ns, ts);
-}
-
-NFA makeZeorOrOne(NFA a) {
-    return makeAlternate(a, makeEpsilonAtomic());
-}
-
-
-
 class RECompiler {
     private:
         Stack<NFA> st;
+        string err;
+        re_ast* tree;
+        //states live as long as the compiler that made them, so the machines it returns
+        //are only good while it is around.
+        deque<NFAState> states;
+        int label;
+        NFAState* makeState(State st) {
+            states.push_back(NFAState(st));
+            return &states.back();
+        }
+        int nextLabel() {
+            return label++;
+        }
+        NFA makeAtomic(char ch) {
+            NFAState* ns = makeState(nextLabel());
+            NFAState* ts = makeState(nextLabel());
+            ns->addTransition(Transition(ch, ts));
+            return NFA(ns, ts);
+        }
+        //the whole class is one transition, with its ranges and negation worked out here
+        NFA makeCharClass(string ccl) {
+            NFAState* ns = makeState(nextLabel());
+            NFAState* ts = makeState(nextLabel());
+            CharClass chars;
+            int i = 0; bool negate = false;
+            if (ccl[0] == '^') {
+                negate = true; 
+                i++;
+            }
+            while (i < ccl.length()) {
+                if (i+2 < ccl.length() && ccl[i+1] == '-') {
+                    chars.addRange(ccl[i], ccl[i+2]);
+                    i += 2;
+                } else {
+                    chars.add(ccl[i]);
+                    i++;
+                }
+            }
+            if (negate)
+                chars.negate();
+            ns->addTransition(Transition(chars, ts));
+            return NFA(ns, ts);
+        }
+        // "The empty string"
+        NFA makeEpsilonAtomic() {
+            NFAState* ns = makeState(nextLabel());
+            NFAState* ts = makeState(nextLabel());
+            ns->addTransition(Transition(ts));
+            return NFA(ns, ts);
+        }
+        NFA makeConcat(NFA a, NFA b) {
+            a.accept->addTransition(Transition(b.start));
+            a.accept = b.accept;
+            return a;
+        }
+        NFA makeAlternate(NFA a, NFA b) {
+            NFAState* ns = makeState(nextLabel());
+            NFAState* ts = makeState(nextLabel());
+            ns->addTransition(Transition(a.start));
+            ns->addTransition(Transition(b.start));
+            a.accept->addTransition(Transition(ts));
+            b.accept->addTransition(Transition(ts));
+            return NFA(ns, ts);
+        }
+        NFA makeKleene(NFA a, bool must) {
+            NFAState* ns = makeState(nextLabel());
+            NFAState* ts = makeState(nextLabel());
+            ns->addTransition(Transition(a.start));
+            if (!must)
+                ns->addTransition(Transition(ts));
+            a.accept->addTransition(Transition(ts));
+            a.accept->addTransition(Transition(a.start));
+            return NFA(ns, ts);
+        }
+        NFA makeZeorOrOne(NFA a) {
+            return makeAlternate(a, makeEpsilonAtomic());
+        }
         void trav(re_ast* node) {
             if (node != nullptr) {
                 if (node->type == LITERAL) {
@@ -339,6 +357,12 @@ class RECompiler {
                             NFA lhs = st.pop();
                             st.push(makeZeorOrOne(lhs));
                         } break;
+                        //matching always starts at the beginning of the text, and the anchors 
+                        //aren't otherwise enforced, so only what they enclose is compiled.
+                        case '^':
+                        case '$':
+                            trav(node->left);
+                            break;
                         default:
                             break;
                     }
@@ -347,20 +371,36 @@ class RECompiler {
         }
     public:
         RECompiler() {
-
+            label = 0;
+            tree = nullptr;
         }
         NFA compile(re_ast* node) {
             trav(node);
             return st.pop();
         }
+        //a pattern that doesn't parse, or needs more than MAX_STATE states, compiles to a 
+        //machine that matches nothing.
+        NFA compile(string pattern) {
+            REParser parser;
+            re_ast* ast = parser.parse(pattern);
+            err = parser.lastError();
+            if (ast != nullptr) {
+                NFA nfa = compile(ast);
+                if (label <= MAX_STATE) {
+                    tree = ast;
+                    return nfa;
+                }
+                err = "Pattern too large";
+            }
+            return NFA(makeState(nextLabel()), makeState(nextLabel()));
+        }
+        string lastError() {
+            return err;
+        }
+        //what the last pattern compiled parsed to, nullptr if it was invalid
+        re_ast* syntaxTree() {
+            return tree;
+        }
 };
 
-NFA compile(string pattern) {
-    REParser parser;
-    re_ast* ast = parser.parse(pattern);
-    preorder(ast, 1);
-    RECompiler compiler;
-    return compiler.compile(ast);
-}
-
 #endif
\ No newline at end of file
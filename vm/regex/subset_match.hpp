@@ -1,68 +1,281 @@
 #ifndef subset_match_hpp
 #define subset_match_hpp
 #include <iostream>
-#include <set>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
 #include "re_compiler.hpp"
+#include "prefilter.hpp"
 using namespace std;
 
-set<NFAState*> move(char ch, set<NFAState*> states) {
-    set<NFAState*> next;
-    for (NFAState* state : states) {
-        for (Transition t : state->transitions) {
-            if (t.ch == ch || t.ch == '.') {
-                if (!t.is_epsilon && next.find(t.dest) == next.end()) {
-                    next.insert(t.dest);
+// A set of NFA states, one bit per state.
+struct StateSet {
+    uint64_t words[MAX_STATE/64];
+    StateSet() {
+        for (auto & w : words) w = 0;
+    }
+    void insert(int state) {
+        words[state/64] |= 1ULL << (state%64);
+    }
+    bool contains(int state) const {
+        return words[state/64] & (1ULL << (state%64));
+    }
+    bool empty() const {
+        for (auto w : words)
+            if (w) return false;
+        return true;
+    }
+    StateSet& operator|=(const StateSet& rhs) {
+        for (int i = 0; i < MAX_STATE/64; i++)
+            words[i] |= rhs.words[i];
+        return *this;
+    }
+    StateSet operator&(const StateSet& rhs) const {
+        StateSet res;
+        for (int i = 0; i < MAX_STATE/64; i++)
+            res.words[i] = words[i] & rhs.words[i];
+        return res;
+    }
+    bool operator<(const StateSet& rhs) const {
+        for (int i = 0; i < MAX_STATE/64; i++)
+            if (words[i] != rhs.words[i])
+                return words[i] < rhs.words[i];
+        return false;
+    }
+};
+
+// The NFA with its states numbered and simulated a set at a time. Thompson's construction
+// only ever gives a state character edges to the one state it makes along with it, so what
+// follows reading a character is fixed per state: the closure of that state. A step is then
+// the states that read c, masked out of the current set, with their closures or'd together.
+class BitNFA {
+    private:
+        StateSet reads[256];
+        StateSet follow[MAX_STATE];
+        StateSet first;
+        int accept;
+        map<NFAState*, int> number(NFA& nfa) {
+            map<NFAState*, int> ids;
+            Stack<NFAState*> st;
+            st.push(nfa.start);
+            ids[nfa.start] = 0;
+            while (!st.empty()) {
+                NFAState* curr = st.pop();
+                for (auto & t : curr->transitions) {
+                    if (ids.find(t.dest) == ids.end() && ids.size() < MAX_STATE) {
+                        int id = ids.size();
+                        ids[t.dest] = id;
+                        st.push(t.dest);
+                    }
                 }
             }
+            return ids;
         }
+        StateSet closure(NFAState* from, map<NFAState*, int>& ids) {
+            StateSet seen;
+            Stack<NFAState*> st;
+            st.push(from);
+            seen.insert(ids[from]);
+            while (!st.empty()) {
+                NFAState* curr = st.pop();
+                for (auto & t : curr->transitions) {
+                    if (t.is_epsilon && !seen.contains(ids[t.dest])) {
+                        seen.insert(ids[t.dest]);
+                        st.push(t.dest);
+                    }
+                }
+            }
+            return seen;
+        }
+    public:
+        BitNFA(NFA nfa) {
+            map<NFAState*, int> ids = number(nfa);
+            accept = ids.find(nfa.accept) != ids.end() ? ids[nfa.accept]:-1;
+            first = closure(nfa.start, ids);
+            for (auto & state : ids) {
+                for (auto & t : state.first->transitions) {
+                    if (t.is_epsilon)
+                        continue;
+                    follow[state.second] = closure(t.dest, ids);
+                    for (int c = 0; c < 256; c++)
+                        if (t.chars.contains(c))
+                            reads[c].insert(state.second);
+                }
+            }
+        }
+        StateSet start() {
+            return first;
+        }
+        bool accepting(const StateSet& states) {
+            return accept != -1 && states.contains(accept);
+        }
+        StateSet step(const StateSet& states, char ch) {
+            StateSet active = states & reads[(unsigned char)ch];
+            StateSet next;
+            for (int i = 0; i < MAX_STATE/64; i++) {
+                for (uint64_t w = active.words[i]; w != 0; w &= w - 1)
+                    next |= follow[i*64 + __builtin_ctzll(w)];
+            }
+            return next;
+        }
+};
+
+//past this many states the table is thrown away and rebuilt from whatever is being matched
+const int MAX_DFA_STATES = 2048;
+//a match that has thrown it away this often goes on without it
+const int MAX_DFA_FLUSHES = 4;
+const int DFA_DEAD = 0;
+const int DFA_UNKNOWN = -1;
+
+struct DFAState {
+    StateSet states;
+    bool accepting;
+    int next[256];
+    DFAState(StateSet s, bool acc) : states(s), accepting(acc) {
+        for (int i = 0; i < 256; i++)
+            next[i] = DFA_UNKNOWN;
     }
-    return next;
-}
+};
+
+// The subset construction done lazily: a DFA state is only built the first time the text
+// leads to it, and each edge the first time it is followed, so matching costs a table
+// lookup per character once the strings it sees have been seen before. State 0 is the
+// empty set, it never leads anywhere.
+class LazyDFA {
+    private:
+        BitNFA nfa;
+        vector<DFAState> dstates;
+        map<StateSet, int> index;
+        int flushes;
+        int addState(StateSet states) {
+            auto it = index.find(states);
+            if (it != index.end())
+                return it->second;
+            dstates.push_back(DFAState(states, nfa.accepting(states)));
+            index[states] = dstates.size()-1;
+            return dstates.size()-1;
+        }
+        void reset() {
+            dstates.clear();
+            index.clear();
+            addState(StateSet());
+            addState(nfa.start());
+        }
+    public:
+        LazyDFA(NFA machine) : nfa(machine), flushes(0) {
+            reset();
+        }
+        int start() {
+            return 1;
+        }
+        bool accepting(int state) {
+            return dstates[state].accepting;
+        }
+        int step(int state, char ch) {
+            int next = dstates[state].next[(unsigned char)ch];
+            if (next != DFA_UNKNOWN)
+                return next;
+            StateSet states = nfa.step(dstates[state].states, ch);
+            if (dstates.size() >= MAX_DFA_STATES) {
+                StateSet from = dstates[state].states;
+                reset();
+                flushes++;
+                state = addState(from);
+            }
+            next = addState(states);
+            dstates[state].next[(unsigned char)ch] = next;
+            return next;
+        }
+        StateSet& states(int state) {
+            return dstates[state].states;
+        }
+        BitNFA& machine() {
+            return nfa;
+        }
+        int flushCount() {
+            return flushes;
+        }
+};
 
-set<NFAState*> e_closure(set<NFAState*> states) {
-    set<NFAState*> next = states;
-    Stack<NFAState*> st;
-    for (auto s : states) {
-        st.push(s);
+// A pattern compiled once, along with the DFA it has built up so far. The machine points
+// into the compiler's states, so it has to stay where it was made.
+struct Regex {
+    string pattern;
+    RECompiler compiler;
+    LazyDFA dfa;
+    Prefilter prefilter;
+    Regex(string pat) : pattern(pat), dfa(compiler.compile(pat)), prefilter(compiler.syntaxTree()) { }
+    Regex(const Regex&) = delete;
+    Regex& operator=(const Regex&) = delete;
+    bool valid() {
+        return compiler.lastError().empty();
     }
-    while (!st.empty()) {
-        NFAState* curr = st.pop();
-        for (auto t : curr->transitions) {
-            if (t.is_epsilon && next.find(t.dest) == next.end()) {
-                next.insert(t.dest);
-                st.push(t.dest);
+    string errorMessage() {
+        return "Error: " + compiler.lastError() + " in regex '" + pattern + "'.";
+    }
+    bool match(const string& text) {
+        if (!prefilter.mayMatch(text))
+            return false;
+        int state = dfa.start();
+        int matchLen = 0;
+        int flushes = dfa.flushCount();
+        char c;
+        for (int i = 0; (c = text[i]) != '\0'; i++) {
+            if (state == DFA_DEAD || c == '\n')
+                return matchLen > 0;
+            if (dfa.flushCount() - flushes > MAX_DFA_FLUSHES)
+                return simulate(text, i, dfa.states(state), matchLen);
+            state = dfa.step(state, c);
+            if (dfa.accepting(state)) {
+                matchLen = i;
             }
         }
+        return dfa.accepting(state);
     }
-    return next;
-}
-
-bool recognizeString(NFA& nfa, string text) {
-    set<NFAState*> states = {nfa.start};
-    states = e_closure(states);
-    int i = 0;
-    int matchFrom = 0;
-    int matchLen = 0;
-    char c;
-    for (int i = 0; (c = text[i]) != '\0'; i++) {
-        if (states.empty() || c == '\n')
-            return matchLen > 0;
-        states = e_closure(move(c, states));
-        if (states.find(nfa.accept) != states.end()) {
-            cout<<"Match Found: ";
-            for (int t = matchFrom; t <= i; t++) {
-                cout<<text[t];
+    //the same walk on the NFA itself, for text that visits more states than the DFA can keep
+    bool simulate(const string& text, int i, StateSet states, int matchLen) {
+        BitNFA& nfa = dfa.machine();
+        char c;
+        for (; (c = text[i]) != '\0'; i++) {
+            if (states.empty() || c == '\n')
+                return matchLen > 0;
+            states = nfa.step(states, c);
+            if (nfa.accepting(states)) {
+                matchLen = i;
             }
-            cout<<endl;
-            matchLen = i - matchFrom;
         }
+        return nfa.accepting(states);
     }
-    return states.find(nfa.accept) != states.end();
-}
+};
 
-bool matchRegex(string pattern, string text) {
-    NFA nfa = compile(pattern);
-    return recognizeString(nfa, text);
-}
+// Patterns which aren't known until runtime are compiled the first time =~ sees them and
+// kept while they are among the last MAX_CACHED_REGEXES used, constant ones are compiled by
+// the code generator instead. Each can hold a DFA of thousands of states, so a program building
+// patterns as it goes would otherwise keep every one it ever matched against.
+const int MAX_CACHED_REGEXES = 64;
+
+class RegexCache {
+    private:
+        list<Regex> recent; //most recently used first
+        unordered_map<string, list<Regex>::iterator> compiled;
+    public:
+        //fresh is set when this call is the one that compiled it
+        Regex* get(string& pattern, bool& fresh) {
+            auto it = compiled.find(pattern);
+            fresh = it == compiled.end();
+            if (!fresh) {
+                recent.splice(recent.begin(), recent, it->second);
+                return &recent.front();
+            }
+            if (compiled.size() >= MAX_CACHED_REGEXES) {
+                compiled.erase(recent.back().pattern);
+                recent.pop_back();
+            }
+            recent.emplace_front(pattern);
+            compiled[pattern] = recent.begin();
+            return &recent.front();
+        }
+};
 
-#endif
\ No newline at end of file
+#endif
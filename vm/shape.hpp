@@ -0,0 +1,55 @@
+#ifndef shape_hpp
+#define shape_hpp
+#include <string>
+#include <vector>
+#include <unordered_map>
+using namespace std;
+
+// A shape is an object's layout: which slot each of its fields lives in. Shapes form a tree
+// rooted at the empty shape, adding a field follows (or creates) the transition to a child,
+// so every object built up from the same fields in the same order shares one shape. Shapes
+// live as long as their isolate does and are never collected.
+struct Shape {
+    Shape* parent;
+    vector<string> names;
+    unordered_map<string, int> slots;
+    unordered_map<string, Shape*> transitions;
+    Shape(Shape* p = nullptr, string field = "") : parent(p) {
+        if (parent != nullptr) {
+            names = parent->names;
+            slots = parent->slots;
+            slots[field] = names.size();
+            names.push_back(field);
+        }
+    }
+    Shape(const Shape& shape) = delete;
+    ~Shape() {
+        for (auto & child : transitions)
+            delete child.second;
+    }
+    int size() {
+        return names.size();
+    }
+    int slotOf(const string& name) {
+        auto it = slots.find(name);
+        return it == slots.end() ? -1:it->second;
+    }
+    Shape* extend(const string& name) {
+        auto it = transitions.find(name);
+        if (it != transitions.end())
+            return it->second;
+        Shape* child = new Shape(this, name);
+        transitions[name] = child;
+        return child;
+    }
+};
+
+// A monomorphic inline cache for one ldfield/stfield site, the slot is -1 when
+// objects of that shape don't have the field.
+struct FieldCache {
+    Shape* shape;
+    int slot;
+    FieldCache(Shape* s = nullptr, int sl = -1) : shape(s), slot(sl) { }
+};
+
+#endif
@@ -5,8 +5,11 @@
 #include <cmath>
 #include <cstring>
 #include <deque>
-#include "alloc.hpp"
+#include <cstdint>
+#include <type_traits>
+#include "isolate.hpp"
 #include "heapitem.hpp"
+#include "shape.hpp"
 using namespace std;
 
 
@@ -14,115 +17,113 @@ enum SIType {
     NIL, INTEGER, NUMBER, BOOLEAN, OBJECT
  };
 
+// StackItems are NaN-boxed into a single 64 bit word. Any double is stored as-is
+// (NaNs are canonicalized so they can never be mistaken for a tagged value), everything 
+// else lives in the payload of a quiet NaN with bit 50 set, bits 48-49 hold the tag:
+//    OBJECT:   1 | 11111111111 | 11 | 00 | 48 bit GCItem*
+//    NIL:      0 | 11111111111 | 11 | 01 | 0
+//    BOOLEAN:  0 | 11111111111 | 11 | 10 | 0 or 1
+//    INTEGER:  0 | 11111111111 | 11 | 11 | 32 bit int
+// This keeps StackItem trivially copyable, and every push, pop or store a single word move.
+static const uint64_t SI_SIGN_BIT = 0x8000000000000000ULL;
+static const uint64_t SI_QNAN     = 0x7ffc000000000000ULL;
+static const uint64_t SI_CANON_NAN = 0x7ff8000000000000ULL;
+static const uint64_t SI_TAG_NIL  = SI_QNAN | (1ULL << 48);
+static const uint64_t SI_TAG_BOOL = SI_QNAN | (2ULL << 48);
+static const uint64_t SI_TAG_INT  = SI_QNAN | (3ULL << 48);
+static const uint64_t SI_TAG_MASK = SI_SIGN_BIT | SI_QNAN | (3ULL << 48);
+static const uint64_t SI_PTR_MASK = 0x0000ffffffffffffULL;
+
 struct StackItem {
-    int type;
-    union {
-        int intval;
-        bool boolval;
-        double numval;
-        GCItem* objval;
-    };
+    uint64_t bits;
+    bool isNumber() const { return (bits & SI_QNAN) != SI_QNAN; }
+    bool isObject() const { return (bits & (SI_QNAN|SI_SIGN_BIT)) == (SI_QNAN|SI_SIGN_BIT); }
+    bool isNil() const { return bits == SI_TAG_NIL; }
+    int type() const {
+        if (isNumber()) return NUMBER;
+        if (bits & SI_SIGN_BIT) return OBJECT;
+        switch ((bits >> 48) & 3) {
+            case 1: return NIL;
+            case 2: return BOOLEAN;
+            case 3: return INTEGER;
+        }
+        return NIL;
+    }
+    double numval() const { double d; memcpy(&d, &bits, sizeof(d)); return d; }
+    int intval() const { return (int)(uint32_t)bits; }
+    GCItem* objval() const { return (GCItem*)(uintptr_t)(bits & SI_PTR_MASK); }
+    //truthiness, only false, nil and zero are false.
+    bool boolval() const {
+        switch (type()) {
+            case BOOLEAN: return bits & 1;
+            case NUMBER:  return numval() != 0;
+            case INTEGER: return intval() != 0;
+            case OBJECT:  return true;
+        }
+        return false;
+    }
+    //numeric view used when mixing integers, numbers and booleans in arithmetic
+    double asNumber() const {
+        switch (type()) {
+            case NUMBER:  return numval();
+            case INTEGER: return intval();
+            case BOOLEAN: return bits & 1;
+        }
+        return 0;
+    }
     string toString() {
-        switch (type) {
+        switch (type()) {
             case INTEGER: {
-                return to_string(intval);
+                return to_string(intval());
             } break;
             case NUMBER: {
-                if (fmod(numval,1) == 0)
-                    return to_string((int)numval);
-                return to_string(numval);
+                if (fmod(numval(),1) == 0)
+                    return to_string((int)numval());
+                return to_string(numval());
             } break;
-            case OBJECT: return objval->toString();
-            case BOOLEAN: return boolval ? "true":"false";
+            case OBJECT: return objval()->toString();
+            case BOOLEAN: return boolval() ? "true":"false";
             case NIL: return "(nil)";
             
         }
         return "(nil)";
     }
-    StackItem(int value) { intval = value; type = INTEGER; }
-    StackItem(double value) { numval = value; type = NUMBER; }
-    StackItem(bool balue) { boolval = balue; type = BOOLEAN; }
-    StackItem(string value) { objval = alloc.alloc(new string(value)); type = OBJECT; }
-    StackItem(Closure* c) { objval = alloc.alloc(c); type = OBJECT; }
-    StackItem(deque<StackItem>* l) { objval = alloc.alloc(l); type = OBJECT; }
-    StackItem(ClassObject* o) { objval = alloc.alloc(o); type = OBJECT; }
-    StackItem(GCItem* i) { objval = i; type = OBJECT; }
-    StackItem() { type = NIL; intval = -66; }
-    StackItem(const StackItem& si) {
-        type = si.type;
-        switch (si.type) {
-            case INTEGER: intval = si.intval; break;
-            case NUMBER: numval = si.numval; break;
-            case BOOLEAN: boolval = si.boolval; break;
-            case OBJECT: objval = si.objval; break;
-        }
-    }
-    StackItem& operator=(const StackItem& si) {
-        if (this == &si)
-            return *this;
-        type = si.type;
-        switch (si.type) {
-            case INTEGER: intval = si.intval; break;
-            case NUMBER: numval = si.numval; break;
-            case BOOLEAN: boolval = si.boolval; break;
-            case OBJECT: objval = si.objval; break;
-        }
-        return *this;
+    StackItem(int value) { bits = SI_TAG_INT | (uint32_t)value; }
+    StackItem(double value) { 
+        if (value != value) bits = SI_CANON_NAN;
+        else memcpy(&bits, &value, sizeof(bits));
     }
+    StackItem(bool balue) { bits = SI_TAG_BOOL | (balue ? 1:0); }
+    StackItem(string value) { setObject(currentHeap().alloc<string>(value)); }
+    StackItem(ClassObject* o) { setObject(currentHeap().alloc(o)); }
+    StackItem(GCItem* i) { setObject(i); }
+    StackItem() { bits = SI_TAG_NIL; }
+    void setObject(GCItem* i) { bits = SI_SIGN_BIT | SI_QNAN | ((uint64_t)(uintptr_t)i & SI_PTR_MASK); }
     bool lessThan(StackItem& si) {
-        switch (si.type) {
-            case INTEGER: {
-                switch (type) {
-                    case INTEGER: return intval < si.intval;
-                    case NUMBER: return  numval < si.intval;
-                    case BOOLEAN: return boolval < si.intval;
-                    case OBJECT: return false;
-                }
-            } break;
-            case BOOLEAN: {
-                switch (type) {
-                    case INTEGER: return intval < si.boolval;
-                    case NUMBER: return  numval < si.boolval;
-                    case BOOLEAN: return boolval < si.boolval;
-                    case OBJECT: false;
-                }
-            } break;
-            case NUMBER: {
-                switch (type) {
-                    case INTEGER: return intval < si.numval;
-                    case NUMBER:  return  numval < si.numval;
-                    case BOOLEAN: return boolval < si.numval;
-                    case OBJECT: false;
-                }
-            } break;
-            case OBJECT: {
-            switch (type) {
-                    case INTEGER: return false;
-                    case NUMBER: return  false;
-                    case BOOLEAN: return false;
-                    case OBJECT: {
-                        if (objval->type == STRING && si.objval->type == STRING)
-                            return strcmp(objval->strval->data(), si.objval->strval->data()) < 0;
-                    }
-                }
-            } break;
+        int lt = type(), rt = si.type();
+        if (lt == NIL || rt == NIL)
+            return false;
+        if (lt != OBJECT && rt != OBJECT)
+            return asNumber() < si.asNumber();
+        if (lt == OBJECT && rt == OBJECT) {
+            if (objval()->type == STRING && si.objval()->type == STRING)
+                return strcmp(objval()->strval->data(), si.objval()->strval->data()) < 0;
         }
         return false;
     }
     bool equals(StackItem& rhs) {
-        if (type != rhs.type)
+        if (type() != rhs.type())
             return false;
-        switch (type) {
-            case INTEGER: return intval == rhs.intval;
-            case NUMBER:  return numval == rhs.numval;
-            case BOOLEAN: return boolval == rhs.boolval;
-            case NIL:     return true;
-            case OBJECT:  return objval->equals(rhs.objval);
+        switch (type()) {
+            case NUMBER:  return numval() == rhs.numval();
+            case OBJECT:  return objval()->equals(rhs.objval());
+            default:
+                break;
         }
-        return false;
+        return bits == rhs.bits;
     }
     StackItem& add(StackItem& rhs) {
-        if (type == OBJECT || rhs.type == OBJECT) {
+        if (isObject() || rhs.isObject()) {
             string str;
             for (char c : toString()) {
                 str.push_back(c);
@@ -130,120 +131,124 @@ struct StackItem {
             for (char c : rhs.toString()) {
                 str.push_back(c);
             }
-            objval = alloc.alloc(new string(str));
-            type = OBJECT;
+            setObject(currentHeap().alloc<string>(str));
         } else {
-            double v = rhs.type == INTEGER ? rhs.intval:rhs.numval;
-            switch (type) {
+            double v = rhs.asNumber();
+            switch (type()) {
                 case INTEGER: {
-                    intval += v;
+                    *this = StackItem((int)(intval() + v));
                 } break;
                 case NUMBER: {
-                    numval += v;
+                    *this = StackItem(numval() + v);
                 } break;
                 case BOOLEAN: {
-                    boolval += v;
+                    *this = StackItem((bool)(boolval() + v));
                 } break;
             }
         }
         return *this;
     }
     StackItem& sub(StackItem& rhs) {
-        if (rhs.type == STRING) {
+        if (rhs.isObject() || rhs.isNil()) {
             return *this;
         } else {
-            double v = rhs.type == INTEGER ? rhs.intval:rhs.numval;
-            switch (type) {
+            double v = rhs.asNumber();
+            switch (type()) {
                 case INTEGER: {
-                    intval -= v;
+                    *this = StackItem((int)(intval() - v));
                 } break;
                 case NUMBER: {
-                    numval -= v;
+                    *this = StackItem(numval() - v);
                 } break;
                 case BOOLEAN: {
-                    boolval -= v;
+                    *this = StackItem((bool)(boolval() - v));
                 } break;
             }
         }
         return *this;
     }
     StackItem& mul(StackItem& rhs) {
-        if (rhs.type == STRING) {
-            return *this;
-        } else if (type == STRING && rhs.type == INTEGER) {
-            string* ns = new string(*objval->strval);
-            for (int i = 1; i < rhs.numval; i++) {
-                *ns += (*objval->strval);
-            }
-            objval->strval = ns;
+        if (rhs.isObject() || rhs.isNil()) {
             return *this;
         } else {
-            double v = rhs.type == INTEGER ? rhs.intval:rhs.numval;
-            switch (type) {
+            double v = rhs.asNumber();
+            switch (type()) {
                 case INTEGER: {
-                    intval *= v;
+                    *this = StackItem((int)(intval() * v));
                 } break;
                 case NUMBER: {
-                    numval *= v;
+                    *this = StackItem(numval() * v);
                 } break;
                 case BOOLEAN: {
-                    boolval *= v;
+                    *this = StackItem(boolval() && v != 0);
                 } break;
             }
         }
         return *this;
     }
     StackItem& div(StackItem& rhs) {
-        if (rhs.type == STRING) {
+        if (rhs.isObject() || rhs.isNil()) {
             return *this;
         } else {
-            double v = rhs.type == INTEGER ? rhs.intval:rhs.numval;
-            switch (type) {
+            double v = rhs.asNumber();
+            switch (type()) {
                 case INTEGER: {
-                    intval /= v;
+                    *this = StackItem((int)(intval() / v));
                 } break;
                 case NUMBER: {
-                    numval /= v;
+                    *this = StackItem(numval() / v);
                 } break;
                 case BOOLEAN: {
-                    boolval /= v;
+                    *this = StackItem((bool)(boolval() / v));
                 } break;
             }
         }
         return *this;
     }
     StackItem& mod(StackItem& rhs) {
-        if (rhs.type == STRING) {
+        if (rhs.isObject() || rhs.isNil()) {
             return *this;
         } else {
-           numval = fmod(numval,rhs.numval); 
+           *this = StackItem(fmod(asNumber(), rhs.asNumber()));
         }
         return *this;
     }
 };
 
+static_assert(sizeof(StackItem) == 8, "StackItem is expected to be a single NaN-boxed word");
+static_assert(is_trivially_copyable<StackItem>::value, "StackItem must be trivially copyable");
+
 struct BlockScope;
 
+//fields are stored in slots, which slot holds which field is up to the object's shape.
 struct ClassObject  {
     string name;
     int cpIdx;
-    unordered_map<string, StackItem> fields;
+    Shape* shape;
+    vector<StackItem> slots;
     bool instantiated;
     BlockScope* scope;
     ClassObject(string n = "",  BlockScope* s = nullptr) {
         name = n;
         scope = s;
+        cpIdx = -1;
+        instantiated = false;
+        shape = rootShape();
+    }
+    void addField(const string& fieldName) {
+        shape = shape->extend(fieldName);
+        slots.push_back(StackItem());
     }
 };
 
-string classToString(ClassObject* obj) {
+inline string classToString(ClassObject* obj) {
     if (obj == nullptr) {
         return "nil";
     }
     if (obj->instantiated) {
         string str = obj->name + "{ ";
-        for (auto m : obj->fields) {
-            str += m.first + ": " + m.second.toString() +" ";
+        for (int i = 0; i < obj->shape->size(); i++) {
+            str += obj->shape->names[i] + ": " + obj->slots[i].toString() +" ";
         }
         str += "} ";
         return str;
@@ -251,17 +256,12 @@ string classToString(ClassObject* obj) {
     return obj->name;
 }
 
-void freeClass(ClassObject* obj) {
-    if (obj != nullptr) {
-        for (auto & m : obj->fields) {
-            if (m.second.type == OBJECT)
-                alloc.free(m.second.objval);
-        }
-        delete obj;
-    }
+inline void GCAllocator::writeBarrier(GCItem* container, StackItem& value) {
+    if (value.isObject() && isYoung(value.objval()) && !isYoung(container) && !container->remembered)
+        remember(container);
 }
 
-string listToString(deque<StackItem>* list) {
+inline string listToString(deque<StackItem>* list) {
         string str = "[";
         for (auto m : *list) {
             str += m.toString() + " ";
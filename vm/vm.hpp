@@ -1,222 +1,795 @@
 #ifndef vm_hpp
 #define vm_hpp
 #include "regex/subset_match.hpp"
+#include <functional>
+#include <random>
 #include "gc.hpp"
+#include "native.hpp"
+#include "pairprofile.hpp"
+#include "jit.hpp"
 using namespace std;
 
 static const int BLOCK_CPIDX = -420;
 static const int MAX_OP_STACK = 1337;
+//native code recurses on the C stack, past this depth calls are interpreted instead
+static const int MAX_NATIVE_DEPTH = 2000;
+//native code only checks for stack overflow at calls and loop back edges, it isn't entered
+//this close to the limit and functions that could push past it between checks aren't compiled
+static const int JIT_STACK_MARGIN = 512;
+
+// SWITCH_DISPATCH fetches a copy of each instruction and decodes it through execute(),
+// THREADED_DISPATCH resolves every instruction in codePage to the address of its handler 
+// once at load time and jumps straight from handler to handler (requires computed goto).
+enum DispatchMode {
+    SWITCH_DISPATCH, THREADED_DISPATCH
+};
+
+//GLAUX_SEED makes random() repeatable, for comparing output between engines. Every VM
+//starts its own generator from it, so VMs on other threads don't disturb the sequence.
+inline unsigned int rngSeedFromEnv() {
+    if (char* seed = getenv("GLAUX_SEED"))
+        return atoi(seed);
+    return random_device()();
+}
+
+#if defined(__GNUC__)
+#define HAS_COMPUTED_GOTO 1
+#else
+#define HAS_COMPUTED_GOTO 0
+#endif
 
 class VM {
+    friend struct CompiledProgram;
+    friend class HeapImage;
     private:
         friend class GarbageCollector;
+        //declared first so it is the last thing torn down, everything below allocates out of it
+        Isolate isolate;
+        ostream* output;
         bool running = false;
         int verbLev;
+        DispatchMode dispatchMode;
         Instruction haltSentinel;
         vector<Instruction> codePage;
+        vector<void*> threadedCode;
+        void** handlerTable;
         int ip;
         int sp;
         ConstPool constPool;
         GarbageCollector collector;
+        FramePool framePool;
+        vector<FieldCache> fieldCaches;
+        RegexCache regexes;
+        mt19937 rng;
+        PairProfile* pairProfile;
+        CodeBuffer* jitCode;
+        vector<Function*> jitted;
+        bool nativeEnabled;
+        bool jitEnabled;
+        int jitThreshold;
+        int nativeDepth;
+        bool tailFromNative;
+        Function* tailTarget;
         ActivationRecord* callstk;
         ActivationRecord* globals;
         StackItem opstk[MAX_OP_STACK];
-        ActivationRecord* walkChain(int d) {
-            if (d == GLOBAL_SCOPE) return globals;
-            if (d == LOCAL_SCOPE) return callstk;
-            auto x = callstk;
-            while (x != nullptr && d > 0) {
-                x = x->access;
-                d--;
-            }
-            return x;
-        }
         StackItem& top(int depth = 0) {
             return opstk[sp-depth];
         }
-        ActivationRecord* mostRecentAR(int func_id) {
-            auto x = callstk;
-            while (x != nullptr) {
-                if (x->cp_index == func_id) {
-                    break;
+        //upvalues are captured from the frame executing mkclosure (or entblk), 
+        //either straight out of its locals or passed down from its own closure.
+        GCItem* makeClosure(Function* func) {
+            GCItem* item = currentHeap().alloc<Closure>(func);
+            Closure* cl = item->closure;
+            cl->upvalues.reserve(func->upvalues.size());
+            for (auto & desc : func->upvalues) {
+                if (desc.isLocal) {
+                    cl->upvalues.push_back(callstk->captureUpvalue(desc.index));
+                } else {
+                    cl->upvalues.push_back(callstk->closure->closure->upvalues[desc.index]);
                 }
-                x = x->access;
             }
-            return (x == nullptr) ? callstk:x;
+            return item;
         }
         void closeOver(Instruction& inst) {
-            int func_id = inst.operand[0].intval;
-            auto funcobj = constPool.get(func_id);
-            if (funcobj.type == OBJECT && funcobj.objval->type == CLOSURE) {
-                auto func = funcobj.objval->closure->func;
-                auto env = mostRecentAR(func_id);
-                opstk[++sp] = StackItem(alloc.alloc(new Closure(func, env)));
+            auto funcobj = constPool.get(inst.a);
+            if (funcobj.type() == OBJECT && funcobj.objval()->type == CLOSURE) {
+                opstk[++sp] = StackItem(makeClosure(funcobj.objval()->closure->func));
             } else {
-                cout<<"Fatal Error: Invalid Environment."<<endl;
+                out()<<"Fatal Error: Invalid Environment."<<endl;
                 running = false;
             }
         }
         void openBlock(Instruction& inst) {
-            callstk = new ActivationRecord(BLOCK_CPIDX, ip, callstk, callstk);
+            Function* func = constPool.get(inst.a).objval()->closure->func;
+            GCItem* cl = func->upvalues.empty() ? nullptr:makeClosure(func);
+            callstk = framePool.acquire(func->nlocals, BLOCK_CPIDX, ip, callstk, cl);
         }
         void closeBlock() {
             if (callstk != nullptr && callstk->control != nullptr) {
+                auto done = callstk;
                 callstk = callstk->control;
+                framePool.release(done);
             }
-            if (verbLev > 1) cout<<"Leaving scope."<<endl;
+            if (verbLev > 1) out()<<"Leaving scope."<<endl;
+        }
+        //collections only happen here: on calls and on backward jumps, so every loop and
+        //every recursion passes through one. Allocation between safepoints that doesn't
+        //fit the nursery goes straight to the old generation.
+        void safepoint() {
+            if (collector.ready()) collectGarbage();
+        }
+        __attribute__((noinline)) void collectGarbage() {
+            collector.run(callstk, opstk, sp, &constPool);
+        }
+        //the callee's slot becomes the result's, the arguments below it stay put until the native returns
+        void callNative(NativeFunction* native, int numArgs) {
+            int base = sp - numArgs;
+            opstk[sp] = StackItem();
+            NativeArgs args(&opstk[base], numArgs, opstk[sp]);
+            native->fn(*this, args);
+            opstk[base] = opstk[base + numArgs];
+            sp = base;
+        }
+        bool isNative(StackItem& si) {
+            return si.type() == OBJECT && si.objval()->type == NATIVE;
         }
         void callProcedure(Instruction& inst) {
-            int numArgs = inst.operand[1].intval;
-            int cpIdx = inst.operand[0].intval;
-            if (opstk[sp].type == OBJECT && opstk[sp].objval->type == CLOSURE) {
-                Closure* close = opstk[sp--].objval->closure;
+            int numArgs = inst.b;
+            int cpIdx = inst.a;
+            if (isNative(opstk[sp])) {
+                callNative(opstk[sp].objval()->nativeFn, numArgs);
+                return;
+            }
+            if (opstk[sp].type() == OBJECT && opstk[sp].objval()->type == CLOSURE) {
+                GCItem* running = opstk[sp--].objval();
+                Closure* close = running->closure;
                 if (close != nullptr) {
-                    callstk = new ActivationRecord(cpIdx, ip, callstk, close->env);
+                    int nslots = max(close->func->nlocals, numArgs+1);
+                    callstk = framePool.acquire(nslots, cpIdx, ip, callstk, running);
                     for (int i = numArgs; i > 0; i--) {
                         callstk->locals[i] = opstk[sp--];
                     }
                     ip = close->func->start_ip;
+                    safepoint();
+                    enterNative(close->func, false);
                     return;
                 }
             }
-            cout <<"Fatal error: attempted function application without a function."<<endl;
+            out() <<"Fatal error: attempted function application without a function."<<endl;
             running = false;
         }
+        //the caller's frame is done once its arguments are on the stack, so release it 
+        //first and the callee usually gets the very same frame back from the pool.
+        //natives have no frame to replace, so the caller returns their result as soon as they are done
+        void tailCallProcedure(Instruction& inst) {
+            int numArgs = inst.b;
+            if (isNative(opstk[sp]) && callstk != globals) {
+                callNative(opstk[sp].objval()->nativeFn, numArgs);
+                if (running)
+                    retProcedure();
+                return;
+            }
+            if (opstk[sp].type() == OBJECT && opstk[sp].objval()->type == CLOSURE && callstk != globals) {
+                GCItem* callee = opstk[sp--].objval();
+                Closure* close = callee->closure;
+                if (close != nullptr) {
+                    int nslots = max(close->func->nlocals, numArgs+1);
+                    ActivationRecord* done = callstk;
+                    int ra = done->ret_addr;
+                    ActivationRecord* calling = done->control;
+                    framePool.release(done);
+                    callstk = framePool.acquire(nslots, inst.a, ra, calling, callee);
+                    for (int i = numArgs; i > 0; i--) {
+                        callstk->locals[i] = opstk[sp--];
+                    }
+                    ip = close->func->start_ip;
+                    safepoint();
+                    enterNative(close->func, true);
+                    return;
+                }
+            }
+            callProcedure(inst);
+        }
+        //Native code, compiled by the JIT once a function has been called jitThreshold times or
+        //ahead of time (compile/cppgen.hpp). Calls to a function with native code run that instead,
+        //it starts with the callee's frame already set up and ip at start_ip. Native code leaves
+        //with the VM in a state the interpreter can pick up from: usually returned, with ip at
+        //the return address.
+        typedef void (*NativeCode)(VM*);
+        typedef void (*JitHelper)(VM*, Instruction*);
+        void enterNative(Function* func, bool isTail) {
+            if (!nativeEnabled || verbLev > 0 || pairProfile != nullptr)
+                return;
+            if (func->native == nullptr) {
+                if (!jitEnabled || func->calls > jitThreshold || ++func->calls != jitThreshold)
+                    return;
+                compileNative(func);
+                if (func->native == nullptr)
+                    return;
+            }
+            //a tail call out of native code returns to the loop in runNative instead of nesting
+            if (isTail && tailFromNative) {
+                tailTarget = func;
+            } else if (nativeDepth < MAX_NATIVE_DEPTH && sp < MAX_OP_STACK - JIT_STACK_MARGIN) {
+                runNative(func);
+            }
+        }
+        void runNative(Function* func) {
+            bool outerTail = tailFromNative;
+            tailFromNative = false;
+            nativeDepth++;
+            while (func != nullptr) {
+                tailTarget = nullptr;
+                ((NativeCode)func->native)(this);
+                func = running && sp < MAX_OP_STACK - JIT_STACK_MARGIN ? tailTarget:nullptr;
+            }
+            nativeDepth--;
+            tailFromNative = outerTail;
+        }
+        //runs the interpreter until the frame on top of 'caller' returns, for native code
+        //calling a function that has no native code of its own (yet).
+        void invoke(ActivationRecord* caller) {
+            bool outerTail = tailFromNative;
+            tailFromNative = false;
+            nativeDepth++;
+#if HAS_COMPUTED_GOTO
+            if (dispatchMode == THREADED_DISPATCH) {
+                runThreaded(caller);
+            } else {
+                runSwitched(verbLev, caller);
+            }
+#else
+            runSwitched(verbLev, caller);
+#endif
+            nativeDepth--;
+            tailFromNative = outerTail;
+        }
+        static void jitExecute(VM* vm, Instruction* inst) {
+            vm->execute(*inst);
+        }
+        template <void (VM::*handler)(Instruction&)> static void jitHandler(VM* vm, Instruction* inst) {
+            (vm->*handler)(*inst);
+        }
+        static bool jitChecked(VM* vm, Instruction* inst) {
+            vm->execute(*inst);
+            return vm->running;
+        }
+        static bool jitBranchOnFalse(VM* vm, Instruction* inst) {
+            return !vm->opstk[vm->sp--].boolval();
+        }
+        static bool jitEach(VM* vm, Instruction* inst) {
+            return !vm->stepIterator();
+        }
+        static bool jitCompareAndBranch(VM* vm, Instruction* inst) {
+            vm->fusedOperation(inst->b);
+            return !vm->opstk[vm->sp--].boolval();
+        }
+        //a loop that is running out of stack is finished by the interpreter, which reports it
+        static bool jitBackEdge(VM* vm, Instruction* inst) {
+            vm->safepoint();
+            return vm->running && vm->sp < MAX_OP_STACK - JIT_STACK_MARGIN;
+        }
+        static bool nativeCall(VM* vm, Instruction* inst) {
+            ActivationRecord* caller = vm->callstk;
+            vm->callProcedure(*inst);
+            if (vm->running && vm->callstk != caller)
+                vm->invoke(caller);
+            return vm->running && vm->callstk == caller;
+        }
+        static void nativeTailCall(VM* vm, Instruction* inst) {
+            vm->tailFromNative = true;
+            vm->tailCallProcedure(*inst);
+            vm->tailFromNative = false;
+        }
+        static void jitReturn(VM* vm, Instruction* inst) {
+            vm->retProcedure();
+        }
+        JitHelper jitHelperFor(int op) {
+            switch (op) {
+                case ldlocal:    return jitHandler<&VM::loadLocal>;
+                case ldconst:    return jitHandler<&VM::loadConst>;
+                case ldglobal:   return jitHandler<&VM::loadGlobal>;
+                case ldupval:    return jitHandler<&VM::loadUpval>;
+                case ldaddr:     return jitHandler<&VM::loadAddress>;
+                case stlocal:    return jitHandler<&VM::storeLocal>;
+                case stupval:    return jitHandler<&VM::storeUpval>;
+                case ldfield:    return jitHandler<&VM::loadField>;
+                case stfield:    return jitHandler<&VM::storeField>;
+                case ldidx:      return jitHandler<&VM::loadIndexed>;
+                case stidx:      return jitHandler<&VM::storeIndexed>;
+                case binop:      return jitHandler<&VM::quicken>;
+                case binlocalk:  return jitHandler<&VM::binaryLocalConst>;
+                case binglobalk: return jitHandler<&VM::binaryGlobalConst>;
+                case add_nn:     return jitHandler<&VM::numericOperation<plus<double>>>;
+                case sub_nn:     return jitHandler<&VM::numericOperation<minus<double>>>;
+                case mul_nn:     return jitHandler<&VM::numericOperation<multiplies<double>>>;
+                case div_nn:     return jitHandler<&VM::numericOperation<divides<double>>>;
+                case lt_nn:      return jitHandler<&VM::numericOperation<less<double>>>;
+                case gt_nn:      return jitHandler<&VM::numericOperation<greater<double>>>;
+                case lte_nn:     return jitHandler<&VM::numericOperation<less_equal<double>>>;
+                case gte_nn:     return jitHandler<&VM::numericOperation<greater_equal<double>>>;
+                case eq_nn:      return jitHandler<&VM::numericOperation<equal_to<double>>>;
+                case neq_nn:     return jitHandler<&VM::numericOperation<not_equal_to<double>>>;
+                case concat_ss:  return jitHandler<&VM::concatStrings>;
+                case mkstruct:   return jitHandler<&VM::instantiate>;
+                case entblk:     return jitHandler<&VM::openBlock>;
+                default:
+                    break;
+            }
+            return jitExecute;
+        }
+        //which quickened opcodes and fused operators get inline code for doubles
+        int numericOperator(int op) {
+            switch (op) {
+                case add_nn: return VM_ADD;
+                case sub_nn: return VM_SUB;
+                case mul_nn: return VM_MUL;
+                case div_nn: return VM_DIV;
+                case lt_nn:  return VM_LT;
+                case gt_nn:  return VM_GT;
+                case lte_nn: return VM_LTE;
+                case gte_nn: return VM_GTE;
+                case eq_nn:  return VM_EQU;
+                case neq_nn: return VM_NEQ;
+                default:
+                    break;
+            }
+            return 0;
+        }
+        bool isComparison(int op) {
+            return op == VM_LT || op == VM_GT || op == VM_LTE || op == VM_GTE || op == VM_EQU || op == VM_NEQ;
+        }
+        bool hasInlineForm(int op) {
+            return isComparison(op) || op == VM_ADD || op == VM_SUB || op == VM_MUL || op == VM_DIV;
+        }
+        //xmm0 op xmm1, leaves the flag in al
+        void emitComparison(X86Emitter& x86, int op) {
+            switch (op) {
+                case VM_LT:  x86.compare(1, 0); x86.setIf(CC_A, RAX); break;
+                case VM_LTE: x86.compare(1, 0); x86.setIf(CC_AE, RAX); break;
+                case VM_GT:  x86.compare(0, 1); x86.setIf(CC_A, RAX); break;
+                case VM_GTE: x86.compare(0, 1); x86.setIf(CC_AE, RAX); break;
+                case VM_EQU: x86.compare(0, 1); x86.setIf(CC_E, RAX); x86.setIf(CC_NP, RBX); x86.andFlags(); break;
+                case VM_NEQ: x86.compare(0, 1); x86.setIf(CC_NE, RAX); x86.setIf(CC_P, RBX); x86.orFlags(); break;
+            }
+        }
+        //xmm0 op xmm1, leaves the result as a StackItem in rax
+        void emitNumeric(X86Emitter& x86, int op) {
+            if (isComparison(op)) {
+                emitComparison(x86, op);
+                x86.widenFlag();
+                x86.loadImmediate(RSI, SI_TAG_BOOL);
+                x86.orTag();
+                return;
+            }
+            switch (op) {
+                case VM_ADD: x86.arithmetic(0x58); break;
+                case VM_SUB: x86.arithmetic(0x5C); break;
+                case VM_MUL: x86.arithmetic(0x59); break;
+                case VM_DIV: x86.arithmetic(0x5E); break;
+            }
+            x86.fromDouble(RAX, 0);
+            x86.compare(0, 0);
+            size_t ordered = x86.jumpIf(CC_NP);
+            x86.loadImmediate(RAX, SI_CANON_NAN);
+            x86.bindHere(ordered);
+        }
+        //loads the two operands on top of the stack into xmm0 and xmm1, jumping to
+        //'slow' unless they are both numbers. rcx/rdx are left pointing at the top.
+        void emitNumericOperands(X86Emitter& x86, vector<size_t>& slow) {
+            x86.loadStackTop();
+            x86.load(RAX, RDX, -8);
+            slow.push_back(x86.jumpIfNotNumber(RAX, SI_QNAN));
+            x86.load(RAX, RDX, 0);
+            slow.push_back(x86.jumpIfNotNumber(RAX, SI_QNAN));
+            x86.toDouble(1, RAX);
+            x86.load(RAX, RDX, -8);
+            x86.toDouble(0, RAX);
+        }
+        //pushes rax
+        void emitPush(X86Emitter& x86) {
+            x86.loadStackTop();
+            x86.store(RDX, 8, RAX);
+            x86.adjustSp(1);
+        }
+        //the out of line half of an instruction with an inline fast path
+        void emitSlowPath(X86Emitter& x86, vector<size_t>& slow, size_t done, int resumeAt, void* helper, Instruction* inst) {
+            for (auto at : slow)
+                x86.bindHere(at);
+            x86.storeIp(resumeAt);
+            x86.callHelper(helper, inst);
+            x86.bindHere(done);
+        }
+        //Doubles take an inline path through the quickened and fused instructions, locals
+        //and numeric constants are moved directly. Everything else, and the inline paths
+        //when their type guards fail, is a call to the instruction's handler with ip stored
+        //first for the handlers that read it. Branches become native jumps. Leaving the body
+        //any other way stores ip and returns, and whoever entered the native code carries on
+        //from there.
+        void compileNative(Function* func) {
+            int start = func->start_ip;
+            if (start < 1 || start >= codePage.size() || codePage[start-1].op != jump)
+                return;
+            int end = codePage[start-1].a;
+            if (end <= start || end > codePage.size() || end - start > JIT_STACK_MARGIN / 2)
+                return;
+            if (jitCode == nullptr)
+                jitCode = new CodeBuffer();
+            if (!jitCode->usable() || !jitCode->hasRoom((end - start) * 256 + 256))
+                return;
+            VMLayout layout;
+            layout.ip = (char*)&ip - (char*)this;
+            layout.sp = (char*)&sp - (char*)this;
+            layout.opstk = (char*)opstk - (char*)this;
+            layout.callstk = (char*)&callstk - (char*)this;
+            layout.locals = (char*)&globals->locals - (char*)globals;
+            size_t entry = jitCode->position();
+            vector<size_t> labels(end - start);
+            vector<pair<size_t,int>> branches;
+            vector<size_t> exits;
+            X86Emitter x86(*jitCode, layout);
+            jitCode->beginWrite();
+            x86.prologue();
+            for (int i = start; i < end; i++) {
+                Instruction* inst = &codePage[i];
+                labels[i - start] = jitCode->position();
+                vector<size_t> slow;
+                switch (inst->op) {
+                    case defun:
+                        break;
+                    case ldlocal:
+                        x86.loadLocals(RAX);
+                        x86.load(RAX, RAX, inst->a * 8);
+                        emitPush(x86);
+                        break;
+                    case setlocal:
+                        x86.loadStackTop();
+                        x86.load(RAX, RDX, 0);
+                        x86.adjustSp(-1);
+                        x86.loadLocals(RDX);
+                        x86.store(RDX, inst->a * 8, RAX);
+                        break;
+                    case incrlocal:
+                    case decrlocal:
+                        x86.loadLocals(RDX);
+                        x86.load(RAX, RDX, inst->a * 8);
+                        slow.push_back(x86.jumpIfNotNumber(RAX, SI_QNAN));
+                        x86.toDouble(0, RAX);
+                        x86.loadImmediate(RAX, StackItem(inst->op == incrlocal ? 1.0:-1.0).bits);
+                        x86.toDouble(1, RAX);
+                        x86.arithmetic(0x58);
+                        x86.fromDouble(RAX, 0);
+                        x86.store(RDX, inst->a * 8, RAX);
+                        x86.bindHere(slow.back());
+                        break;
+                    case ldconst:
+                        if (constPool.get(inst->a).isNumber()) {
+                            x86.loadImmediate(RAX, constPool.get(inst->a).bits);
+                            emitPush(x86);
+                        } else {
+                            x86.storeIp(i+1);
+                            x86.callHelper((void*)jitHelperFor(inst->op), inst);
+                        }
+                        break;
+                    case add_nn: case sub_nn: case mul_nn: case div_nn:
+                    case lt_nn: case gt_nn: case lte_nn: case gte_nn: case eq_nn: case neq_nn: {
+                        emitNumericOperands(x86, slow);
+                        emitNumeric(x86, numericOperator(inst->op));
+                        x86.store(RDX, -8, RAX);
+                        x86.adjustSp(-1);
+                        emitSlowPath(x86, slow, x86.jump(), i+1, (void*)jitHelperFor(inst->op), inst);
+                    } break;
+                    case binlocalk:
+                        if (!hasInlineForm(inst->c) || !constPool.get(inst->a).isNumber()) {
+                            x86.storeIp(i+1);
+                            x86.callHelper((void*)jitHelperFor(inst->op), inst);
+                            break;
+                        }
+                        x86.loadLocals(RAX);
+                        x86.load(RAX, RAX, inst->b * 8);
+                        slow.push_back(x86.jumpIfNotNumber(RAX, SI_QNAN));
+                        x86.toDouble(0, RAX);
+                        x86.loadImmediate(RAX, constPool.get(inst->a).bits);
+                        x86.toDouble(1, RAX);
+                        emitNumeric(x86, inst->c);
+                        emitPush(x86);
+                        emitSlowPath(x86, slow, x86.jump(), i+1, (void*)jitHelperFor(inst->op), inst);
+                        break;
+                    case jump:
+                        if (inst->a <= i) {
+                            x86.storeIp(inst->a);
+                            x86.callHelper((void*)jitBackEdge, inst);
+                            x86.testResult();
+                            exits.push_back(x86.jumpIfZero());
+                        }
+                        branches.push_back(make_pair(x86.jump(), inst->a));
+                        break;
+                    case brf: {
+                        x86.loadStackTop();
+                        x86.load(RAX, RDX, 0);
+                        size_t isFalse = x86.jumpIfEqual(RAX, SI_TAG_BOOL);
+                        size_t isTrue = x86.jumpIfEqual(RAX, SI_TAG_BOOL | 1);
+                        x86.callHelper((void*)jitBranchOnFalse, inst);
+                        x86.testResult();
+                        branches.push_back(make_pair(x86.jumpIfNotZero(), inst->a));
+                        size_t done = x86.jump();
+                        x86.bindHere(isFalse);
+                        x86.adjustSp(-1);
+                        branches.push_back(make_pair(x86.jump(), inst->a));
+                        x86.bindHere(isTrue);
+                        x86.adjustSp(-1);
+                        x86.bindHere(done);
+                    } break;
+                    case cmpbrf: {
+                        size_t done = 0;
+                        if (isComparison(inst->b)) {
+                            emitNumericOperands(x86, slow);
+                            emitComparison(x86, inst->b);
+                            x86.adjustSp(-2);
+                            x86.testResult();
+                            branches.push_back(make_pair(x86.jumpIfZero(), inst->a));
+                            done = x86.jump();
+                            for (auto at : slow)
+                                x86.bindHere(at);
+                        }
+                        x86.storeIp(i+1);
+                        x86.callHelper((void*)jitCompareAndBranch, inst);
+                        x86.testResult();
+                        branches.push_back(make_pair(x86.jumpIfNotZero(), inst->a));
+                        if (isComparison(inst->b))
+                            x86.bindHere(done);
+                    } break;
+                    case each:
+                        x86.storeIp(i+1);
+                        x86.callHelper((void*)jitEach, inst);
+                        x86.testResult();
+                        branches.push_back(make_pair(x86.jumpIfNotZero(), inst->a));
+                        break;
+                    case call:
+                        x86.storeIp(i+1);
+                        x86.callHelper((void*)nativeCall, inst);
+                        x86.testResult();
+                        exits.push_back(x86.jumpIfZero());
+                        break;
+                    case mkclosure:
+                        x86.storeIp(i+1);
+                        x86.callHelper((void*)jitChecked, inst);
+                        x86.testResult();
+                        exits.push_back(x86.jumpIfZero());
+                        break;
+                    case tailcall:
+                    case retfun:
+                        x86.storeIp(i+1);
+                        x86.callHelper(inst->op == tailcall ? (void*)nativeTailCall:(void*)jitReturn, inst);
+                        exits.push_back(x86.jump());
+                        break;
+                    case halt:
+                        x86.storeIp(i);
+                        exits.push_back(x86.jump());
+                        break;
+                    default:
+                        x86.storeIp(i+1);
+                        x86.callHelper((void*)jitHelperFor(inst->op), inst);
+                        break;
+                }
+            }
+            x86.storeIp(end);
+            exits.push_back(x86.jump());
+            //branches that leave the body go through a stub that sets ip on the way out
+            for (auto & br : branches) {
+                if (br.second >= start && br.second < end) {
+                    x86.bind(br.first, labels[br.second - start]);
+                } else {
+                    x86.bindHere(br.first);
+                    x86.storeIp(br.second);
+                    exits.push_back(x86.jump());
+                }
+            }
+            size_t exit = jitCode->position();
+            x86.epilogue();
+            for (auto at : exits)
+                x86.bind(at, exit);
+            jitCode->endWrite();
+            func->native = jitCode->address(entry);
+            jitted.push_back(func);
+        }
+        //native code points into codePage, which is replaced on every run
+        void discardNativeCode() {
+            for (auto func : jitted) {
+                func->native = nullptr;
+                func->calls = 0;
+            }
+            jitted.clear();
+            if (jitCode != nullptr)
+                jitCode->rewind(0);
+        }
         void retProcedure() {
             ip = callstk->ret_addr;
             closeBlock();
         }
         void instantiate(Instruction& inst) {
-            ClassObject* master = constPool.get(inst.operand[0].intval).objval->object;
-            ClassObject* clone = new ClassObject(master->name, master->scope);
+            ClassObject* master = constPool.get(inst.a).objval()->object;
+            GCItem* item = currentHeap().alloc<ClassObject>(master->name, master->scope);
+            ClassObject* clone = item->object;
             clone->instantiated = true;
-            for (auto m : master->fields) {
-                clone->fields[m.first] = StackItem();
-            }
-            opstk[++sp] = alloc.alloc(clone); 
+            clone->shape = master->shape;
+            clone->slots.resize(master->shape->size());
+            opstk[++sp] = item;
         }
         void storeGlobal() {
             StackItem t = opstk[sp--];
             StackItem val = opstk[sp--];
-            globals->locals[t.intval] =  val;
+            globals->locals[t.intval()] =  val;
         }
         void loadGlobal(Instruction& inst) {
             if (verbLev > 1)
-                cout<<"Load "<<globals->locals[inst.operand[0].intval].toString()<<" from "<<(inst.operand[0].intval)<<endl;
-            opstk[++sp] = globals->locals[inst.operand[0].intval];
+                out()<<"Load "<<globals->locals[inst.a].toString()<<" from "<<(inst.a)<<endl;
+            opstk[++sp] = globals->locals[inst.a];
         }
         void loadLocal(Instruction& inst) {
-            opstk[++sp] = callstk->locals[inst.operand[0].intval];
+            opstk[++sp] = callstk->locals[inst.a];
             if (verbLev > 1)
-                cout<<"loaded local: "<<opstk[sp].toString()<<endl;
+                out()<<"loaded local: "<<opstk[sp].toString()<<endl;
         } 
         void loadUpval(Instruction& inst) {
-            opstk[++sp] = walkChain(inst.operand[1].intval)->locals[inst.operand[0].intval];
+            opstk[++sp] = *callstk->closure->closure->upvalues[inst.a]->upval->location;
             if (verbLev > 1)
-                cout<<"loaded Upval: "<<opstk[sp].toString()<<"from "<<inst.operand[0].intval<<" of scope "<<(inst.operand[1].intval)<<endl;
+                out()<<"loaded Upval: "<<opstk[sp].toString()<<" from upvalue "<<inst.a<<endl;
         } 
         void storeLocal(Instruction& inst) {
             StackItem t = opstk[sp--];
             StackItem val = opstk[sp--];
-            callstk->locals[t.intval] = val;
+            callstk->locals[t.intval()] = val;
             if (verbLev > 1)
-                cout<<"Stored local at "<<t.intval<<endl;
+                out()<<"Stored local at "<<t.intval()<<endl;
         }
         void storeUpval(Instruction& inst) {
-            StackItem t = opstk[sp--];
+            sp--;
             StackItem val = opstk[sp--];
-            walkChain(inst.operand[0].intval)->locals[t.intval] = val;
+            GCItem* uv = callstk->closure->closure->upvalues[inst.a];
+            *uv->upval->location = val;
+            currentHeap().writeBarrier(uv, val);
             if (verbLev > 1)
-                cout<<"Stored upval at "<<t.intval<<" in scope "<<(inst.operand[0].intval)<<endl;
+                out()<<"Stored upval "<<inst.a<<endl;
         }
         void makeList(Instruction& inst) {
-            opstk[++sp] = StackItem(alloc.alloc(new deque<StackItem>()));
+            opstk[++sp] = StackItem(currentHeap().alloc<deque<StackItem>>());
         }
         void loadIndexed(Instruction& inst) {
-            if (top(1).type == OBJECT && top(0).type == NUMBER) {
-                switch (top(1).objval->type) {
+            if (top(1).type() == OBJECT && top(0).type() == NUMBER) {
+                switch (top(1).objval()->type) {
                     case LIST:
-                        top(1) = (top(1).objval->list->at(top(0).numval)); sp--; 
+                        top(1) = (top(1).objval()->list->at(top(0).numval())); sp--; 
                         return;
-                    case STRING: 
-                        char c = top(1).objval->strval->at(top(0).numval);
+                    case STRING: {
+                        char c = top(1).objval()->strval->at(top(0).numval());
                         string str;
                         str.push_back(c);
-                        top(1) = (alloc.alloc(new string(str))); sp--; 
+                        top(1) = currentHeap().alloc<string>(str); sp--; 
+                    } return;
+                    case RANGE:
+                        top(1) = StackItem(top(1).objval()->range->at(top(0).numval())); sp--;
                         return;
                 }
             }
         }
         void storeIndexed(Instruction& inst) {
-            if (top(1).type == OBJECT && top(1).objval->type == LIST) {
-                top(1).objval->list->at(top(0).numval) = top(2); 
-                sp--;
+            if (top(1).type() == OBJECT && top(1).objval()->type == LIST) {
+                top(1).objval()->list->at(top(0).numval()) = top(2); 
+                currentHeap().writeBarrier(top(1).objval(), top(2));
             }
+            sp -= 3;
+        }
+        //the name is only looked up when the site sees a shape other than the one it cached.
+        FieldCache& fieldCacheFor(Instruction& inst, ClassObject* object) {
+            FieldCache& ic = fieldCaches[inst.b];
+            if (ic.shape != object->shape)
+                ic = FieldCache(object->shape, object->shape->slotOf(*constPool.get(inst.a).objval()->strval));
+            return ic;
         }
         void loadField(Instruction& inst) {
-            if (top(0).type == OBJECT && top(0).objval->type == CLASS) {
-                int idx = inst.operand[0].intval;    
-                string fieldName = *(constPool.get(idx).objval->strval);
-                auto object = top(0).objval->object;
-                auto item = object->fields[fieldName];
-                top(0) = item;
+            if (top(0).type() == OBJECT && top(0).objval()->type == CLASS) {
+                auto object = top(0).objval()->object;
+                FieldCache& ic = fieldCacheFor(inst, object);
+                top(0) = ic.slot < 0 ? StackItem():object->slots[ic.slot];
                 return;
             }
         }
         void storeField(Instruction& inst) {
-            if (top(0).type == OBJECT && top(0).objval->type == CLASS) {
-                int idx = inst.operand[0].intval;    
-                string fieldName = *(constPool.get(idx).objval->strval);
-                top(0).objval->object->fields[fieldName] = top(1);
+            if (top(0).type() == OBJECT && top(0).objval()->type == CLASS) {
+                auto object = top(0).objval()->object;
+                FieldCache& ic = fieldCacheFor(inst, object);
+                if (ic.slot < 0) {
+                    object->addField(*constPool.get(inst.a).objval()->strval);
+                    ic = FieldCache(object->shape, object->shape->size() - 1);
+                }
+                object->slots[ic.slot] = top(1);
+                currentHeap().writeBarrier(top(0).objval(), top(1));
             }
+            sp -= 2;
         }
         void loadConst(Instruction& inst) {
-            if (inst.operand[0].type == INTEGER) {
-                opstk[++sp] = (constPool.get(inst.operand[0].intval));
-            } else {
-                opstk[++sp] = (inst.operand[0]);
-            }
+            opstk[++sp] = constPool.get(inst.a);
         }
         void loadAddress(Instruction& inst) {
-            opstk[++sp] = (inst.operand[0]); 
+            opstk[++sp] = StackItem((int)inst.a);
         }
         void randNumber(Instruction& inst) {
-            opstk[++sp] = fmod(rand(), inst.operand[0].numval); 
+            opstk[++sp] = fmod(rng(), constPool.get(inst.a).numval());
         }
         void branchOnFalse(Instruction& inst) {
-            bool tmp = opstk[sp--].boolval;
+            bool tmp = opstk[sp--].boolval();
             if (tmp == false) {
-                ip = inst.operand[0].intval;
+                ip = inst.a;
             }
         }
         void uncondBranch(Instruction& inst) {
-            ip = inst.operand[0].intval;
+            bool backward = inst.a < ip;
+            ip = inst.a;
+            if (backward) safepoint();
         }
         void appendList() {
-            if (top(1).type == OBJECT && top(1).objval->type == LIST)
-                top(1).objval->list->push_back(top(0));
+            if (top(1).type() == OBJECT && top(1).objval()->type == LIST) {
+                top(1).objval()->list->push_back(top(0));
+                currentHeap().writeBarrier(top(1).objval(), top(0));
+            }
             sp--;
         }
         void pushList() {
-            if (top(1).type == OBJECT && top(1).objval->type == LIST)
-                top(1).objval->list->push_front(top(0));
+            if (top(1).type() == OBJECT && top(1).objval()->type == LIST) {
+                top(1).objval()->list->push_front(top(0));
+                currentHeap().writeBarrier(top(1).objval(), top(0));
+            }
             sp-=2;
         }
         void listLength() {
-            if (top().type == OBJECT && top().objval->type == LIST)
-                top() = ((double)top().objval->list->size());
-        }
-        void makeRange() {
-            double hi = opstk[sp--].numval;
-            double lo = opstk[sp--].numval;
-            if (hi < lo) swap(hi, lo);
-            if (top(0).type != OBJECT && (top(0).objval->type != LIST)) {
-                cout<<"Error: ranges require a list context."<<endl;
+            if (top().type() == OBJECT && top().objval()->type == LIST)
+                top() = ((double)top().objval()->list->size());
+            else if (top().type() == OBJECT && top().objval()->type == RANGE)
+                top() = ((double)top().objval()->range->size());
+        }
+        //[lo .. hi] is filled in place, any other lo .. hi is a Range that holds none of its numbers
+        void makeRange(Instruction& inst) {
+            double hi = opstk[sp--].numval();
+            double lo = opstk[sp--].numval();
+            Range range(lo, hi);
+            if (inst.a == 0) {
+                opstk[++sp] = StackItem(currentHeap().alloc<Range>(range));
+                return;
+            }
+            if (top(0).type() != OBJECT || top(0).objval()->type != LIST) {
+                out()<<"Error: ranges require a list context."<<endl;
                 return;
             }
-            for (int i = lo; i <= hi; i++) {
-                top(0).objval->list->push_back((double)i);
+            for (int i = 0; i < range.size(); i++) {
+                top(0).objval()->list->push_back(range.at(i));
+            }
+        }
+        //what a counted loop over lo .. hi runs between, the first and last number the range holds
+        void rangeBounds() {
+            Range range(top(1).numval(), top(0).numval());
+            top(1) = StackItem(range.first);
+            top(0) = StackItem(range.last);
+        }
+        void makeIterator() {
+            if (!Iterator::iterable(top(0)))
+                out()<<"Error: "<<top(0).toString()<<" can't be iterated over."<<endl;
+            top(0) = StackItem(currentHeap().alloc<Iterator>(top(0)));
+        }
+        //puts the iterator's next element in its place, or pops it once it is spent
+        bool stepIterator() {
+            StackItem item;
+            if (top(0).isObject() && top(0).objval()->type == ITERATOR && top(0).objval()->iter->next(item)) {
+                top(0) = item;
+                return true;
             }
+            sp--;
+            return false;
+        }
+        void nextElement(Instruction& inst) {
+            if (!stepIterator())
+                ip = inst.a;
         }
         void duplicateTop() {
             auto item = top(0);
@@ -226,61 +799,78 @@ class VM {
             running = false;
         }
         void printTopOfStack() {
-            cout<<opstk[sp--].toString();
+            out()<<opstk[sp--].toString();
         }
         void unaryOperation(Instruction& inst) {
-            switch (inst.operand[0].intval) {
+            switch (inst.a) {
                 case VM_NEG: { 
-                    switch (top().type) {
-                        case INTEGER: top().intval = -top().intval; break;
-                        case NUMBER:  top().numval = -top().numval; break;
-                        case BOOLEAN: top().boolval = !top().boolval; break;
+                    switch (top().type()) {
+                        case INTEGER: top() = StackItem(-top().intval()); break;
+                        case NUMBER:  top() = StackItem(-top().numval()); break;
+                        case BOOLEAN: top() = StackItem(!top().boolval()); break;
                     }
                 } break;
             }
         }
+        //text =~ "pattern" where the pattern was compiled along with the code
+        void matchRegex(Instruction& inst) {
+            Regex* re = constPool.get(inst.a).objval()->regex;
+            if (top(0).isObject() && top(0).objval()->type == STRING) {
+                top(0) = StackItem(re->match(*top(0).objval()->strval));
+            } else {
+                top(0) = StackItem(re->match(top(0).toString()));
+            }
+        }
+        bool matchDynamic(string pattern, string text) {
+            bool fresh;
+            Regex* re = regexes.get(pattern, fresh);
+            if (fresh && !re->valid())
+                out()<<re->errorMessage()<<endl;
+            return re->match(text);
+        }
         void binaryOperation(Instruction& inst) {
-            if (inst.operand[0].intval > 6) {
+            if (inst.a > 6) {
                 relationOperation(inst);
             } else {
                 arithmeticOperation(inst);
             }
         }
         void relationOperation(Instruction& inst) {
-            switch (inst.operand[0].intval) {
+            bool result = false;
+            switch (inst.a) {
                 case VM_LT:   {
-                    top(1).boolval = top(1).lessThan(top(0));
+                    result = top(1).lessThan(top(0));
                 } break;
                 case VM_GT:   {
-                    top(1).boolval = top(0).lessThan(top(1));
+                    result = top(0).lessThan(top(1));
                 } break;
                 case VM_LTE: {
-                top(1).boolval = (top(1).lessThan(top(0)) || (top(0).equals(top(1))));
+                    result = (top(1).lessThan(top(0)) || (top(0).equals(top(1))));
                 } break;
                 case VM_GTE: {
-                    top(1).boolval = (top(0).lessThan(top(1)) || (top(0).equals(top(1))));
+                    result = (top(0).lessThan(top(1)) || (top(0).equals(top(1))));
                 } break;
                 case VM_EQU:  {
-                    top(1).boolval = (top(0).equals(top(1))); break;
+                    result = (top(0).equals(top(1))); break;
                 } break;
                 case VM_NEQ: {
-                    top(1).boolval = !(top(0).equals(top(1))); break;
+                    result = !(top(0).equals(top(1))); break;
                 } break;
                 case VM_LOGIC_AND: {
-                    top(1).boolval = (top(1).boolval && top(0).boolval);
+                    result = (top(1).boolval() && top(0).boolval());
                 } break;
                 case VM_LOGIC_OR: {
-                    top(1).boolval = (top(1).boolval || top(0).boolval);
+                    result = (top(1).boolval() || top(0).boolval());
                 } break;
                 case VM_REGEX: {
-                    top(1).boolval = (matchRegex(top(0).toString(), top(1).toString()));
+                    result = matchDynamic(top(0).toString(), top(1).toString());
                 } break;
             }
-            top(1).type = BOOLEAN;
+            top(1) = StackItem(result);
             sp--;
         }
         void arithmeticOperation(Instruction& inst) {
-            switch (inst.operand[0].intval) {
+            switch (inst.a) {
                 case VM_ADD:  {
                     top(1).add(top());
                 } break;
@@ -301,21 +891,126 @@ class VM {
             }
             sp--;
         }
+        //replaces the opcode at 'site' in place, in both engines.
+        void rewrite(int site, int op) {
+            codePage[site].op = op;
+            if (site < threadedCode.size() && handlerTable != nullptr)
+                threadedCode[site] = handlerTable[op];
+        }
+        VMInstruction quickenedForm(int op, StackItem& lhs, StackItem& rhs) {
+            if (lhs.isNumber() && rhs.isNumber()) {
+                switch (op) {
+                    case VM_ADD: return add_nn;
+                    case VM_SUB: return sub_nn;
+                    case VM_MUL: return mul_nn;
+                    case VM_DIV: return div_nn;
+                    case VM_MOD: return mod_nn;
+                    case VM_LT:  return lt_nn;
+                    case VM_GT:  return gt_nn;
+                    case VM_LTE: return lte_nn;
+                    case VM_GTE: return gte_nn;
+                    case VM_EQU: return eq_nn;
+                    case VM_NEQ: return neq_nn;
+                }
+            } else if (op == VM_ADD && lhs.isObject() && rhs.isObject() 
+                        && lhs.objval()->type == STRING && rhs.objval()->type == STRING) {
+                return concat_ss;
+            }
+            return binop;
+        }
+        //a binop site is quickened the first time it runs into a form specialised for the types
+        //it saw. A quickened site that meets anything else goes back to binop, and b marks it
+        //so that it stays there.
+        void quicken(Instruction& inst) {
+            if (inst.b == 0) {
+                VMInstruction form = quickenedForm(inst.a, top(1), top(0));
+                if (form != binop)
+                    rewrite(ip - 1, form);
+            }
+            binaryOperation(inst);
+        }
+        void dequicken(Instruction& inst) {
+            codePage[ip - 1].b = 1;
+            rewrite(ip - 1, binop);
+            binaryOperation(inst);
+        }
+        template <class Op> void numericOperation(Instruction& inst) {
+            if (!top(0).isNumber() || !top(1).isNumber()) {
+                dequicken(inst);
+                return;
+            }
+            top(1) = StackItem(Op()(top(1).numval(), top(0).numval()));
+            sp--;
+        }
+        struct fmodOp {
+            double operator()(double l, double r) { return fmod(l, r); }
+        };
+        void concatStrings(Instruction& inst) {
+            if (!top(0).isObject() || !top(1).isObject() || top(0).objval()->type != STRING || top(1).objval()->type != STRING) {
+                dequicken(inst);
+                return;
+            }
+            top(1) = StackItem(currentHeap().alloc<string>(*top(1).objval()->strval + *top(0).objval()->strval));
+            sp--;
+        }
+        //superinstructions, see compile/fusion.hpp for the sequences they replace. They have
+        //no site of their own to quicken, so numbers take a direct path here instead.
+        void fusedOperation(int op) {
+            if (top(0).isNumber() && top(1).isNumber()) {
+                double l = top(1).numval(), r = top(0).numval();
+                switch (op) {
+                    case VM_ADD: top(1) = StackItem(l + r); sp--; return;
+                    case VM_SUB: top(1) = StackItem(l - r); sp--; return;
+                    case VM_MUL: top(1) = StackItem(l * r); sp--; return;
+                    case VM_DIV: top(1) = StackItem(l / r); sp--; return;
+                    case VM_MOD: top(1) = StackItem(fmod(l, r)); sp--; return;
+                    case VM_LT:  top(1) = StackItem(l < r); sp--; return;
+                    case VM_GT:  top(1) = StackItem(l > r); sp--; return;
+                    case VM_LTE: top(1) = StackItem(l <= r); sp--; return;
+                    case VM_GTE: top(1) = StackItem(l >= r); sp--; return;
+                    case VM_EQU: top(1) = StackItem(l == r); sp--; return;
+                    case VM_NEQ: top(1) = StackItem(l != r); sp--; return;
+                    default:
+                        break;
+                }
+            }
+            Instruction fused(binop, op);
+            binaryOperation(fused);
+        }
+        void binaryLocalConst(Instruction& inst) {
+            opstk[++sp] = callstk->locals[inst.b];
+            opstk[++sp] = constPool.get(inst.a);
+            fusedOperation(inst.c);
+        }
+        void binaryGlobalConst(Instruction& inst) {
+            opstk[++sp] = globals->locals[inst.b];
+            opstk[++sp] = constPool.get(inst.a);
+            fusedOperation(inst.c);
+        }
+        void compareAndBranch(Instruction& inst) {
+            fusedOperation(inst.b);
+            branchOnFalse(inst);
+        }
+        void stepInPlace(StackItem& var, int step) {
+            if (var.isNumber()) var = StackItem(var.numval() + step);
+        }
         void execute(Instruction& inst) {
             switch (inst.op) {
                 case list_append: { appendList(); } break;
                 case list_push:   { pushList(); } break;
                 case list_len: { listLength(); } break;
                 case call:     { callProcedure(inst); } break;
+                case tailcall: { tailCallProcedure(inst); } break;
                 case retfun:   { retProcedure(); } break;
                 case entblk:   { openBlock(inst); } break;
                 case retblk:   { closeBlock(); } break;
                 case jump:     { uncondBranch(inst); } break;
                 case brf:      { branchOnFalse(inst); } break;
-                case binop:    { binaryOperation(inst); } break;
+                case binop:    { quicken(inst); } break;
                 case unop:     { unaryOperation(inst); } break;
+                case matchre:  { matchRegex(inst); } break;
                 case print:    { printTopOfStack(); } break;
-                case newline:  { cout<<endl; } break;
+                case newline:  { out()<<endl; } break;
                 case halt:     { haltvm(); } break;
                 case stglobal: { storeGlobal(); } break;
                 case stupval:  { storeUpval(inst); } break;
@@ -332,102 +1027,394 @@ class VM {
                 case mkclosure: { closeOver(inst); } break;
                 case mkstruct:  { instantiate(inst); } break;
                 case mklist:    { makeList(inst); } break;
-                case mkrange:   { makeRange(); } break;
+                case mkrange:   { makeRange(inst); } break;
+                case bounds:    { rangeBounds(); } break;
+                case mkiter:    { makeIterator(); } break;
+                case each:      { nextElement(inst); } break;
                 case ldrand:    { randNumber(inst); } break;
                 case popstack:  { sp--; } break; 
-                case incr:     { if (top(0).type == NUMBER) top(0).numval += 1; } break;
-                case decr:     { if (top(0).type == NUMBER) top(0).numval -= 1; } break;
-                case floorval: { if (top(0).type == NUMBER) top(0).numval = floor(top(0).numval); } break;
+                case incr:     { if (top(0).isNumber()) top(0) = StackItem(top(0).numval() + 1); } break;
+                case decr:     { if (top(0).isNumber()) top(0) = StackItem(top(0).numval() - 1); } break;
+                case floorval: { if (top(0).isNumber()) top(0) = StackItem(floor(top(0).numval())); } break;
+                case binlocalk:  { binaryLocalConst(inst); } break;
+                case binglobalk: { binaryGlobalConst(inst); } break;
+                case cmpbrf:     { compareAndBranch(inst); } break;
+                case incrlocal:  { stepInPlace(callstk->locals[inst.a], 1); } break;
+                case decrlocal:  { stepInPlace(callstk->locals[inst.a], -1); } break;
+                case incrglobal: { stepInPlace(globals->locals[inst.a], 1); } break;
+                case decrglobal: { stepInPlace(globals->locals[inst.a], -1); } break;
+                case setlocal:   { callstk->locals[inst.a] = opstk[sp--]; } break;
+                case setglobal:  { globals->locals[inst.a] = opstk[sp--]; } break;
+                case add_nn:     { numericOperation<plus<double>>(inst); } break;
+                case sub_nn:     { numericOperation<minus<double>>(inst); } break;
+                case mul_nn:     { numericOperation<multiplies<double>>(inst); } break;
+                case div_nn:     { numericOperation<divides<double>>(inst); } break;
+                case mod_nn:     { numericOperation<fmodOp>(inst); } break;
+                case lt_nn:      { numericOperation<less<double>>(inst); } break;
+                case gt_nn:      { numericOperation<greater<double>>(inst); } break;
+                case lte_nn:     { numericOperation<less_equal<double>>(inst); } break;
+                case gte_nn:     { numericOperation<greater_equal<double>>(inst); } break;
+                case eq_nn:      { numericOperation<equal_to<double>>(inst); } break;
+                case neq_nn:     { numericOperation<not_equal_to<double>>(inst); } break;
+                case concat_ss:  { concatStrings(inst); } break;
                 default:
                     break;
             }
-            if (collector.ready()) collector.run(callstk, opstk, sp, &constPool);       
         }
         Instruction& fetch() {
             return ip < codePage.size() && ip > -1 ? codePage[ip++]:haltSentinel;
         }
         void printInstruction(Instruction& inst) {
-            cout<<"Instrctn: "<<ip<<": [0x0"<<inst.op<<"("<<instrStr[inst.op]<<"), "<<inst.operand[0].toString()<<","<<inst.operand[1].toString();
-            if (inst.op == call) cout<<", "<<inst.operand[2].toString();
-            cout<<"]  \n";
+            out()<<"Instrctn: "<<ip<<": [0x"<<hex<<(int)inst.op<<dec<<" "<<instructionToString(inst);
+            if (hasConstOperand(inst.op))
+                out()<<" {"<<constPool.get(inst.a).toString()<<"}";
+            out()<<"]  \n";
         }
         void printOperandStack() {
-            cout<<"Operands:  ";
+            out()<<"Operands:  ";
             for (int i = 0; i <= sp; i++) {
-                cout<<i<<": ["<<opstk[i].toString()<<"] ";
+                out()<<i<<": ["<<opstk[i].toString()<<"] ";
             }
-            cout<<endl;
+            out()<<endl;
         }
         void printCallStack() {
-            cout<<"Callstack: \n";
+            out()<<"Callstack: \n";
             auto x = callstk;
             int i = 0;
             while (x != nullptr) {
-                cout<<"\t   "<<i++<<": [ ";
-                for (int j = 1; j <= 5; j++) {
-                    cout<<(j)<<": "<<"{"<<x->locals[j].toString()<<"}, ";
+                out()<<"\t   "<<i++<<": [ ";
+                for (int j = 1; j <= 5 && j < x->nslots; j++) {
+                    out()<<(j)<<": "<<"{"<<x->locals[j].toString()<<"}, ";
                 }
-                cout<<"]"<<endl;
+                out()<<"]"<<endl;
                 x = x->control;
             }            
             
+        }
+        void interpret() {
+#if HAS_COMPUTED_GOTO
+            //tracing output lives in the switch engine.
+            if (dispatchMode == THREADED_DISPATCH && verbLev == 0 && pairProfile == nullptr) {
+                runThreaded();
+            } else {
+                runSwitched(verbLev);
+            }
+#else
+            runSwitched(verbLev);
+#endif
         }
         void init(vector<Instruction>& cp, int verbosity) {
+            discardNativeCode();
             codePage = cp;
+            for (auto & inst : codePage) {
+                if ((inst.op == ldfield || inst.op == stfield) && inst.b >= fieldCaches.size())
+                    fieldCaches.resize(inst.b + 1);
+            }
+            threadedCode.clear();
             if (ip > 0) ip -= 1;
             verbLev = verbosity;
         }
+        void runSwitched(int verbosity, ActivationRecord* stopAt = nullptr) {
+            while (running) {
+                if (sp >= MAX_OP_STACK) {
+                    out()<<"Error: Out of stack space, yo."<<endl;
+                    running = false;
+                    break;
+                }
+                int at = ip;
+                Instruction inst = fetch();
+                if (verbosity > 0) {
+                    printInstruction(inst);
+                    out()<<"----------------"<<endl;
+                }
+                execute(inst);
+                if (pairProfile != nullptr)
+                    pairProfile->record(inst.op, ip == at + 1);
+                if ((inst.op == retfun || inst.op == tailcall) && callstk == stopAt)
+                    return;
+                if (verbosity > 1) {
+                    out()<<"----------------"<<endl;                
+                    printOperandStack();
+                }
+                if (verbosity > 2) {
+                    printCallStack();
+                }
+                if (verbosity > 0) out()<<"================"<<endl;
+            }
+        }
+#if HAS_COMPUTED_GOTO
+        void runThreaded(ActivationRecord* stopAt = nullptr) {
+            static thread_local void* handlers[NUM_OPCODES];
+            static thread_local bool tableBuilt = false;
+            if (!tableBuilt) {
+                for (int i = 0; i < NUM_OPCODES; i++)
+                    handlers[i] = &&do_nop;
+                handlers[list_append] = &&do_list_append; handlers[list_push] = &&do_list_push;
+                handlers[list_len] = &&do_list_len;   handlers[call] = &&do_call;
+                handlers[tailcall] = &&do_tailcall;   handlers[retfun] = &&do_retfun;
+                handlers[retblk] = &&do_retblk;       handlers[jump] = &&do_jump;
+                handlers[brf] = &&do_brf;             handlers[binop] = &&do_binop;
+                handlers[unop] = &&do_unop;           handlers[print] = &&do_print;
+                handlers[newline] = &&do_newline;     handlers[halt] = &&do_halt;
+                handlers[stglobal] = &&do_stglobal;   handlers[stupval] = &&do_stupval;
+                handlers[stlocal] = &&do_stlocal;     handlers[stidx] = &&do_stidx;
+                handlers[stfield] = &&do_stfield;     handlers[ldconst] = &&do_ldconst;
+                handlers[ldglobal] = &&do_ldglobal;   handlers[ldupval] = &&do_ldupval;
+                handlers[ldlocal] = &&do_ldlocal;     handlers[ldfield] = &&do_ldfield;
+                handlers[ldidx] = &&do_ldidx;         handlers[ldaddr] = &&do_ldaddr;
+                handlers[mkclosure] = &&do_mkclosure; handlers[mkstruct] = &&do_mkstruct;
+                handlers[mklist] = &&do_mklist;       handlers[mkrange] = &&do_mkrange;
+                handlers[bounds] = &&do_bounds;       handlers[mkiter] = &&do_mkiter;
+                handlers[each] = &&do_each;           handlers[matchre] = &&do_matchre;
+                handlers[ldrand] = &&do_ldrand;       handlers[popstack] = &&do_popstack;
+                handlers[incr] = &&do_incr;           handlers[decr] = &&do_decr;
+                handlers[floorval] = &&do_floorval;   handlers[entblk] = &&do_entblk;
+                handlers[binlocalk] = &&do_binlocalk; handlers[binglobalk] = &&do_binglobalk;
+                handlers[cmpbrf] = &&do_cmpbrf;       handlers[incrlocal] = &&do_incrlocal;
+                handlers[decrlocal] = &&do_decrlocal; handlers[incrglobal] = &&do_incrglobal;
+                handlers[decrglobal] = &&do_decrglobal; handlers[setlocal] = &&do_setlocal;
+                handlers[setglobal] = &&do_setglobal;
+                handlers[add_nn] = &&do_add_nn;       handlers[sub_nn] = &&do_sub_nn;
+                handlers[mul_nn] = &&do_mul_nn;       handlers[div_nn] = &&do_div_nn;
+                handlers[mod_nn] = &&do_mod_nn;       handlers[lt_nn] = &&do_lt_nn;
+                handlers[gt_nn] = &&do_gt_nn;         handlers[lte_nn] = &&do_lte_nn;
+                handlers[gte_nn] = &&do_gte_nn;       handlers[eq_nn] = &&do_eq_nn;
+                handlers[neq_nn] = &&do_neq_nn;       handlers[concat_ss] = &&do_concat_ss;
+                tableBuilt = true;
+            }
+            handlerTable = handlers;
+            if (threadedCode.size() != codePage.size() + 1) {
+                threadedCode.resize(codePage.size() + 1);
+                for (int i = 0; i < codePage.size(); i++)
+                    threadedCode[i] = handlers[codePage[i].op];
+                threadedCode[codePage.size()] = &&do_halt;
+            }
+            Instruction* inst;
+            #define DISPATCH() {                                                    \
+                if (sp >= MAX_OP_STACK) goto stack_overflow;                        \
+                inst = &codePage[ip];                                               \
+                goto *threadedCode[ip++];                                           \
+            }
+            #define CHECKED_DISPATCH() { if (!running) return; DISPATCH(); }
+            if (ip < 0 || ip >= codePage.size()) {
+                running = false;
+                return;
+            }
+            DISPATCH();
+            do_list_append: appendList(); DISPATCH();
+            do_list_push:   pushList(); DISPATCH();
+            do_list_len:    listLength(); DISPATCH();
+            do_call:        callProcedure(*inst); CHECKED_DISPATCH();
+            do_tailcall:    tailCallProcedure(*inst); if (callstk == stopAt) return; CHECKED_DISPATCH();
+            do_retfun:      retProcedure(); if (callstk == stopAt) return; DISPATCH();
+            do_entblk:      openBlock(*inst); DISPATCH();
+            do_retblk:      closeBlock(); DISPATCH();
+            do_jump:        uncondBranch(*inst); DISPATCH();
+            do_brf:         branchOnFalse(*inst); DISPATCH();
+            do_binop:       quicken(*inst); DISPATCH();
+            do_unop:        unaryOperation(*inst); DISPATCH();
+            do_matchre:     matchRegex(*inst); DISPATCH();
+            do_print:       printTopOfStack(); DISPATCH();
+            do_newline:     out()<<endl; DISPATCH();
+            do_stglobal:    storeGlobal(); DISPATCH();
+            do_stupval:     storeUpval(*inst); DISPATCH();
+            do_stlocal:     storeLocal(*inst); DISPATCH();
+            do_stidx:       storeIndexed(*inst); DISPATCH();
+            do_stfield:     storeField(*inst); DISPATCH();
+            do_ldconst:     loadConst(*inst); DISPATCH();
+            do_ldglobal:    loadGlobal(*inst); DISPATCH();
+            do_ldupval:     loadUpval(*inst); DISPATCH();
+            do_ldlocal:     loadLocal(*inst); DISPATCH();
+            do_ldfield:     loadField(*inst); DISPATCH();
+            do_ldidx:       loadIndexed(*inst); DISPATCH();
+            do_ldaddr:      loadAddress(*inst); DISPATCH();
+            do_mkclosure:   closeOver(*inst); CHECKED_DISPATCH();
+            do_mkstruct:    instantiate(*inst); DISPATCH();
+            do_mklist:      makeList(*inst); DISPATCH();
+            do_mkrange:     makeRange(*inst); DISPATCH();
+            do_bounds:      rangeBounds(); DISPATCH();
+            do_mkiter:      makeIterator(); DISPATCH();
+            do_each:        nextElement(*inst); DISPATCH();
+            do_ldrand:      randNumber(*inst); DISPATCH();
+            do_popstack:    sp--; DISPATCH();
+            do_incr:        if (top(0).isNumber()) top(0) = StackItem(top(0).numval() + 1); DISPATCH();
+            do_decr:        if (top(0).isNumber()) top(0) = StackItem(top(0).numval() - 1); DISPATCH();
+            do_floorval:    if (top(0).isNumber()) top(0) = StackItem(floor(top(0).numval())); DISPATCH();
+            do_binlocalk:   binaryLocalConst(*inst); DISPATCH();
+            do_binglobalk:  binaryGlobalConst(*inst); DISPATCH();
+            do_cmpbrf:      compareAndBranch(*inst); DISPATCH();
+            do_incrlocal:   stepInPlace(callstk->locals[inst->a], 1); DISPATCH();
+            do_decrlocal:   stepInPlace(callstk->locals[inst->a], -1); DISPATCH();
+            do_incrglobal:  stepInPlace(globals->locals[inst->a], 1); DISPATCH();
+            do_decrglobal:  stepInPlace(globals->locals[inst->a], -1); DISPATCH();
+            do_setlocal:    callstk->locals[inst->a] = opstk[sp--]; DISPATCH();
+            do_setglobal:   globals->locals[inst->a] = opstk[sp--]; DISPATCH();
+            do_add_nn:      numericOperation<plus<double>>(*inst); DISPATCH();
+            do_sub_nn:      numericOperation<minus<double>>(*inst); DISPATCH();
+            do_mul_nn:      numericOperation<multiplies<double>>(*inst); DISPATCH();
+            do_div_nn:      numericOperation<divides<double>>(*inst); DISPATCH();
+            do_mod_nn:      numericOperation<fmodOp>(*inst); DISPATCH();
+            do_lt_nn:       numericOperation<less<double>>(*inst); DISPATCH();
+            do_gt_nn:       numericOperation<greater<double>>(*inst); DISPATCH();
+            do_lte_nn:      numericOperation<less_equal<double>>(*inst); DISPATCH();
+            do_gte_nn:      numericOperation<greater_equal<double>>(*inst); DISPATCH();
+            do_eq_nn:       numericOperation<equal_to<double>>(*inst); DISPATCH();
+            do_neq_nn:      numericOperation<not_equal_to<double>>(*inst); DISPATCH();
+            do_concat_ss:   concatStrings(*inst); DISPATCH();
+            do_nop:         DISPATCH();
+            stack_overflow:
+                out()<<"Error: Out of stack space, yo."<<endl;
+            do_halt:
+                haltvm();
+                return;
+            #undef CHECKED_DISPATCH
+            #undef DISPATCH
+        }
+#endif
     public:
-        VM() {
+        VM() : rng(rngSeedFromEnv()) {
+            isolate.bind();
+            output = &cout;
             ip = 0;
             sp = 0;
+            dispatchMode = HAS_COMPUTED_GOTO ? THREADED_DISPATCH:SWITCH_DISPATCH;
             haltSentinel = Instruction(halt);
-            globals =  new ActivationRecord(GLOBAL_SCOPE,0, nullptr, nullptr);
+            pairProfile = nullptr;
+            handlerTable = nullptr;
+            jitCode = nullptr;
+            nativeEnabled = false;
+            jitEnabled = false;
+            jitThreshold = 100;
+            nativeDepth = 0;
+            tailFromNative = false;
+            tailTarget = nullptr;
+            globals =  new ActivationRecord(MAX_LOCAL, GLOBAL_SCOPE, 0, nullptr, nullptr);
             callstk = globals;
         }
         ~VM() {
+            isolate.bind();
+            delete pairProfile;
+            delete jitCode;
             for (int i = MAX_OP_STACK-1; i > -1; i--) {
-                if (opstk[i].type == OBJECT)
-                    alloc.free(opstk[i].objval);
+                if (opstk[i].type() == OBJECT)
+                    currentHeap().free(opstk[i].objval());
             }
             auto x = callstk;
             while (x != nullptr) {
                 auto tmp = x;
                 for (int i = 0; i < 255; i++) {
-                    if (opstk[i].type == OBJECT)
-                        alloc.free(opstk[i].objval);
+                    if (opstk[i].type() == OBJECT)
+                        currentHeap().free(opstk[i].objval());
                 }
                 x = x->control;
                 delete tmp;
             }
         }
+        //makes this VM's heap the one the calling thread allocates from, for hosts building
+        //objects to pass in to apply()
+        void bind() {
+            isolate.bind();
+        }
+        //calls fn with args from the host and runs the interpreter until it returns, giving
+        //back what it returned. Objects in the result may be moved or freed by the collector
+        //once anything else runs, so they are only good until the next call. Natives calling
+        //back into Glaux go through here too, and give up as soon as halted() says a call failed.
+        StackItem apply(StackItem fn, const StackItem* args, int count) {
+            isolate.bind();
+            if (sp + count + 1 >= MAX_OP_STACK - JIT_STACK_MARGIN)
+                return StackItem();
+            ActivationRecord* caller = callstk;
+            int base = sp;
+            for (int i = 0; i < count; i++)
+                opstk[++sp] = args[i];
+            opstk[++sp] = fn;
+            Instruction inst(call, -1, count);
+            running = true;
+            callProcedure(inst);
+            if (running && callstk != caller)
+                invoke(caller);
+            StackItem result = running && sp > base ? opstk[sp]:StackItem();
+            //a call that failed part way through leaves its frames behind
+            while (callstk != caller && callstk->control != nullptr)
+                closeBlock();
+            sp = base;
+            return result;
+        }
+        StackItem apply(StackItem fn, const vector<StackItem>& args) {
+            return apply(fn, args.data(), args.size());
+        }
+        bool halted() {
+            return !running;
+        }
+        //stops the program with an error, for natives given arguments they can't use
+        void fail(string message) {
+            out()<<"Fatal error: "<<message<<endl;
+            running = false;
+        }
+        bool isCallable(StackItem si) {
+            return si.type() == OBJECT && (si.objval()->type == CLOSURE || si.objval()->type == NATIVE);
+        }
+        //frames on the call stack, the globals' included. apply() leaves it as it found it
+        int callDepth() {
+            int depth = 0;
+            for (ActivationRecord* ar = callstk; ar != nullptr; ar = ar->control)
+                depth++;
+            return depth;
+        }
+        StackItem global(int addr) {
+            return addr > -1 && addr < MAX_LOCAL ? globals->locals[addr]:StackItem();
+        }
+        //where print and newline write to, cout unless told otherwise
+        void setOutput(ostream& out) {
+            output = &out;
+        }
+        ostream& out() {
+            return *output;
+        }
         void setConstPool(ConstPool& cp) {
             constPool = cp;
         }
+        void setGCPolicy(GCPolicy policy) {
+            collector.setPolicy(policy);
+        }
+        void printGCStats() {
+            collector.printStats();
+        }
+        //profiling lives in the switch engine, so it turns threaded dispatch off.
+        void enablePairProfile() {
+            if (pairProfile == nullptr)
+                pairProfile = new PairProfile();
+        }
+        void printPairProfile() {
+            if (pairProfile != nullptr)
+                pairProfile->print();
+        }
+        //returns whether native code can actually be generated on this platform
+        bool enableJit(int threshold) {
+            jitEnabled = nativeEnabled = HAS_JIT;
+            jitThreshold = max(1, threshold);
+            return jitEnabled;
+        }
+        void setDispatchMode(DispatchMode mode) {
+            dispatchMode = HAS_COMPUTED_GOTO ? mode:SWITCH_DISPATCH;
+        }
+        //a VM can be handed between threads, but only one may be running it at a time.
         void run(vector<Instruction>& cp, int verbosity) {
+            isolate.bind();
             init(cp, verbosity);
             running = true;
-            while (running) {
-                if (sp >= MAX_OP_STACK) {
-                    cout<<"Error: Out of stack space, yo."<<endl;
-                    running = false;
-                    break;
-                }
-                Instruction inst = fetch();
-                if (verbosity > 0) {
-                    printInstruction(inst);
-                    cout<<"----------------"<<endl;
-                }
-                execute(inst);
-                if (verbosity > 1) {
-                    cout<<"----------------"<<endl;                
-                    printOperandStack();
-                }
-                if (verbosity > 2) {
-                    printCallStack();
-                }
-                if (verbosity > 0) cout<<"================"<<endl;
-            }
+            interpret();
+            collector.run(callstk, opstk, sp, &constPool);
+        }
+        //runs a program compiled ahead of time, 'entry' is the native code for its top level
+        void runCompiled(vector<Instruction>& cp, NativeCode entry) {
+            isolate.bind();
+            init(cp, 0);
+            running = true;
+            nativeEnabled = true;
+            entry(this);
+            if (running)
+                interpret();
             collector.run(callstk, opstk, sp, &constPool);
         }
 };